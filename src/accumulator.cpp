@@ -0,0 +1,61 @@
+#include "accumulator.h"
+
+ScoreAccumulator::ScoreAccumulator() {}
+
+void ScoreAccumulator::Reserve(std::size_t tokenCount) {
+    if (tokenCount <= mScores.size()) 
+        return;
+    
+    mScores.resize(tokenCount, 0.0);
+    mTouchedFlag.resize(tokenCount, 0);
+    mTouched.reserve(tokenCount);
+}
+
+void ScoreAccumulator::Add(int token, double weight) {
+    if (token < 0) 
+        return;
+    
+    std::size_t index = static_cast<std::size_t>(token);
+    if (index >= mScores.size()) {
+        // Grow geometrically so a slowly increasing vocabulary stays amortized.
+        std::size_t grow = mScores.size() * 2;
+        Reserve(grow > index ? grow : index + 1);
+    }
+    
+    if (!mTouchedFlag[index]) {
+        mTouchedFlag[index] = 1;
+        mTouched.push_back(token);
+    }
+    mScores[index] += weight;
+}
+
+double ScoreAccumulator::Get(int token) const {
+    if (token < 0 || static_cast<std::size_t>(token) >= mScores.size()) 
+        return 0.0;
+    return mScores[static_cast<std::size_t>(token)];
+}
+
+void ScoreAccumulator::Clear(void) {
+    for (std::size_t i = 0; i < mTouched.size(); ++i) {
+        std::size_t index = static_cast<std::size_t>(mTouched[i]);
+        mScores[index]      = 0.0;
+        mTouchedFlag[index] = 0;
+    }
+    mTouched.clear();
+}
+
+bool ScoreAccumulator::empty(void) const {
+    return mTouched.empty();
+}
+
+std::size_t ScoreAccumulator::size(void) const {
+    return mTouched.size();
+}
+
+int ScoreAccumulator::GetToken(std::size_t i) const {
+    return mTouched[i];
+}
+
+double ScoreAccumulator::GetScore(std::size_t i) const {
+    return mScores[static_cast<std::size_t>(mTouched[i])];
+}
@@ -0,0 +1,46 @@
+#ifndef _SCORE_ACCUMULATOR__
+#define _SCORE_ACCUMULATOR__
+
+#include <vector>
+#include <cstddef>
+
+// Dense per-token score table. Scores live in a vector indexed by token id
+// and the touched tokens are listed in first-touch order, so iterating and
+// clearing both cost O(touched) instead of O(vocabulary). The table only
+// grows, so reusing one accumulator does not allocate once it has seen the
+// largest token id.
+class ScoreAccumulator {
+public:
+    
+    ScoreAccumulator();
+    
+    // Make room for token ids below tokenCount.
+    void Reserve(std::size_t tokenCount);
+    
+    // Add weight to a token's score.
+    void Add(int token, double weight);
+    
+    // Score of a token, 0 if untouched.
+    double Get(int token) const;
+    
+    // Reset every touched score.
+    void Clear(void);
+    
+    bool empty(void) const;
+    
+    // Number of touched tokens.
+    std::size_t size(void) const;
+    
+    // The i-th touched token and its score.
+    int GetToken(std::size_t i) const;
+    double GetScore(std::size_t i) const;
+    
+private:
+    
+    std::vector<double> mScores;
+    std::vector<unsigned char> mTouchedFlag;
+    std::vector<int> mTouched;
+    
+};
+
+#endif
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <unordered_set>
+#include <algorithm>
 
 void AttentionSystem::ProcessSequence(const std::vector<int>& tokens) {
     const int N = (int)tokens.size();
@@ -15,6 +16,8 @@ void AttentionSystem::ProcessSequence(const std::vector<int>& tokens) {
     
     updateStep++;
     
+    MarkIndexDirty();
+    
     for (unsigned int h = 0; h < (unsigned int)windowRadius; h++) {
         
         // Pick a random anchor index
@@ -70,6 +73,8 @@ static unsigned int HalfCeil(unsigned int v) {
 }
 
 void AttentionSystem::RenormalizeAll(float weightScale) {
+    MarkIndexDirty();
+    
     // Scale edge data
     for (std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::iterator it = attention.begin();
          it != attention.end(); ++it) {
@@ -91,6 +96,7 @@ void AttentionSystem::Clear() {
     attention.clear();
     tokenStats.clear();
     updateStep = 0u;
+    MarkIndexDirty();
 }
 
 // Return weight for a specific (anchor, candidate, offset) triple.
@@ -153,6 +159,124 @@ float AttentionSystem::GetScore(const std::vector<int>& context, int token_j) co
     return totalScore / totalWeight;
 }
 
+void AttentionSystem::GetScores(const std::vector<int>& context,
+                                float horizonEpsilon,
+                                AttentionScores& out) const {
+    out.Clear();
+    if (context.empty()) {
+        return;
+    }
+    
+    BuildAnchorIndex();
+    
+    const float decay = 0.7f;
+    
+    float w = 1.0f;
+    const int nextIndex = (int)context.size();
+    
+    // Same walk as GetScore(context, token), but each anchor hands its whole
+    // row to every neighbor instead of being probed once per candidate.
+    for (int i = (int)context.size() - 1; i >= 0; --i) {
+        if (w < horizonEpsilon || w <= 0.0f) {
+            break; // nothing further back can contribute
+        }
+        
+        int anchor = context[(unsigned int)i];
+        int offset = nextIndex - i;
+        
+        if (anchor >= 0 && anchor + 1 < (int)mRowStart.size()) {
+            std::vector<AttentionRow>::const_iterator first = mRows.begin() + mRowStart[(unsigned int)anchor];
+            std::vector<AttentionRow>::const_iterator last  = mRows.begin() + mRowStart[(unsigned int)anchor + 1u];
+            std::vector<AttentionRow>::const_iterator row =
+                std::lower_bound(first, last, offset,
+                                 [](const AttentionRow& r, int value) { return r.offset < value; });
+            
+            if (row != last && row->offset == offset) {
+                for (unsigned int e = row->begin; e < row->end; ++e) {
+                    float s = mRowWeight[e];
+                    if (s != 0.0f) {
+                        out.Add(mRowNeighbor[e], s * w, w);
+                    }
+                }
+            }
+        }
+        
+        w *= decay;
+    }
+}
+
+void AttentionSystem::MarkIndexDirty(void) {
+    mIndexDirty = true;
+}
+
+void AttentionSystem::BuildAnchorIndex(void) const {
+    if (!mIndexDirty) {
+        return;
+    }
+    
+    struct Entry {
+        int   anchor;
+        int   offset;
+        int   neighbor;
+        float weight;
+    };
+    
+    std::vector<Entry> entries;
+    entries.reserve(attention.size());
+    
+    int maxAnchor = -1;
+    for (std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::const_iterator it =
+             attention.begin();
+         it != attention.end(); ++it) {
+        const AttentionKey &k = it->first;
+        if (k.anchor < 0) {
+            continue;
+        }
+        Entry entry = {k.anchor, k.offset, k.neighbor, it->second.weight};
+        entries.push_back(entry);
+        if (k.anchor > maxAnchor) {
+            maxAnchor = k.anchor;
+        }
+    }
+    
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) {
+                  if (a.anchor != b.anchor) return a.anchor < b.anchor;
+                  if (a.offset != b.offset) return a.offset < b.offset;
+                  return a.neighbor < b.neighbor;
+              });
+    
+    mRowStart.assign((std::size_t)(maxAnchor + 2), 0u);
+    mRows.clear();
+    mRowNeighbor.resize(entries.size());
+    mRowWeight.resize(entries.size());
+    
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        const Entry& e = entries[i];
+        
+        if (i == 0 ||
+            entries[i - 1].anchor != e.anchor ||
+            entries[i - 1].offset != e.offset) {
+            AttentionRow row = {e.offset, (unsigned int)i, (unsigned int)i};
+            mRows.push_back(row);
+            mRowStart[(std::size_t)e.anchor + 1u] = (unsigned int)mRows.size();
+        }
+        
+        mRows.back().end = (unsigned int)i + 1u;
+        mRowNeighbor[i] = e.neighbor;
+        mRowWeight[i]   = e.weight;
+    }
+    
+    // Anchors without rows start where the previous anchor ended.
+    for (std::size_t a = 1; a < mRowStart.size(); ++a) {
+        if (mRowStart[a] < mRowStart[a - 1]) {
+            mRowStart[a] = mRowStart[a - 1];
+        }
+    }
+    
+    mIndexDirty = false;
+}
+
 int AttentionSystem::GetNextToken(const std::vector<int>& context,
                                   const std::vector<int>& allTokens) {
     int   bestToken = -1;
@@ -171,6 +295,8 @@ int AttentionSystem::GetNextToken(const std::vector<int>& context,
 }
 
 void AttentionSystem::NormalizeWeightsPerAnchor() {
+    MarkIndexDirty();
+    
     // First, accumulate total weight per anchor.
     std::unordered_map<int, float> sumPerAnchor;
     for (std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::const_iterator it =
@@ -194,6 +320,7 @@ void AttentionSystem::NormalizeWeightsPerAnchor() {
 
 // Set a specific (tokenA, tokenB, offset) score.
 void AttentionSystem::SetScore(int tokenA, int tokenB, int offset, float score) {
+    MarkIndexDirty();
     AttentionKey key{tokenA, tokenB, offset};
     AttentionEdge &edge = attention[key];
     edge.weight = score;
@@ -204,6 +331,8 @@ void AttentionSystem::SetScore(int tokenA, int tokenB, int offset, float score)
 
 // Set aggregate score for (tokenA, tokenB) by distributing across existing offsets.
 void AttentionSystem::SetScore(int tokenA, int tokenB, float score) {
+    MarkIndexDirty();
+    
     // Count how many offsets exist for (tokenA, tokenB).
     float count = 0.0f;
     for (std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::const_iterator it =
@@ -231,6 +360,7 @@ void AttentionSystem::SetScore(int tokenA, int tokenB, float score) {
 
 // Scale a specific (tokenA, tokenB, offset) association.
 void AttentionSystem::AdjustScore(int tokenA, int tokenB, int offset, float multiplier) {
+    MarkIndexDirty();
     AttentionKey key{tokenA, tokenB, offset};
     std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::iterator it =
         attention.find(key);
@@ -243,6 +373,7 @@ void AttentionSystem::AdjustScore(int tokenA, int tokenB, int offset, float mult
 
 // Scale all offsets for (tokenA, tokenB).
 void AttentionSystem::AdjustScore(int tokenA, int tokenB, float multiplier) {
+    MarkIndexDirty();
     for (std::unordered_map<AttentionKey, AttentionEdge, AttentionKeyHash>::iterator it =
              attention.begin();
          it != attention.end(); ++it) {
@@ -582,3 +713,43 @@ bool AttentionSystem::LoadFromFile(const std::string& filename) {
     
     return true;
 }
+
+float AttentionScores::Get(int token) const {
+    if (token < 0 || token >= (int)mWeight.size()) {
+        return 0.0f;
+    }
+    float weight = mWeight[(unsigned int)token];
+    if (weight <= 0.0f) {
+        return 0.0f;
+    }
+    return mScore[(unsigned int)token] / weight;
+}
+
+void AttentionScores::Clear(void) {
+    for (std::size_t i = 0; i < mTouched.size(); ++i) {
+        unsigned int token = (unsigned int)mTouched[i];
+        mScore[token]  = 0.0f;
+        mWeight[token] = 0.0f;
+    }
+    mTouched.clear();
+}
+
+void AttentionScores::Add(int token, float score, float weight) {
+    if (token < 0) {
+        return;
+    }
+    if (token >= (int)mWeight.size()) {
+        std::size_t grow = mWeight.size() * 2;
+        if (grow <= (std::size_t)token) {
+            grow = (std::size_t)token + 1u;
+        }
+        mScore.resize(grow, 0.0f);
+        mWeight.resize(grow, 0.0f);
+    }
+    
+    if (mWeight[(unsigned int)token] == 0.0f) {
+        mTouched.push_back(token);
+    }
+    mScore[(unsigned int)token]  += score;
+    mWeight[(unsigned int)token] += weight;
+}
@@ -92,6 +92,35 @@ struct TokenInfo {
     {}
 };
 
+// One (anchor, offset) row of the anchor-major index: its neighbors sit in
+// [begin, end) of the flat neighbor/weight arrays.
+struct AttentionRow {
+    int          offset;
+    unsigned int begin;
+    unsigned int end;
+};
+
+// Per-token results of scoring a whole context at once. Accumulates the
+// same weighted sums GetScore(context, token) builds for one token, for
+// every token reachable from the context.
+class AttentionScores {
+public:
+    
+    // Score of a token, 0 if no anchor reaches it.
+    float Get(int token) const;
+    
+    // Reset every touched token.
+    void Clear(void);
+    
+private:
+    friend class AttentionSystem;
+    
+    void Add(int token, float score, float weight);
+    
+    std::vector<float> mScore;
+    std::vector<float> mWeight;
+    std::vector<int>   mTouched;
+};
 
 class AttentionSystem {
 public:
@@ -113,7 +142,8 @@ public:
         : n_points(16),
           baseWeight(1.0f),
           falloff(0.5f),
-          updateStep(0u)
+          updateStep(0u),
+          mIndexDirty(true)
     {}
     
     // Learn from a sequence of tokens.
@@ -135,6 +165,15 @@ public:
     // the proper offset (next position index - anchor index).
     float GetScore(const std::vector<int>& context, int token_j) const;
     
+    // Score every candidate at once: walk the context a single time and
+    // scatter each anchor's row at the matching offset into out. Gives the
+    // same value as GetScore(context, token) for every token. Anchors whose
+    // decay weight (0.7 per step back) falls below horizonEpsilon are
+    // skipped; 0 keeps the whole context.
+    void GetScores(const std::vector<int>& context,
+                   float horizonEpsilon,
+                   AttentionScores& out) const;
+    
     // Pick highest-scoring candidate from a list.
     int GetNextToken(const std::vector<int>& context,
                      const std::vector<int>& allTokens);
@@ -177,6 +216,23 @@ public:
     
     // Load the attention scoring data from a file.
     bool LoadFromFile(const std::string& filename);
+    
+    // Call after editing the attention map directly; the member functions
+    // above already do.
+    void MarkIndexDirty(void);
+    
+private:
+    
+    // Rebuild the anchor-major index from the attention map if stale.
+    void BuildAnchorIndex(void) const;
+    
+    // Anchor-major copy of the attention map: the rows of anchor a are
+    // mRows[mRowStart[a], mRowStart[a + 1]), sorted by offset.
+    mutable std::vector<unsigned int> mRowStart;
+    mutable std::vector<AttentionRow> mRows;
+    mutable std::vector<int>          mRowNeighbor;
+    mutable std::vector<float>        mRowWeight;
+    mutable bool                      mIndexDirty;
 };
 
 #endif
@@ -1,38 +1,357 @@
 #include "embedding.h"
+#include "kernels.h"
+#include "workerpool.h"
 
 #include <fstream>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <math.h>
 
-EmbeddingSystem::EmbeddingSystem() {
+// Leading word of files that carry a width; older files start with the count.
+static const std::uint32_t EMBEDDING_FILE_MAGIC = 0x57424D45u; // "EMBW"
+
+// Leading word of files that also carry a precision.
+static const std::uint32_t EMBEDDING_FILE_MAGIC_QUANTIZED = 0x51424D45u; // "EMBQ"
+
+// A deferred row folds its pending scale in once the scale leaves
+// [MIN, 1 / MIN], keeping the stored values well inside float range.
+static const double EMBEDDING_PENDING_SCALE_MIN = 1e-6;
+
+// Upper bound on a width read from a file, to reject corrupt headers.
+static const std::uint32_t EMBEDDING_MAX_WIDTH = 4096u;
+
+// Upper bound on a token id read from a file. Rows are indexed by id, so a
+// corrupt id would otherwise size the matrix to match.
+static const std::int32_t EMBEDDING_MAX_TOKENS = 1 << 24;
+
+static std::size_t BytesPerValue(int precision) {
+    switch (precision) {
+        case EMBEDDING_FP16: return 2u;
+        case EMBEDDING_INT8: return 1u;
+        default:             return 4u;
+    }
+}
+
+// Rows are padded to whole 64-byte blocks.
+static std::size_t BlocksForRow(int width, int precision) {
+    return (static_cast<std::size_t>(width) * BytesPerValue(precision) + 63u) / 64u;
+}
+
+EmbeddingSystem::EmbeddingSystem() : 
+    mWidth(EMBEDDING_DEFAULT_WIDTH),
+    mPrecision(EMBEDDING_FP32),
+    mRowBlocks(BlocksForRow(EMBEDDING_DEFAULT_WIDTH, EMBEDDING_FP32)),
+    mRowCount(0),
+    mDirtyCount(0),
+    mDeferNormalize(false),
+    mCount(0),
+    mVersion(0u),
+    mRowWrites(0u) {
 }
 
 void EmbeddingSystem::Clear(void) {
-    mEmbeddings.clear();
+    mRows.clear();
+    mScale.clear();
+    mPresent.clear();
+    mNorm.clear();
+    mRowVersion.clear();
+    mDirty.clear();
+    mPendingScale.clear();
+    mPendingNormSq.clear();
+    mDirtyCount = 0;
+    mRowCount = 0;
+    mCount = 0;
+    mVersion++;
+}
+
+void EmbeddingSystem::SetWidth(int width) {
+    if (width < 1) 
+        width = 1;
+    Clear();
+    mWidth     = width;
+    mRowBlocks = BlocksForRow(mWidth, mPrecision);
+}
+
+int EmbeddingSystem::GetWidth(void) const {
+    return mWidth;
+}
+
+void EmbeddingSystem::SetPrecision(int precision) {
+    if (precision != EMBEDDING_FP16 && precision != EMBEDDING_INT8) 
+        precision = EMBEDDING_FP32;
+    if (precision == mPrecision) 
+        return;
+    
+    FlushNormalization();
+    
+    // Move the rows aside, then write each one back at the new precision.
+    EmbeddingSystem source;
+    source.mWidth     = mWidth;
+    source.mPrecision = mPrecision;
+    source.mRowBlocks = mRowBlocks;
+    source.mRowCount  = mRowCount;
+    source.mRows.swap(mRows);
+    source.mScale.swap(mScale);
+    source.mPresent   = mPresent;
+    
+    const std::size_t rowCount = mRowCount;
+    Clear();
+    mPrecision = precision;
+    mRowBlocks = BlocksForRow(mWidth, mPrecision);
+    
+    std::vector<float> row(static_cast<std::size_t>(mWidth));
+    for (std::size_t r = 0; r < rowCount; ++r) {
+        int token = static_cast<int>(r);
+        if (!source.IsPresent(token)) 
+            continue;
+        source.ReadRow(token, row.data());
+        Reserve(token);
+        SetPresent(token);
+        WriteRow(token, row.data());
+    }
+}
+
+int EmbeddingSystem::GetPrecision(void) const {
+    return mPrecision;
+}
+
+std::size_t EmbeddingSystem::GetMemoryUsage(void) const {
+    return mRows.capacity()    * sizeof(EmbeddingBlock) + 
+           mScale.capacity()   * sizeof(float) + 
+           mNorm.capacity()    * sizeof(float) + 
+           mRowVersion.capacity() * sizeof(unsigned int) + 
+           mDirty.capacity()   * sizeof(std::uint64_t) + 
+           (mPendingScale.capacity() + mPendingNormSq.capacity()) * sizeof(double) + 
+           mPresent.capacity() * sizeof(std::uint64_t);
+}
+
+void EmbeddingSystem::Reserve(int token) {
+    std::size_t rows = static_cast<std::size_t>(token) + 1;
+    if (rows <= mRowCount) 
+        return;
+    
+    // Grow geometrically so streaming in new tokens stays amortized O(1).
+    std::size_t capacity = mRows.capacity() / mRowBlocks;
+    if (rows > capacity) 
+        mRows.reserve(std::max(rows, capacity * 2) * mRowBlocks);
+    
+    EmbeddingBlock zero = EmbeddingBlock();
+    mRows.resize(rows * mRowBlocks, zero);
+    if (mPrecision == EMBEDDING_INT8) 
+        mScale.resize(rows, 0.0f);
+    mNorm.resize(rows, 0.0f);
+    mRowVersion.resize(rows, 0u);
+    mDirty.resize((rows + 63) / 64, 0u);
+    mPendingScale.resize(rows, 1.0);
+    mPendingNormSq.resize(rows, 0.0);
+    mPresent.resize((rows + 63) / 64, 0u);
+    mRowCount = rows;
+}
+
+bool EmbeddingSystem::IsPresent(int token) const {
+    if (token < 0 || static_cast<std::size_t>(token) >= mRowCount) 
+        return false;
+    return (mPresent[static_cast<std::size_t>(token) >> 6] >> (token & 63)) & 1u;
+}
+
+void EmbeddingSystem::SetPresent(int token) {
+    if (IsPresent(token)) 
+        return;
+    mPresent[static_cast<std::size_t>(token) >> 6] |= (std::uint64_t(1) << (token & 63));
+    mCount++;
+}
+
+unsigned char* EmbeddingSystem::GetRow(int token) {
+    return mRows[static_cast<std::size_t>(token) * mRowBlocks].bytes;
+}
+
+const unsigned char* EmbeddingSystem::GetRow(int token) const {
+    return mRows[static_cast<std::size_t>(token) * mRowBlocks].bytes;
+}
+
+void EmbeddingSystem::ReadRow(int token, float* out) const {
+    const unsigned char* row = GetRow(token);
+    
+    if (mPrecision == EMBEDDING_FP16) {
+        KernelHalfToFloat(reinterpret_cast<const std::uint16_t*>(row), out, mWidth);
+    } else if (mPrecision == EMBEDDING_INT8) {
+        const std::int8_t* values = reinterpret_cast<const std::int8_t*>(row);
+        float scale = mScale[static_cast<std::size_t>(token)];
+        for (int d = 0; d < mWidth; ++d) 
+            out[d] = static_cast<float>(values[d]) * scale;
+    } else {
+        std::memcpy(out, row, sizeof(float) * static_cast<std::size_t>(mWidth));
+    }
+}
+
+void EmbeddingSystem::WriteRow(int token, const float* in) {
+    StoreRow(token, in);
+    UpdateNorm(token);
+}
+
+void EmbeddingSystem::StoreRow(int token, const float* in) {
+    unsigned char* row = GetRow(token);
+    
+    if (mPrecision == EMBEDDING_FP16) {
+        KernelFloatToHalf(in, reinterpret_cast<std::uint16_t*>(row), mWidth);
+    } else if (mPrecision == EMBEDDING_INT8) {
+        // Symmetric per-row scale: the largest magnitude maps to 127.
+        float maxAbs = 0.0f;
+        for (int d = 0; d < mWidth; ++d) 
+            maxAbs = std::max(maxAbs, std::fabs(in[d]));
+        
+        float scale = (maxAbs > 0.0f) ? maxAbs / 127.0f : 0.0f;
+        float inv   = (maxAbs > 0.0f) ? 127.0f / maxAbs : 0.0f;
+        std::int8_t* values = reinterpret_cast<std::int8_t*>(row);
+        for (int d = 0; d < mWidth; ++d) {
+            float q = std::floor(in[d] * inv + 0.5f);
+            values[d] = static_cast<std::int8_t>(std::max(-127.0f, std::min(127.0f, q)));
+        }
+        mScale[static_cast<std::size_t>(token)] = scale;
+    } else {
+        std::memcpy(row, in, sizeof(float) * static_cast<std::size_t>(mWidth));
+    }
+}
+
+void EmbeddingSystem::UpdateNorm(int token) {
+    mNorm[static_cast<std::size_t>(token)] = ComputeNorm(token);
+    mRowVersion[static_cast<std::size_t>(token)] = ++mRowWrites;
+}
+
+float EmbeddingSystem::ComputeNorm(int token) const {
+    float magSq;
+    if (mPrecision == EMBEDDING_FP32) {
+        magSq = KernelSquaredNorm(reinterpret_cast<const float*>(GetRow(token)), mWidth);
+    } else {
+        // Norm of what the kernels will actually see.
+        std::vector<float> row(static_cast<std::size_t>(mWidth));
+        ReadRow(token, row.data());
+        magSq = KernelSquaredNorm(row.data(), mWidth);
+    }
+    
+    return std::sqrt(magSq);
 }
 
 void EmbeddingSystem::AddEmbedding(int token, const Embedding& emb) {
-    mEmbeddings[token] = emb;
+    if (token < 0 || emb.v.size() != static_cast<std::size_t>(mWidth)) 
+        return;
+    
+    Reserve(token);
+    SetPresent(token);
+    ClearDirty(token);
+    WriteRow(token, emb.v.data());
+    mVersion++;
 }
 
 void EmbeddingSystem::AddEmbedding(int token) {
     // If we already have an embedding for this token, don't overwrite it.
-    if (mEmbeddings.find(token) != mEmbeddings.end()) 
+    if (IsPresent(token)) 
         return;
     
     Embedding embedding;
+    embedding.v.resize(static_cast<std::size_t>(mWidth));
     
     // Simple random init in a small range  (-0.1 - 0.1)
-    for (int i = 0; i < EMBEDDING_WIDTH; ++i) {
+    for (int i = 0; i < mWidth; ++i) {
         float r = static_cast<float>(std::rand()) / static_cast<float>(RAND_MAX);
         embedding.v[i] = r * 0.2f - 0.1f;
     }
     
-    mEmbeddings[token] = embedding;
+    AddEmbedding(token, embedding);
+}
+
+void EmbeddingSystem::BumpTarget(const std::vector<int>& tokens, 
+                                 int i, 
+                                 int windowSize, 
+                                 float strength, 
+                                 float* targetEmb) const {
+    // Define the local window
+    int start = std::max(0, i - windowSize);
+    int end = std::min((int)tokens.size() - 1, i + windowSize);
+    
+    for (int j = start; j <= end; ++j) {
+        if (i == j) continue; // Don't train on yourself
+        
+        int neighborToken = tokens[j];
+        
+        // Closer words have more semantic influence
+        // Linear decay: 1.0 for immediate neighbors, decreasing as distance increases
+        float distance = (float)std::abs(i - j);
+        float weight = strength * (1.0f - (distance / (float)(windowSize + 1)));
+        
+        // High-Frequency Dimension Mapping via a simple hash with a secondary salt to reduce collisions
+        unsigned int dim = (unsigned int)(neighborToken * 2654435761u) % (unsigned int)mWidth;
+        
+        // 3. The "Bumping" Logic we increment the dimension
+        targetEmb[dim] += weight;
+        
+        // optional; Slightly penalize the neighbor's dimension in "rival" categories to keep the vectors sparse and distinct.
+        unsigned int antiDim = (dim + (unsigned int)(mWidth / 2)) % (unsigned int)mWidth;
+        targetEmb[antiDim] -= (weight * 0.2f);
+    }
+}
+
+void EmbeddingSystem::BumpTargetScaled(const std::vector<int>& tokens, 
+                                       int i, 
+                                       int windowSize, 
+                                       float strength, 
+                                       float* targetEmb, 
+                                       double invScale, 
+                                       double& normSq) const {
+    int start = std::max(0, i - windowSize);
+    int end = std::min((int)tokens.size() - 1, i + windowSize);
+    
+    for (int j = start; j <= end; ++j) {
+        if (i == j) continue;
+        
+        // Same weights and dimensions as BumpTarget.
+        float distance = (float)std::abs(i - j);
+        float weight = strength * (1.0f - (distance / (float)(windowSize + 1)));
+        
+        unsigned int dim = (unsigned int)(tokens[j] * 2654435761u) % (unsigned int)mWidth;
+        unsigned int antiDim = (dim + (unsigned int)(mWidth / 2)) % (unsigned int)mWidth;
+        
+        float before = targetEmb[dim];
+        targetEmb[dim] += static_cast<float>(weight * invScale);
+        normSq += (double)targetEmb[dim] * targetEmb[dim] - (double)before * before;
+        
+        before = targetEmb[antiDim];
+        targetEmb[antiDim] -= static_cast<float>(weight * 0.2f * invScale);
+        normSq += (double)targetEmb[antiDim] * targetEmb[antiDim] - (double)before * before;
+    }
 }
 
 void EmbeddingSystem::TrainOnSentence(const std::vector<int>& tokens, int windowSize, float strength) {
     if (tokens.size() < 2) return;
+    mVersion++;
+    
+    if (mDeferNormalize && mPrecision == EMBEDDING_FP32) {
+        int maxToken = -1;
+        for (std::size_t i = 0; i < tokens.size(); ++i) 
+            if (tokens[i] > maxToken) maxToken = tokens[i];
+        if (maxToken >= 0) 
+            Reserve(maxToken);
+        
+        for (std::size_t i = 0; i < tokens.size(); ++i) {
+            AddEmbedding(tokens[i]);
+            if (HasEmbedding(tokens[i])) 
+                MarkDirty(tokens[i]);
+        }
+        TrainSentenceDeferred(tokens, windowSize, strength);
+        return;
+    }
+    
+    // Size the matrix once up front so rows stay put while we write them.
+    int maxToken = -1;
+    for (std::size_t i = 0; i < tokens.size(); ++i) 
+        if (tokens[i] > maxToken) maxToken = tokens[i];
+    if (maxToken >= 0) 
+        Reserve(maxToken);
+    
+    std::vector<float> scratch;
+    
     for (int i = 0; i < (int)tokens.size(); ++i) {
         int targetToken = tokens[i];
         
@@ -41,102 +360,444 @@ void EmbeddingSystem::TrainOnSentence(const std::vector<int>& tokens, int window
             AddEmbedding(targetToken); 
         }
         
-        Embedding& targetEmb = mEmbeddings[targetToken];
+        if (!HasEmbedding(targetToken)) 
+            continue; // negative ids have no row
+        
+        // Quantized rows are bumped in a float copy and written back.
+        const bool quantized = (mPrecision != EMBEDDING_FP32);
+        float* targetEmb;
+        if (quantized) {
+            scratch.resize(static_cast<std::size_t>(mWidth));
+            ReadRow(targetToken, scratch.data());
+            targetEmb = scratch.data();
+        } else {
+            targetEmb = reinterpret_cast<float*>(GetRow(targetToken));
+        }
+        
+        BumpTarget(tokens, i, windowSize, strength, targetEmb);
         
-        // Define the local window
-        int start = std::max(0, i - windowSize);
-        int end = std::min((int)tokens.size() - 1, i + windowSize);
+        if (quantized) 
+            WriteRow(targetToken, targetEmb);
+    }
+    
+    // Post-Training Normalization, left to the flush when deferring.
+    for (int i = 0; i < (int)tokens.size(); ++i) {
+        if (!mDeferNormalize) 
+            Normalize(tokens[i]);
+        else if (HasEmbedding(tokens[i])) 
+            MarkDirty(tokens[i]);
+    }
+}
+
+void EmbeddingSystem::TrainOnSentences(const std::vector<std::vector<int>>& sentences, 
+                                       std::size_t first, 
+                                       std::size_t last, 
+                                       int windowSize, 
+                                       float strength, 
+                                       WorkerPool& pool) {
+    if (last > sentences.size()) 
+        last = sentences.size();
+    if (first >= last) 
+        return;
+    mVersion++;
+    
+    // Serial setup. Missing rows are created in the order TrainOnSentence
+    // would create them, and the matrix is sized once so no row moves while
+    // the workers write into it. A caller that draws from std::rand()
+    // between sentences must create the rows itself to keep the stream.
+    int maxToken = -1;
+    for (std::size_t s = first; s < last; ++s) 
+        for (std::size_t i = 0; i < sentences[s].size(); ++i) 
+            maxToken = std::max(maxToken, sentences[s][i]);
+    if (maxToken < 0) 
+        return;
+    Reserve(maxToken);
+    
+    // Rows are marked dirty here, before the threads start, so the bitmap
+    // is never written concurrently.
+    for (std::size_t s = first; s < last; ++s) {
+        const std::vector<int>& tokens = sentences[s];
+        if (tokens.size() < 2) 
+            continue;
+        for (std::size_t i = 0; i < tokens.size(); ++i) {
+            AddEmbedding(tokens[i]);
+            if (HasEmbedding(tokens[i])) 
+                MarkDirty(tokens[i]);
+        }
+    }
+    
+    // Hogwild: each thread takes a contiguous run of sentences and bumps the
+    // shared rows without locks, as word2vec does. Two threads racing on one
+    // row can lose a bump; at these rates that is noise. fp32 rows take the
+    // deferred per-sentence normalization; quantized rows are only
+    // normalized at the flush. Racing on a quantized row would tear it
+    // instead: an int8 row is rescaled as a whole on every store, so those
+    // run as a single job.
+    const bool quantized = (mPrecision != EMBEDDING_FP32);
+    const unsigned int threadCount = quantized ? 1u : pool.GetThreadCount();
+    const std::size_t sentenceChunk = (last - first + threadCount - 1) / threadCount;
+    
+    pool.Run(threadCount, [&](unsigned int chunk) {
+        std::size_t begin = first + chunk * sentenceChunk;
+        std::size_t end   = std::min(begin + sentenceChunk, last);
+        std::vector<float> scratch(quantized ? static_cast<std::size_t>(mWidth) : 0u);
         
-        for (int j = start; j <= end; ++j) {
-            if (i == j) continue; // Don't train on yourself
-            
-            int neighborToken = tokens[j];
-            
-            // Closer words have more semantic influence
-            // Linear decay: 1.0 for immediate neighbors, decreasing as distance increases
-            float distance = (float)std::abs(i - j);
-            float weight = strength * (1.0f - (distance / (float)(windowSize + 1)));
-            
-            // High-Frequency Dimension Mapping via a simple hash with a secondary salt to reduce collisions
-            unsigned int dim = (unsigned int)(neighborToken * 2654435761u) % EMBEDDING_WIDTH;
+        for (std::size_t s = begin; s < end; ++s) {
+            const std::vector<int>& tokens = sentences[s];
+            if (tokens.size() < 2) 
+                continue;
+            int window = (windowSize > 0) ? windowSize : static_cast<int>(tokens.size());
             
-            // 3. The "Bumping" Logic we increment the dimension
-            targetEmb.v[dim] += weight;
+            if (!quantized) {
+                TrainSentenceDeferred(tokens, window, strength);
+                continue;
+            }
             
-            // optional; Slightly penalize the neighbor's dimension in "rival" categories to keep the vectors sparse and distinct.
-            unsigned int antiDim = (dim + (EMBEDDING_WIDTH / 2)) % EMBEDDING_WIDTH;
-            targetEmb.v[antiDim] -= (weight * 0.2f);
+            for (int i = 0; i < static_cast<int>(tokens.size()); ++i) {
+                int targetToken = tokens[i];
+                if (!IsPresent(targetToken)) 
+                    continue;
+                
+                ReadRow(targetToken, scratch.data());
+                BumpTarget(tokens, i, window, strength, scratch.data());
+                StoreRow(targetToken, scratch.data());
+            }
+        }
+    });
+    
+    if (!mDeferNormalize) 
+        FlushNormalization(pool);
+}
+
+void EmbeddingSystem::SetDeferredNormalization(bool defer) {
+    if (!defer) 
+        FlushNormalization();
+    mDeferNormalize = defer;
+}
+
+bool EmbeddingSystem::GetDeferredNormalization(void) const {
+    return mDeferNormalize;
+}
+
+std::size_t EmbeddingSystem::GetDirtyCount(void) const {
+    return mDirtyCount;
+}
+
+void EmbeddingSystem::FlushNormalization(void) {
+    WorkerPool serial;
+    FlushNormalization(serial);
+}
+
+void EmbeddingSystem::FlushNormalization(WorkerPool& pool) {
+    if (mDirtyCount == 0) 
+        return;
+    mVersion++;
+    
+    std::vector<int> dirty;
+    dirty.reserve(mDirtyCount);
+    for (std::size_t w = 0; w < mDirty.size(); ++w) {
+        std::uint64_t word = mDirty[w];
+        while (word != 0u) {
+            int bit = __builtin_ctzll(word);
+            dirty.push_back(static_cast<int>(w * 64 + static_cast<std::size_t>(bit)));
+            word &= word - 1u;
         }
+        mDirty[w] = 0u;
     }
     
-    // Post-Training Normalization
-    for (int i = 0; i < (int)tokens.size(); ++i) {
-        Normalize(tokens[i]);
+    // Fold in the pending scale, then normalize. Rows are split across
+    // threads so no two threads share one.
+    const unsigned int threadCount = pool.GetThreadCount();
+    const std::size_t rowChunk = (dirty.size() + threadCount - 1) / threadCount;
+    
+    pool.Run(threadCount, [&](unsigned int chunk) {
+        std::size_t begin = chunk * rowChunk;
+        std::size_t end   = std::min(begin + rowChunk, dirty.size());
+        std::vector<float> scratch;
+        for (std::size_t k = begin; k < end; ++k) {
+            std::size_t token = static_cast<std::size_t>(dirty[k]);
+            if (mPrecision == EMBEDDING_FP32 && mPendingScale[token] != 1.0) {
+                KernelScale(static_cast<float>(mPendingScale[token]), 
+                            reinterpret_cast<float*>(GetRow(dirty[k])), mWidth);
+                mPendingScale[token] = 1.0;
+            }
+            NormalizeRow(dirty[k], scratch);
+        }
+    });
+    
+    for (std::size_t k = 0; k < dirty.size(); ++k) 
+        mRowVersion[static_cast<std::size_t>(dirty[k])] = ++mRowWrites;
+    mDirtyCount = 0;
+}
+
+void EmbeddingSystem::MarkDirty(int token) {
+    std::uint64_t bit = std::uint64_t(1) << (token & 63);
+    std::uint64_t& word = mDirty[static_cast<std::size_t>(token) >> 6];
+    if (word & bit) 
+        return;
+    word |= bit;
+    mDirtyCount++;
+    
+    // The pending scale starts at 1 with the norm of the row as stored.
+    if (mPrecision == EMBEDDING_FP32) {
+        mPendingScale[static_cast<std::size_t>(token)]  = 1.0;
+        mPendingNormSq[static_cast<std::size_t>(token)] = 
+            KernelSquaredNorm(reinterpret_cast<const float*>(GetRow(token)), mWidth);
+    }
+}
+
+void EmbeddingSystem::ClearDirty(int token) {
+    std::uint64_t bit = std::uint64_t(1) << (token & 63);
+    std::uint64_t& word = mDirty[static_cast<std::size_t>(token) >> 6];
+    if (!(word & bit)) 
+        return;
+    word &= ~bit;
+    mDirtyCount--;
+    mPendingScale[static_cast<std::size_t>(token)] = 1.0;
+}
+
+bool EmbeddingSystem::IsDirty(int token) const {
+    return (mDirty[static_cast<std::size_t>(token) >> 6] >> (token & 63)) & 1u;
+}
+
+double EmbeddingSystem::GetPendingScale(int token) const {
+    if (mPrecision != EMBEDDING_FP32 || !IsDirty(token)) 
+        return 1.0;
+    return mPendingScale[static_cast<std::size_t>(token)];
+}
+
+void EmbeddingSystem::TrainSentenceDeferred(const std::vector<int>& tokens, int windowSize, float strength) {
+    for (int i = 0; i < static_cast<int>(tokens.size()); ++i) {
+        int targetToken = tokens[i];
+        if (!IsPresent(targetToken)) 
+            continue;
+        
+        std::size_t t = static_cast<std::size_t>(targetToken);
+        BumpTargetScaled(tokens, i, windowSize, strength, 
+                         reinterpret_cast<float*>(GetRow(targetToken)), 
+                         1.0 / mPendingScale[t], mPendingNormSq[t]);
+    }
+    
+    // Normalize each target by changing only its pending scale: O(1) where
+    // Normalize() makes three passes over the row.
+    for (int i = 0; i < static_cast<int>(tokens.size()); ++i) {
+        int targetToken = tokens[i];
+        if (!IsPresent(targetToken)) 
+            continue;
+        
+        std::size_t t = static_cast<std::size_t>(targetToken);
+        double& scale  = mPendingScale[t];
+        double& normSq = mPendingNormSq[t];
+        if (scale * scale * normSq > 0.00001) 
+            scale = 1.0 / std::sqrt(normSq);
+        
+        // Fold the scale in before the stored values drift out of range.
+        if (scale < EMBEDDING_PENDING_SCALE_MIN || scale > 1.0 / EMBEDDING_PENDING_SCALE_MIN) {
+            float* row = reinterpret_cast<float*>(GetRow(targetToken));
+            KernelScale(static_cast<float>(scale), row, mWidth);
+            scale  = 1.0;
+            normSq = KernelSquaredNorm(row, mWidth);
+        }
     }
 }
 
 bool EmbeddingSystem::HasEmbedding(int token) const {
-    return mEmbeddings.find(token) != mEmbeddings.end();
+    return IsPresent(token);
 }
 
 bool EmbeddingSystem::GetEmbedding(int token, Embedding& outEmbedding) const {
-    std::unordered_map<int, Embedding>::const_iterator it = mEmbeddings.find(token);
-    if (it == mEmbeddings.end()) {
+    if (!IsPresent(token)) {
         return false;
     }
-    outEmbedding = it->second;
+    outEmbedding.v.resize(static_cast<std::size_t>(mWidth));
+    ReadRow(token, outEmbedding.v.data());
+    
+    double scale = GetPendingScale(token);
+    if (scale != 1.0) 
+        KernelScale(static_cast<float>(scale), outEmbedding.v.data(), mWidth);
     return true;
 }
 
-const Embedding* EmbeddingSystem::GetEmbeddingPtr(int token) const {
-    std::unordered_map<int, Embedding>::const_iterator it = mEmbeddings.find(token);
-    if (it == mEmbeddings.end()) {
+const float* EmbeddingSystem::GetEmbeddingPtr(int token) const {
+    if (!IsPresent(token) || mPrecision != EMBEDDING_FP32 || IsDirty(token)) {
         return NULL;
     }
-    return &it->second;
+    return reinterpret_cast<const float*>(GetRow(token));
+}
+
+bool EmbeddingSystem::AccumulateEmbedding(int token, double weight, double* sum) const {
+    if (!IsPresent(token)) {
+        return false;
+    }
+    
+    const unsigned char* row = GetRow(token);
+    if (mPrecision == EMBEDDING_FP16) {
+        const std::uint16_t* values = reinterpret_cast<const std::uint16_t*>(row);
+        float chunk[16];
+        for (int d = 0; d < mWidth; d += 16) {
+            int n = std::min(16, mWidth - d);
+            KernelHalfToFloat(values + d, chunk, n);
+            for (int k = 0; k < n; ++k) 
+                sum[d + k] += weight * chunk[k];
+        }
+    } else if (mPrecision == EMBEDDING_INT8) {
+        const std::int8_t* values = reinterpret_cast<const std::int8_t*>(row);
+        double scaled = weight * mScale[static_cast<std::size_t>(token)];
+        for (int d = 0; d < mWidth; ++d) 
+            sum[d] += scaled * values[d];
+    } else {
+        const float* values = reinterpret_cast<const float*>(row);
+        double scaled = weight * GetPendingScale(token);
+        for (int d = 0; d < mWidth; ++d) 
+            sum[d] += scaled * values[d];
+    }
+    return true;
+}
+
+void EmbeddingSystem::CosineBatch(const float* query,
+                                  const int* tokens,
+                                  int count,
+                                  float* norms,
+                                  float* similarity) const {
+    for (int i = 0; i < count; ++i) 
+        norms[i] = GetNorm(tokens[i]);
+    
+    if (mPrecision == EMBEDDING_FP32) {
+        // Gather row pointers a chunk at a time for the batched kernel. A
+        // dirty row is passed with the norm of its stored values, which
+        // gives the same cosine as the scaled row.
+        const float* rows[64];
+        float rowNorms[64];
+        for (int first = 0; first < count; first += 64) {
+            int n = std::min(64, count - first);
+            for (int k = 0; k < n; ++k) {
+                int token = tokens[first + k];
+                rowNorms[k] = norms[first + k];
+                rows[k] = NULL;
+                if (!IsPresent(token)) 
+                    continue;
+                rows[k] = reinterpret_cast<const float*>(GetRow(token));
+                if (IsDirty(token)) 
+                    rowNorms[k] = static_cast<float>(
+                        std::sqrt(mPendingNormSq[static_cast<std::size_t>(token)]));
+            }
+            KernelCosineBatch(query, rows, rowNorms, n, mWidth, similarity + first);
+        }
+        return;
+    }
+    
+    for (int i = 0; i < count; ++i) {
+        if (norms[i] <= 0.0f) {
+            similarity[i] = 0.0f;
+            continue;
+        }
+        
+        const unsigned char* row = GetRow(tokens[i]);
+        float dot;
+        if (mPrecision == EMBEDDING_FP16) {
+            dot = KernelDotHalf(query, reinterpret_cast<const std::uint16_t*>(row), mWidth);
+        } else {
+            dot = KernelDotInt8(query, reinterpret_cast<const std::int8_t*>(row), mWidth) * 
+                  mScale[static_cast<std::size_t>(tokens[i])];
+        }
+        similarity[i] = dot / norms[i];
+    }
+}
+
+float EmbeddingSystem::GetNorm(int token) const {
+    if (!IsPresent(token)) {
+        return 0.0f;
+    }
+    
+    // The cached norm is only brought up to date at the flush.
+    if (IsDirty(token)) {
+        if (mPrecision != EMBEDDING_FP32) 
+            return ComputeNorm(token);
+        std::size_t t = static_cast<std::size_t>(token);
+        return static_cast<float>(mPendingScale[t] * std::sqrt(mPendingNormSq[t]));
+    }
+    return mNorm[static_cast<std::size_t>(token)];
 }
 
 std::size_t EmbeddingSystem::size(void) const {
-    return mEmbeddings.size();
+    return mCount;
 }
 
 void EmbeddingSystem::Normalize(int token) {
     if (!HasEmbedding(token)) return;
-    Embedding& emb = mEmbeddings[token];
+    mVersion++;
     
-    float magSq = 0.0f;
-    for (int d = 0; d < EMBEDDING_WIDTH; ++d) magSq += (emb.v[d] * emb.v[d]);
-    
-    if (magSq > 0.00001f) {
-        float invMag = 1.0f / std::sqrt(magSq);
-        for (int d = 0; d < EMBEDDING_WIDTH; ++d) emb.v[d] *= invMag;
+    std::vector<float> scratch;
+    NormalizeRow(token, scratch);
+    mRowVersion[static_cast<std::size_t>(token)] = ++mRowWrites;
+}
+
+void EmbeddingSystem::NormalizeRow(int token, std::vector<float>& scratch) {
+    if (mPrecision != EMBEDDING_FP32) {
+        scratch.resize(static_cast<std::size_t>(mWidth));
+        ReadRow(token, scratch.data());
+        
+        float magSq = KernelSquaredNorm(scratch.data(), mWidth);
+        if (magSq > 0.00001f) {
+            KernelScale(1.0f / std::sqrt(magSq), scratch.data(), mWidth);
+            StoreRow(token, scratch.data());
+        }
+    } else {
+        float* emb = reinterpret_cast<float*>(GetRow(token));
+        
+        float magSq = KernelSquaredNorm(emb, mWidth);
+        
+        if (magSq > 0.00001f) {
+            float invMag = 1.0f / std::sqrt(magSq);
+            KernelScale(invMag, emb, mWidth);
+        }
     }
+    
+    mNorm[static_cast<std::size_t>(token)] = ComputeNorm(token);
 }
 
-bool EmbeddingSystem::SaveToFile(const std::string& filename) const {
+bool EmbeddingSystem::SaveToFile(const std::string& filename) {
+    // The file holds normalized rows.
+    FlushNormalization();
+    
     std::ofstream out(filename.c_str(), std::ios::binary);
     if (!out.is_open()) {
         return false;
     }
     
-    std::uint32_t count = static_cast<std::uint32_t>(mEmbeddings.size());
+    // Header: magic, width, [precision,] count. fp32 keeps the plain
+    // header so older builds can still read it.
+    const bool quantized = (mPrecision != EMBEDDING_FP32);
+    std::uint32_t magic     = quantized ? EMBEDDING_FILE_MAGIC_QUANTIZED : EMBEDDING_FILE_MAGIC;
+    std::uint32_t width     = static_cast<std::uint32_t>(mWidth);
+    std::uint32_t precision = static_cast<std::uint32_t>(mPrecision);
+    std::uint32_t count     = static_cast<std::uint32_t>(mCount);
+    out.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    out.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    if (quantized) 
+        out.write(reinterpret_cast<const char*>(&precision), sizeof(precision));
     out.write(reinterpret_cast<const char*>(&count), sizeof(count));
     if (!out.good()) {
         return false;
     }
     
-    for (std::unordered_map<int, Embedding>::const_iterator it = mEmbeddings.begin();
-         it != mEmbeddings.end(); ++it) {
+    // Entries in token order: token id, [int8 scale,] then the raw values.
+    const std::size_t rowBytes = static_cast<std::size_t>(mWidth) * BytesPerValue(mPrecision);
+    for (std::size_t row = 0; row < mRowCount; ++row) {
+        int token = static_cast<int>(row);
+        if (!IsPresent(token)) 
+            continue;
         
-        std::int32_t tokenId = static_cast<std::int32_t>(it->first);
+        std::int32_t tokenId = static_cast<std::int32_t>(token);
         out.write(reinterpret_cast<const char*>(&tokenId), sizeof(tokenId));
+        if (mPrecision == EMBEDDING_INT8) 
+            out.write(reinterpret_cast<const char*>(&mScale[row]), sizeof(float));
         if (!out.good()) {
             return false;
         }
         
-        const Embedding& emb = it->second;
-        out.write(reinterpret_cast<const char*>(emb.v),
-                  sizeof(float) * static_cast<std::size_t>(EMBEDDING_WIDTH));
+        out.write(reinterpret_cast<const char*>(GetRow(token)),
+                  static_cast<std::streamsize>(rowBytes));
         if (!out.good()) {
             return false;
         }
@@ -151,7 +812,7 @@ bool EmbeddingSystem::LoadFromFile(const std::string& filename) {
         return false;
     }
     
-    mEmbeddings.clear();
+    Clear();
     
     std::uint32_t count = 0;
     in.read(reinterpret_cast<char*>(&count), sizeof(count));
@@ -159,24 +820,165 @@ bool EmbeddingSystem::LoadFromFile(const std::string& filename) {
         return false;
     }
     
+    std::uint32_t width     = EMBEDDING_DEFAULT_WIDTH;
+    std::uint32_t precision = EMBEDDING_FP32;
+    if (count == EMBEDDING_FILE_MAGIC || count == EMBEDDING_FILE_MAGIC_QUANTIZED) {
+        const bool quantized = (count == EMBEDDING_FILE_MAGIC_QUANTIZED);
+        in.read(reinterpret_cast<char*>(&width), sizeof(width));
+        if (quantized) 
+            in.read(reinterpret_cast<char*>(&precision), sizeof(precision));
+        in.read(reinterpret_cast<char*>(&count), sizeof(count));
+        if (!in.good() || width == 0u || width > EMBEDDING_MAX_WIDTH || 
+            precision > EMBEDDING_INT8) {
+            return false;
+        }
+    }
+    mPrecision = EMBEDDING_FP32;
+    SetWidth(static_cast<int>(width));
+    SetPrecision(static_cast<int>(precision));
+    
+    const std::size_t rowBytes = static_cast<std::size_t>(width) * BytesPerValue(mPrecision);
+    
     for (std::uint32_t i = 0; i < count; ++i) {
         std::int32_t tokenId = 0;
+        float scale = 0.0f;
         in.read(reinterpret_cast<char*>(&tokenId), sizeof(tokenId));
-        if (!in.good()) {
-            mEmbeddings.clear();
+        if (mPrecision == EMBEDDING_INT8) 
+            in.read(reinterpret_cast<char*>(&scale), sizeof(scale));
+        if (!in.good() || tokenId < 0 || tokenId >= EMBEDDING_MAX_TOKENS) {
+            Clear();
             return false;
         }
         
-        Embedding emb;
-        in.read(reinterpret_cast<char*>(emb.v),
-                sizeof(float) * static_cast<std::size_t>(EMBEDDING_WIDTH));
+        // Raw values go straight into the row, with no requantization.
+        int token = static_cast<int>(tokenId);
+        Reserve(token);
+        in.read(reinterpret_cast<char*>(GetRow(token)), static_cast<std::streamsize>(rowBytes));
         if (!in.good()) {
-            mEmbeddings.clear();
+            Clear();
             return false;
         }
         
-        mEmbeddings[static_cast<int>(tokenId)] = emb;
+        SetPresent(token);
+        if (mPrecision == EMBEDDING_INT8) 
+            mScale[static_cast<std::size_t>(token)] = scale;
+        UpdateNorm(token);
+    }
+    
+    mVersion++;
+    return true;
+}
+
+unsigned int EmbeddingSystem::GetVersion(void) const {
+    return mVersion;
+}
+
+unsigned int EmbeddingSystem::GetRowVersion(int token) const {
+    if (!IsPresent(token)) 
+        return 0u;
+    return mRowVersion[static_cast<std::size_t>(token)];
+}
+
+int EmbeddingSystem::GetTokenLimit(void) const {
+    return static_cast<int>(mRowCount);
+}
+
+ContextEmbedding::ContextEmbedding() : 
+    mGeneration(0u) {
+    Clear();
+}
+
+void ContextEmbedding::Clear(void) {
+    mSum.assign(mSum.size(), 0.0);
+    mStale       = false;
+    mUsedCount   = 0;
+    mLength      = 0;
+    mVersion     = 0u;
+    mGeneration++;
+}
+
+void ContextEmbedding::Append(const EmbeddingSystem& embeddings, int token) {
+    const std::size_t width = static_cast<std::size_t>(embeddings.GetWidth());
+    if (mLength == 0) 
+        mVersion = embeddings.GetVersion();
+    
+    // The sums no longer line up with the rows; keep counting tokens so
+    // Matches fails and the next caller rebuilds.
+    if (mSum.size() != width) {
+        mStale = mStale || mLength != 0;
+        mSum.assign(width, 0.0);
+        mUsedCount = 0;
     }
     
+    mLength++;
+    mGeneration++;
+    
+    if (embeddings.AccumulateEmbedding(token, 1.0, mSum.data())) 
+        mUsedCount++;
+}
+
+void ContextEmbedding::Evict(const EmbeddingSystem& embeddings, int token) {
+    if (mLength == 0) 
+        return;
+    
+    mLength--;
+    if (mLength == 0) {
+        Clear();
+        return;
+    }
+    mGeneration++;
+    
+    const std::size_t width = static_cast<std::size_t>(embeddings.GetWidth());
+    if (mSum.size() != width) {
+        mStale = true;
+        return;
+    }
+    
+    if (embeddings.AccumulateEmbedding(token, -1.0, mSum.data())) 
+        mUsedCount--;
+}
+
+void ContextEmbedding::Rebuild(const EmbeddingSystem& embeddings, const std::vector<int>& tokens) {
+    Clear();
+    mSum.assign(static_cast<std::size_t>(embeddings.GetWidth()), 0.0);
+    for (std::size_t i = 0; i < tokens.size(); ++i) 
+        Append(embeddings, tokens[i]);
+    mVersion = embeddings.GetVersion();
+}
+
+unsigned int ContextEmbedding::GetGeneration(void) const {
+    return mGeneration;
+}
+
+std::size_t ContextEmbedding::size(void) const {
+    return mLength;
+}
+
+bool ContextEmbedding::Matches(const EmbeddingSystem& embeddings, std::size_t length, unsigned int generation) const {
+    if (mStale || length != mLength || generation != mGeneration) 
+        return false;
+    return mLength == 0 || embeddings.GetVersion() == mVersion;
+}
+
+bool ContextEmbedding::GetNormalized(Embedding& out) const {
+    if (mUsedCount <= 0) 
+        return false;
+    
+    const std::size_t width = mSum.size();
+    out.v.resize(width);
+    
+    float invCount = 1.0f / static_cast<float>(mUsedCount);
+    float norm = 0.0f;
+    for (std::size_t d = 0; d < width; ++d) {
+        out.v[d] = static_cast<float>(mSum[d]) * invCount;
+        norm += out.v[d] * out.v[d];
+    }
+    
+    if (norm <= 0.0f) 
+        return false;
+    
+    float invNorm = 1.0f / std::sqrt(norm);
+    for (std::size_t d = 0; d < width; ++d) 
+        out.v[d] *= invNorm;
     return true;
 }
@@ -1,15 +1,33 @@
 #ifndef _EMBEDDING__
 #define _EMBEDDING__
 
-#define EMBEDDING_WIDTH  128
+// Width used until one is set or loaded. Files carry their own width.
+#define EMBEDDING_DEFAULT_WIDTH  128
+
+// Storage precision of the embedding matrix. Quantized rows keep their
+// cosine ranking close to fp32 at a half or a quarter of the memory.
+#define EMBEDDING_FP32  0
+#define EMBEDDING_FP16  1   // IEEE half per value
+#define EMBEDDING_INT8  2   // int8 per value plus one float scale per row
 
 #include <string>
 #include <vector>
-#include <unordered_map>
+#include <cstdint>
+
+class WorkerPool;
 
+// One embedding vector, sized to the width of the system it came from.
 struct Embedding {
     
-    float v[EMBEDDING_WIDTH];
+    std::vector<float> v;
+    
+};
+
+// Storage unit of the embedding matrix. Rows are padded to whole blocks so
+// every row starts on a cache line.
+struct alignas(64) EmbeddingBlock {
+    
+    unsigned char bytes[64];
     
 };
 
@@ -21,7 +39,24 @@ public:
     // Remove all embeddings.
     void Clear(void);
     
-    // Add or replace an embedding for a token.
+    // Change the number of dimensions per embedding. Removes all embeddings.
+    void SetWidth(int width);
+    
+    // Number of dimensions per embedding.
+    int GetWidth(void) const;
+    
+    // Convert the stored rows to another EMBEDDING_* precision. Rows are
+    // requantized in place; going back to fp32 does not recover what the
+    // quantization dropped.
+    void SetPrecision(int precision);
+    
+    int GetPrecision(void) const;
+    
+    // Bytes held by the matrix, norms and scales.
+    std::size_t GetMemoryUsage(void) const;
+    
+    // Add or replace an embedding for a token. Ignored unless emb holds
+    // exactly GetWidth() values.
     void AddEmbedding(int token, const Embedding& emb);
     
     // Add a random embedding for a token if its unknown.
@@ -29,32 +64,232 @@ public:
     
     // Simple analytic "training": for each token, we bump dimensions in its
     // embedding based on nearby tokens in the sentence.
-    // Each neighbor token hashes to a dimension: neighborToken % EMBEDDING_WIDTH.
+    // Each neighbor token hashes to a dimension modulo the width.
     void TrainOnSentence(const std::vector<int>& tokens, int windowSize, float strength);
     
+    // Train on sentences [first, last) across the pool's threads. Threads
+    // share the matrix without locks (Hogwild), so racing bumps to one row
+    // may be lost. Quantized rows are trained on the calling thread only,
+    // since an fp16 or int8 write is not a single store. Always trains with
+    // deferred normalization and flushes at the end unless deferral is on.
+    // A windowSize of 0 spans each whole sentence.
+    void TrainOnSentences(const std::vector<std::vector<int>>& sentences, 
+                          std::size_t first, 
+                          std::size_t last, 
+                          int windowSize, 
+                          float strength, 
+                          WorkerPool& pool);
+    
+    // With deferral on, training leaves each touched row dirty instead of
+    // normalizing it after every sentence. An fp32 row keeps a pending
+    // scale that is renormalized in O(1) per sentence, so after a flush the
+    // rows match per-sentence training to within float rounding (about
+    // 1e-6 per value). Quantized rows are only normalized at the flush.
+    // Readers fold the pending scale in, so they see a dirty fp32 row as
+    // normalized and a dirty quantized row as trained but not yet
+    // normalized. Turning deferral off flushes.
+    void SetDeferredNormalization(bool defer);
+    bool GetDeferredNormalization(void) const;
+    
+    // Fold in pending scales and normalize every dirty row once. Call at a
+    // batch or epoch boundary; saving flushes first.
+    void FlushNormalization(void);
+    void FlushNormalization(WorkerPool& pool);
+    
+    // Rows waiting for FlushNormalization().
+    std::size_t GetDirtyCount(void) const;
+    
     // Check if we have an embedding for this token.
     bool HasEmbedding(int token) const;
     
-    // Copy embedding out; returns false if not found.
+    // Copy embedding out, dequantized if needed; returns false if not found.
     bool GetEmbedding(int token, Embedding& outEmbedding) const;
     
-    // Pointer access; returns NULL if not found.
-    const Embedding* GetEmbeddingPtr(int token) const;
+    // Pointer to the GetWidth() values of a row; returns NULL if not found,
+    // if the rows are quantized, or if the row is waiting for a flush.
+    const float* GetEmbeddingPtr(int token) const;
+    
+    // sum[d] += weight * row[d] at any precision; false if not found.
+    bool AccumulateEmbedding(int token, double weight, double* sum) const;
+    
+    // Cosine of a unit-length query against the rows of several tokens,
+    // using the kernel for the stored precision. Tokens without an
+    // embedding get a norm and a similarity of 0.
+    void CosineBatch(const float* query,
+                     const int* tokens,
+                     int count,
+                     float* norms,
+                     float* similarity) const;
+    
+    // Cached Euclidean norm of a token's embedding; 0 if not found.
+    float GetNorm(int token) const;
     
     // Number of stored embeddings.
     std::size_t size(void) const;
     
     void Normalize(int token);
     
-    // Load embeddings from a binary file.
+    // Load embeddings from a binary file. Width and precision come from the
+    // file header; files without one are fp32 at the default width.
     bool LoadFromFile(const std::string& filename);
     
-    // Save embeddings to a binary file.
-    bool SaveToFile(const std::string& filename) const;
+    // Save embeddings to a binary file, flushing any dirty rows first.
+    bool SaveToFile(const std::string& filename);
+    
+    // Bumped on every change to any embedding.
+    unsigned int GetVersion(void) const;
+    
+    // Bumped each time this token's row is written, so a caller can tell
+    // which rows changed since it last looked; 0 if not found.
+    unsigned int GetRowVersion(int token) const;
+    
+    // One past the highest token id that has a row.
+    int GetTokenLimit(void) const;
+    
+private:
+    
+    // Grow the matrix so that this token has a row.
+    void Reserve(int token);
+    
+    bool IsPresent(int token) const;
+    
+    // Mark a token as present, counting it the first time.
+    void SetPresent(int token);
+    
+    unsigned char* GetRow(int token);
+    const unsigned char* GetRow(int token) const;
+    
+    // Dequantize a row into width floats.
+    void ReadRow(int token, float* out) const;
+    
+    // Quantize width floats into a row and refresh its norm.
+    void WriteRow(int token, const float* in);
+    
+    // Quantize width floats into a row, leaving the norm and stamp alone.
+    void StoreRow(int token, const float* in);
+    
+    // Recompute the cached norm of one row and stamp it.
+    void UpdateNorm(int token);
+    
+    float ComputeNorm(int token) const;
+    
+    // Scale a row to unit length and refresh its norm without stamping it,
+    // so disjoint rows can be normalized from several threads.
+    void NormalizeRow(int token, std::vector<float>& scratch);
+    
+    // Add the window bumps for tokens[i] into its row values.
+    void BumpTarget(const std::vector<int>& tokens, 
+                    int i, 
+                    int windowSize, 
+                    float strength, 
+                    float* targetEmb) const;
+    
+    // BumpTarget for a row stored at 1 / invScale of its value, keeping
+    // the squared norm of the stored values up to date.
+    void BumpTargetScaled(const std::vector<int>& tokens, 
+                          int i, 
+                          int windowSize, 
+                          float strength, 
+                          float* targetEmb, 
+                          double invScale, 
+                          double& normSq) const;
+    
+    // Set a row's dirty bit, starting its pending scale.
+    void MarkDirty(int token);
+    
+    // Drop a row's dirty bit and pending scale, for a row being overwritten.
+    void ClearDirty(int token);
+    
+    bool IsDirty(int token) const;
+    
+    // Factor the stored values of a row are short of its trained values:
+    // the pending scale of a dirty fp32 row, otherwise 1.
+    double GetPendingScale(int token) const;
+    
+    // Train one sentence on dirty fp32 rows, normalizing by pending scale.
+    // Touches no shared counters, so Hogwild threads can run it.
+    void TrainSentenceDeferred(const std::vector<int>& tokens, int windowSize, float strength);
+    
+    int         mWidth;
+    int         mPrecision;
+    std::size_t mRowBlocks; // blocks per row
+    std::size_t mRowCount;  // rows allocated, one per token id
+    
+    // Row-major matrix indexed by token id. Token ids are dense, so rows
+    // for tokens without an embedding are left zeroed.
+    std::vector<EmbeddingBlock> mRows;
+    
+    // Per-row dequantization scale, int8 only.
+    std::vector<float> mScale;
+    
+    // One bit per row, set when the token has an embedding.
+    std::vector<std::uint64_t> mPresent;
+    
+    // Norm of each row, kept in step with every write.
+    std::vector<float> mNorm;
+    
+    // Write stamp of each row, taken from mRowWrites.
+    std::vector<unsigned int> mRowVersion;
+    
+    // One bit per row trained since the last flush. fp32 rows hold
+    // value / scale, with the squared norm of the stored values alongside.
+    std::vector<std::uint64_t> mDirty;
+    std::vector<double>        mPendingScale;
+    std::vector<double>        mPendingNormSq;
+    std::size_t                mDirtyCount;
+    bool                       mDeferNormalize;
+    
+    std::size_t mCount;
+    
+    unsigned int mVersion;
+    unsigned int mRowWrites; // never reset, so stamps stay unique across Clear()
+    
+};
+
+// Running average of the embeddings over a window of tokens. Appending or
+// evicting one token costs O(width), so a caller that keeps it in
+// step with its context never has to re-average the whole window.
+class ContextEmbedding {
+public:
+    
+    ContextEmbedding();
+    
+    // Forget every token.
+    void Clear(void);
+    
+    // Add a token to the end of the window.
+    void Append(const EmbeddingSystem& embeddings, int token);
+    
+    // Remove a token from the front of the window.
+    void Evict(const EmbeddingSystem& embeddings, int token);
+    
+    // Recompute from scratch over a token list.
+    void Rebuild(const EmbeddingSystem& embeddings, const std::vector<int>& tokens);
+    
+    // Bumped by every Append, Evict, Clear and Rebuild. A caller that keeps
+    // the window in step with its context holds on to it to show the window
+    // is still its own.
+    unsigned int GetGeneration(void) const;
+    
+    // Tokens in the window.
+    std::size_t size(void) const;
+    
+    // Check in O(1) that the window is still the one a caller left at this
+    // generation and length, and that no embedding changed since.
+    bool Matches(const EmbeddingSystem& embeddings, std::size_t length, unsigned int generation) const;
+    
+    // Unit-length average; false if no token in the window has an embedding.
+    bool GetNormalized(Embedding& out) const;
     
 private:
     
-    std::unordered_map<int, Embedding> mEmbeddings;
+    // Doubles keep add/subtract drift negligible over long sessions.
+    std::vector<double> mSum;
+    bool          mStale;       // width changed under a non-empty window
+    int           mUsedCount;   // tokens in the window that had an embedding
+    std::size_t   mLength;      // tokens in the window
+    unsigned int  mVersion;     // embedding version the sums were built from
+    unsigned int  mGeneration;  // never reset, so Clear() also bumps it
     
 };
 
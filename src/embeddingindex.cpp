@@ -0,0 +1,484 @@
+#include "embeddingindex.h"
+#include "kernels.h"
+
+#include <fstream>
+#include <cstdint>
+#include <algorithm>
+#include <math.h>
+
+// Leading word of an index file.
+static const std::uint32_t EMBEDDING_INDEX_FILE_MAGIC = 0x57534E48u; // "HNSW"
+
+// Level draws restart from the same seed on every Clear(), so building over
+// the same embeddings always gives the same graph.
+static const std::uint64_t EMBEDDING_INDEX_SEED = 0x484E5357u;
+
+static bool MoreSimilar(const EmbeddingNeighbor& a, const EmbeddingNeighbor& b) {
+    return a.similarity > b.similarity;
+}
+
+static bool LessSimilar(const EmbeddingNeighbor& a, const EmbeddingNeighbor& b) {
+    return a.similarity < b.similarity;
+}
+
+EmbeddingIndex::EmbeddingIndex() :
+    mEntry(-1),
+    mTopLevel(-1),
+    mWidth(0),
+    mSearchWidth(EMBEDDING_INDEX_SEARCH_WIDTH),
+    mCount(0),
+    mVisitEpoch(0u) {
+    mRandom.Seed(EMBEDDING_INDEX_SEED);
+}
+
+void EmbeddingIndex::Clear(void) {
+    mNodes.clear();
+    mVisited.clear();
+    mVisitEpoch = 0u;
+    mEntry    = -1;
+    mTopLevel = -1;
+    mWidth    = 0;
+    mCount    = 0;
+    mRandom.Seed(EMBEDDING_INDEX_SEED);
+}
+
+void EmbeddingIndex::Build(const EmbeddingSystem& embeddings) {
+    Clear();
+    mWidth = embeddings.GetWidth();
+
+    const int limit = embeddings.GetTokenLimit();
+    mNodes.resize(static_cast<std::size_t>(limit));
+    for (int token = 0; token < limit; ++token)
+        if (embeddings.HasEmbedding(token))
+            Insert(embeddings, token);
+}
+
+int EmbeddingIndex::Update(const EmbeddingSystem& embeddings) {
+    if (mWidth != embeddings.GetWidth()) {
+        Build(embeddings);
+        return static_cast<int>(mCount);
+    }
+
+    const int limit = embeddings.GetTokenLimit();
+    for (std::size_t t = static_cast<std::size_t>(limit); t < mNodes.size(); ++t) {
+        if (mNodes[t].level >= 0) {
+            Build(embeddings);
+            return static_cast<int>(mCount);
+        }
+    }
+    if (mNodes.size() < static_cast<std::size_t>(limit))
+        mNodes.resize(static_cast<std::size_t>(limit));
+
+    std::vector<int> pending;
+    std::size_t relinked = 0;
+    for (int token = 0; token < limit; ++token) {
+        const EmbeddingIndexNode& node = mNodes[static_cast<std::size_t>(token)];
+        const bool present = embeddings.HasEmbedding(token);
+        if (node.level < 0) {
+            if (present)
+                pending.push_back(token);
+            continue;
+        }
+        if (!present) {
+            // Nodes cannot be unlinked cleanly; start over.
+            Build(embeddings);
+            return static_cast<int>(mCount);
+        }
+        if (node.version != embeddings.GetRowVersion(token)) {
+            pending.push_back(token);
+            relinked++;
+        }
+    }
+
+    // Re-linking leaves the old back links in place, so once most rows have
+    // moved a fresh graph is both cheaper and better connected.
+    if (relinked * 2 > mCount) {
+        Build(embeddings);
+        return static_cast<int>(mCount);
+    }
+
+    for (std::size_t i = 0; i < pending.size(); ++i)
+        Insert(embeddings, pending[i]);
+    return static_cast<int>(pending.size());
+}
+
+void EmbeddingIndex::Search(const EmbeddingSystem& embeddings,
+                            const float* query,
+                            int k,
+                            std::vector<EmbeddingNeighbor>& results) {
+    results.clear();
+    if (mEntry < 0 || k <= 0 || embeddings.GetWidth() != mWidth)
+        return;
+
+    // Greedy descent through the sparse layers, then a wide search on the
+    // bottom layer where every node lives.
+    int entry = mEntry;
+    for (int level = mTopLevel; level > 0; --level) {
+        SearchLayer(embeddings, query, entry, 1, level, mLayerResults);
+        entry = mLayerResults[0].token;
+    }
+
+    SearchLayer(embeddings, query, entry, std::max(k, mSearchWidth), 0, results);
+    if (results.size() > static_cast<std::size_t>(k))
+        results.resize(static_cast<std::size_t>(k));
+}
+
+void EmbeddingIndex::SetSearchWidth(int width) {
+    mSearchWidth = std::max(1, width);
+}
+
+int EmbeddingIndex::GetSearchWidth(void) const {
+    return mSearchWidth;
+}
+
+std::size_t EmbeddingIndex::size(void) const {
+    return mCount;
+}
+
+void EmbeddingIndex::Insert(const EmbeddingSystem& embeddings, int token) {
+    if (!ReadUnit(embeddings, token, mQuery))
+        return;
+
+    EmbeddingIndexNode& node = mNodes[static_cast<std::size_t>(token)];
+    if (node.level < 0) {
+        node.level = DrawLevel();
+        node.links.assign(static_cast<std::size_t>(node.level) + 1, std::vector<int>());
+        mCount++;
+    }
+    node.version = embeddings.GetRowVersion(token);
+
+    if (mEntry < 0) {
+        mEntry    = token;
+        mTopLevel = node.level;
+        return;
+    }
+
+    // A node being re-linked keeps its old links while we search, so the
+    // graph stays connected through it; it is dropped from its own results.
+    int entry = mEntry;
+    for (int level = mTopLevel; level > node.level; --level) {
+        SearchLayer(embeddings, mQuery.v.data(), entry, 1, level, mLayerResults);
+        entry = mLayerResults[0].token;
+    }
+
+    for (int level = std::min(node.level, mTopLevel); level >= 0; --level) {
+        SearchLayer(embeddings, mQuery.v.data(), entry, EMBEDDING_INDEX_BUILD_WIDTH, level, mLayerResults);
+        entry = mLayerResults[0].token;
+
+        for (std::size_t i = 0; i < mLayerResults.size(); ++i) {
+            if (mLayerResults[i].token == token) {
+                mLayerResults.erase(mLayerResults.begin() + static_cast<std::ptrdiff_t>(i));
+                break;
+            }
+        }
+
+        std::vector<int>& links = node.links[static_cast<std::size_t>(level)];
+        SelectNeighbors(embeddings, mLayerResults, LinkLimit(level), links);
+        for (std::size_t i = 0; i < links.size(); ++i)
+            AddLink(embeddings, links[i], token, level);
+    }
+
+    if (node.level > mTopLevel) {
+        mTopLevel = node.level;
+        mEntry    = token;
+    }
+}
+
+void EmbeddingIndex::SearchLayer(const EmbeddingSystem& embeddings,
+                                 const float* query,
+                                 int entry,
+                                 int width,
+                                 int level,
+                                 std::vector<EmbeddingNeighbor>& results) {
+    if (mVisited.size() < mNodes.size())
+        mVisited.resize(mNodes.size(), 0u);
+    if (++mVisitEpoch == 0u) {
+        std::fill(mVisited.begin(), mVisited.end(), 0u);
+        mVisitEpoch = 1u;
+    }
+
+    EmbeddingNeighbor start;
+    start.token = entry;
+    Similarity(embeddings, query, &entry, 1, &start.similarity);
+    mVisited[static_cast<std::size_t>(entry)] = mVisitEpoch;
+
+    // Candidates to expand, best on top, and the results so far, worst on
+    // top so it can be dropped once the list is full.
+    std::vector<EmbeddingNeighbor>& candidates = mCandidates;
+    candidates.assign(1, start);
+    results.assign(1, start);
+
+    while (!candidates.empty()) {
+        std::pop_heap(candidates.begin(), candidates.end(), LessSimilar);
+        EmbeddingNeighbor current = candidates.back();
+        candidates.pop_back();
+
+        if (results.size() >= static_cast<std::size_t>(width) &&
+            current.similarity < results.front().similarity)
+            break;
+
+        // Score every unvisited neighbor in one batched call.
+        const std::vector<int>& links = mNodes[static_cast<std::size_t>(current.token)].links[static_cast<std::size_t>(level)];
+        mBatchTokens.clear();
+        for (std::size_t i = 0; i < links.size(); ++i) {
+            std::size_t next = static_cast<std::size_t>(links[i]);
+            if (mVisited[next] == mVisitEpoch)
+                continue;
+            mVisited[next] = mVisitEpoch;
+            mBatchTokens.push_back(links[i]);
+        }
+        if (mBatchTokens.empty())
+            continue;
+
+        mBatchSimilarity.resize(mBatchTokens.size());
+        Similarity(embeddings, query, mBatchTokens.data(), static_cast<int>(mBatchTokens.size()), mBatchSimilarity.data());
+
+        for (std::size_t i = 0; i < mBatchTokens.size(); ++i) {
+            EmbeddingNeighbor next;
+            next.token      = mBatchTokens[i];
+            next.similarity = mBatchSimilarity[i];
+
+            if (results.size() >= static_cast<std::size_t>(width) &&
+                next.similarity <= results.front().similarity)
+                continue;
+
+            candidates.push_back(next);
+            std::push_heap(candidates.begin(), candidates.end(), LessSimilar);
+            results.push_back(next);
+            std::push_heap(results.begin(), results.end(), MoreSimilar);
+            if (results.size() > static_cast<std::size_t>(width)) {
+                std::pop_heap(results.begin(), results.end(), MoreSimilar);
+                results.pop_back();
+            }
+        }
+    }
+
+    std::sort(results.begin(), results.end(), MoreSimilar);
+}
+
+void EmbeddingIndex::SelectNeighbors(const EmbeddingSystem& embeddings,
+                                     const std::vector<EmbeddingNeighbor>& candidates,
+                                     int maxLinks,
+                                     std::vector<int>& selected) {
+    selected.clear();
+    for (std::size_t i = 0; i < candidates.size(); ++i) {
+        if (selected.size() >= static_cast<std::size_t>(maxLinks))
+            break;
+
+        if (!selected.empty()) {
+            if (!ReadUnit(embeddings, candidates[i].token, mSelectQuery))
+                continue;
+
+            mSelectSimilarity.resize(selected.size());
+            Similarity(embeddings, mSelectQuery.v.data(), selected.data(),
+                       static_cast<int>(selected.size()), mSelectSimilarity.data());
+
+            bool keep = true;
+            for (std::size_t s = 0; s < selected.size(); ++s) {
+                if (mSelectSimilarity[s] > candidates[i].similarity) {
+                    keep = false;
+                    break;
+                }
+            }
+            if (!keep)
+                continue;
+        }
+
+        selected.push_back(candidates[i].token);
+    }
+}
+
+void EmbeddingIndex::AddLink(const EmbeddingSystem& embeddings, int from, int to, int level) {
+    std::vector<int>& links = mNodes[static_cast<std::size_t>(from)].links[static_cast<std::size_t>(level)];
+    if (std::find(links.begin(), links.end(), to) != links.end())
+        return;
+
+    if (links.size() < static_cast<std::size_t>(LinkLimit(level))) {
+        links.push_back(to);
+        return;
+    }
+
+    // Full: pick again from the old links plus the new one.
+    if (!ReadUnit(embeddings, from, mLinkQuery))
+        return;
+
+    mBatchTokens.assign(links.begin(), links.end());
+    mBatchTokens.push_back(to);
+    mBatchSimilarity.resize(mBatchTokens.size());
+    Similarity(embeddings, mLinkQuery.v.data(), mBatchTokens.data(),
+               static_cast<int>(mBatchTokens.size()), mBatchSimilarity.data());
+
+    mPruneCandidates.resize(mBatchTokens.size());
+    for (std::size_t i = 0; i < mBatchTokens.size(); ++i) {
+        mPruneCandidates[i].token      = mBatchTokens[i];
+        mPruneCandidates[i].similarity = mBatchSimilarity[i];
+    }
+    std::sort(mPruneCandidates.begin(), mPruneCandidates.end(), MoreSimilar);
+
+    SelectNeighbors(embeddings, mPruneCandidates, LinkLimit(level), mSelected);
+    links = mSelected;
+}
+
+void EmbeddingIndex::Similarity(const EmbeddingSystem& embeddings,
+                                const float* query,
+                                const int* tokens,
+                                int count,
+                                float* similarity) {
+    mBatchNorms.resize(static_cast<std::size_t>(count));
+    embeddings.CosineBatch(query, tokens, count, mBatchNorms.data(), similarity);
+}
+
+bool EmbeddingIndex::ReadUnit(const EmbeddingSystem& embeddings, int token, Embedding& out) const {
+    float norm = embeddings.GetNorm(token);
+    if (norm <= 0.0f || !embeddings.GetEmbedding(token, out))
+        return false;
+    KernelScale(1.0f / norm, out.v.data(), static_cast<int>(out.v.size()));
+    return true;
+}
+
+int EmbeddingIndex::DrawLevel(void) {
+    // Geometric layers: each one up holds about 1 / LINKS of the nodes below.
+    const double scale = 1.0 / log(static_cast<double>(EMBEDDING_INDEX_LINKS));
+    double level = -log(1.0 - mRandom.NextDouble()) * scale;
+    return std::min(static_cast<int>(level), EMBEDDING_INDEX_MAX_LEVEL);
+}
+
+int EmbeddingIndex::LinkLimit(int level) const {
+    return (level == 0) ? EMBEDDING_INDEX_LINKS * 2 : EMBEDDING_INDEX_LINKS;
+}
+
+bool EmbeddingIndex::SaveToFile(const std::string& filename) const {
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    std::uint32_t magic  = EMBEDDING_INDEX_FILE_MAGIC;
+    std::uint32_t width  = static_cast<std::uint32_t>(mWidth);
+    std::uint32_t linksM = EMBEDDING_INDEX_LINKS;
+    std::int32_t  entry  = mEntry;
+    std::int32_t  top    = mTopLevel;
+    std::uint32_t limit  = static_cast<std::uint32_t>(mNodes.size());
+    std::uint32_t count  = static_cast<std::uint32_t>(mCount);
+    out.write(reinterpret_cast<const char*>(&magic),  sizeof(magic));
+    out.write(reinterpret_cast<const char*>(&width),  sizeof(width));
+    out.write(reinterpret_cast<const char*>(&linksM), sizeof(linksM));
+    out.write(reinterpret_cast<const char*>(&entry),  sizeof(entry));
+    out.write(reinterpret_cast<const char*>(&top),    sizeof(top));
+    out.write(reinterpret_cast<const char*>(&limit),  sizeof(limit));
+    out.write(reinterpret_cast<const char*>(&count),  sizeof(count));
+
+    for (std::size_t t = 0; t < mNodes.size(); ++t) {
+        const EmbeddingIndexNode& node = mNodes[t];
+        if (node.level < 0)
+            continue;
+
+        std::int32_t token = static_cast<std::int32_t>(t);
+        std::int32_t level = node.level;
+        out.write(reinterpret_cast<const char*>(&token), sizeof(token));
+        out.write(reinterpret_cast<const char*>(&level), sizeof(level));
+        for (std::size_t l = 0; l < node.links.size(); ++l) {
+            std::uint32_t n = static_cast<std::uint32_t>(node.links[l].size());
+            out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+            out.write(reinterpret_cast<const char*>(node.links[l].data()),
+                      static_cast<std::streamsize>(sizeof(std::int32_t) * n));
+        }
+    }
+
+    return out.good();
+}
+
+bool EmbeddingIndex::LoadFromFile(const std::string& filename, const EmbeddingSystem& embeddings) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    Clear();
+
+    std::uint32_t magic  = 0;
+    std::uint32_t width  = 0;
+    std::uint32_t linksM = 0;
+    std::int32_t  entry  = -1;
+    std::int32_t  top    = -1;
+    std::uint32_t limit  = 0;
+    std::uint32_t count  = 0;
+    in.read(reinterpret_cast<char*>(&magic),  sizeof(magic));
+    in.read(reinterpret_cast<char*>(&width),  sizeof(width));
+    in.read(reinterpret_cast<char*>(&linksM), sizeof(linksM));
+    in.read(reinterpret_cast<char*>(&entry),  sizeof(entry));
+    in.read(reinterpret_cast<char*>(&top),    sizeof(top));
+    in.read(reinterpret_cast<char*>(&limit),  sizeof(limit));
+    in.read(reinterpret_cast<char*>(&count),  sizeof(count));
+
+    // The graph is only meaningful over the embeddings it was built from.
+    if (!in.good() || magic != EMBEDDING_INDEX_FILE_MAGIC ||
+        width != static_cast<std::uint32_t>(embeddings.GetWidth()) ||
+        linksM != EMBEDDING_INDEX_LINKS ||
+        limit > static_cast<std::uint32_t>(embeddings.GetTokenLimit()) ||
+        count > limit || top > EMBEDDING_INDEX_MAX_LEVEL) {
+        return false;
+    }
+
+    mWidth = static_cast<int>(width);
+    mNodes.resize(static_cast<std::size_t>(embeddings.GetTokenLimit()));
+
+    for (std::uint32_t i = 0; i < count; ++i) {
+        std::int32_t token = -1;
+        std::int32_t level = -1;
+        in.read(reinterpret_cast<char*>(&token), sizeof(token));
+        in.read(reinterpret_cast<char*>(&level), sizeof(level));
+        if (!in.good() || token < 0 || static_cast<std::uint32_t>(token) >= limit ||
+            level < 0 || level > top || !embeddings.HasEmbedding(token) ||
+            mNodes[static_cast<std::size_t>(token)].level >= 0) {
+            Clear();
+            return false;
+        }
+
+        EmbeddingIndexNode& node = mNodes[static_cast<std::size_t>(token)];
+        node.level   = level;
+        node.version = embeddings.GetRowVersion(token);
+        node.links.resize(static_cast<std::size_t>(level) + 1);
+        for (int l = 0; l <= level; ++l) {
+            std::uint32_t n = 0;
+            in.read(reinterpret_cast<char*>(&n), sizeof(n));
+            if (!in.good() || n > static_cast<std::uint32_t>(LinkLimit(l))) {
+                Clear();
+                return false;
+            }
+            node.links[static_cast<std::size_t>(l)].resize(n);
+            in.read(reinterpret_cast<char*>(node.links[static_cast<std::size_t>(l)].data()),
+                    static_cast<std::streamsize>(sizeof(std::int32_t) * n));
+        }
+        if (!in.good()) {
+            Clear();
+            return false;
+        }
+        mCount++;
+    }
+
+    // Every link must land on a node that reaches that layer.
+    for (std::size_t t = 0; t < mNodes.size(); ++t) {
+        const EmbeddingIndexNode& node = mNodes[t];
+        for (std::size_t l = 0; l < node.links.size(); ++l) {
+            for (std::size_t i = 0; i < node.links[l].size(); ++i) {
+                int next = node.links[l][i];
+                if (next < 0 || static_cast<std::uint32_t>(next) >= limit ||
+                    mNodes[static_cast<std::size_t>(next)].level < static_cast<int>(l)) {
+                    Clear();
+                    return false;
+                }
+            }
+        }
+    }
+
+    if (count > 0u && (entry < 0 || static_cast<std::uint32_t>(entry) >= limit ||
+                       mNodes[static_cast<std::size_t>(entry)].level != top)) {
+        Clear();
+        return false;
+    }
+
+    mEntry    = (count > 0u) ? entry : -1;
+    mTopLevel = (count > 0u) ? top : -1;
+    return true;
+}
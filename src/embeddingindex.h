@@ -0,0 +1,154 @@
+#ifndef _EMBEDDING_INDEX__
+#define _EMBEDDING_INDEX__
+
+// Links kept per node on the upper layers; layer 0 keeps twice as many.
+#define EMBEDDING_INDEX_LINKS         16
+
+// Candidate list width while linking a new node. Wider builds a better
+// connected graph at a higher insert cost.
+#define EMBEDDING_INDEX_BUILD_WIDTH   100
+
+// Default candidate list width while searching; trades recall for speed.
+#define EMBEDDING_INDEX_SEARCH_WIDTH  64
+
+// Highest layer a node can be drawn on.
+#define EMBEDDING_INDEX_MAX_LEVEL     16
+
+#include "embedding.h"
+#include "rng.h"
+
+#include <string>
+#include <vector>
+
+struct EmbeddingNeighbor {
+    int   token;
+    float similarity;
+};
+
+// One token in the graph. Tokens are the node ids, so nodes are indexed
+// directly by token and tokens without an embedding have level -1.
+struct EmbeddingIndexNode {
+
+    int          level;   // top layer, -1 if the token is not in the graph
+    unsigned int version; // row version of the embedding the links were built from
+
+    // Neighbor tokens, one list per layer 0..level.
+    std::vector<std::vector<int>> links;
+
+    EmbeddingIndexNode() :
+        level(-1),
+        version(0u) {}
+};
+
+// Hierarchical navigable small world graph over the rows of an embedding
+// system, for approximate nearest neighbors by cosine similarity. The graph
+// stores no vectors of its own; distances are read through the embedding
+// system at whatever precision it stores, so the two must be kept in step
+// with Update() after the embeddings change.
+class EmbeddingIndex {
+public:
+
+    EmbeddingIndex();
+
+    // Remove every node.
+    void Clear(void);
+
+    // Rebuild the graph over every token that has an embedding.
+    void Build(const EmbeddingSystem& embeddings);
+
+    // Insert tokens that gained an embedding and re-link the ones whose row
+    // was written since they were linked. Falls back to a full Build() when
+    // the width changed, a token lost its embedding, or most rows changed.
+    // Returns the number of nodes inserted or re-linked.
+    int Update(const EmbeddingSystem& embeddings);
+
+    // Up to k tokens most similar to a unit-length query, best first.
+    // Not safe to call from several threads at once; searches share scratch.
+    void Search(const EmbeddingSystem& embeddings,
+                const float* query,
+                int k,
+                std::vector<EmbeddingNeighbor>& results);
+
+    // Candidate list width used by Search(); never less than k.
+    void SetSearchWidth(int width);
+    int GetSearchWidth(void) const;
+
+    // Number of tokens in the graph.
+    std::size_t size(void) const;
+
+    // Save the graph to a binary file.
+    bool SaveToFile(const std::string& filename) const;
+
+    // Load a graph saved over these embeddings. Fails, leaving the index
+    // empty, if the file does not fit them; call Update() afterwards to
+    // pick up tokens added since it was saved.
+    bool LoadFromFile(const std::string& filename, const EmbeddingSystem& embeddings);
+
+private:
+
+    // Link one token into the graph, or re-link it if already there.
+    void Insert(const EmbeddingSystem& embeddings, int token);
+
+    // Best-first search of one layer from an entry token, keeping the
+    // width most similar tokens found. Results are sorted best first.
+    void SearchLayer(const EmbeddingSystem& embeddings,
+                     const float* query,
+                     int entry,
+                     int width,
+                     int level,
+                     std::vector<EmbeddingNeighbor>& results);
+
+    // Pick up to maxLinks of the candidates (sorted best first), skipping
+    // any that is closer to an already picked neighbor than to the base, so
+    // links spread out in different directions.
+    void SelectNeighbors(const EmbeddingSystem& embeddings,
+                         const std::vector<EmbeddingNeighbor>& candidates,
+                         int maxLinks,
+                         std::vector<int>& selected);
+
+    // Add a back link from one node to another, pruning the list if full.
+    void AddLink(const EmbeddingSystem& embeddings, int from, int to, int level);
+
+    // Cosine of a unit-length query against a list of tokens.
+    void Similarity(const EmbeddingSystem& embeddings,
+                    const float* query,
+                    const int* tokens,
+                    int count,
+                    float* similarity);
+
+    // Unit-length copy of a token's row; false if it has none.
+    bool ReadUnit(const EmbeddingSystem& embeddings, int token, Embedding& out) const;
+
+    int DrawLevel(void);
+
+    int LinkLimit(int level) const;
+
+    std::vector<EmbeddingIndexNode> mNodes;
+
+    int         mEntry;       // entry token on the top layer, -1 if empty
+    int         mTopLevel;
+    int         mWidth;       // embedding width the graph was built for
+    int         mSearchWidth;
+    std::size_t mCount;
+
+    RandomGenerator mRandom;
+
+    // Scratch reused across searches. Visited marks are epochs, so a new
+    // search only bumps mVisitEpoch instead of clearing the table.
+    std::vector<unsigned int>      mVisited;
+    unsigned int                   mVisitEpoch;
+    std::vector<int>               mBatchTokens;
+    std::vector<float>             mBatchNorms;
+    std::vector<float>             mBatchSimilarity;
+    std::vector<EmbeddingNeighbor> mCandidates;
+    std::vector<EmbeddingNeighbor> mLayerResults;
+    std::vector<EmbeddingNeighbor> mPruneCandidates;
+    std::vector<int>               mSelected;
+    std::vector<float>             mSelectSimilarity;
+    Embedding                      mQuery;
+    Embedding                      mLinkQuery;
+    Embedding                      mSelectQuery;
+
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "focus.h"
+#include "languagemodel.h"
+
+FocusList::FocusList() : 
+    mSource(NULL),
+    mSourceGeneration(0),
+    mHead(0),
+    mCapacity(FOCUS_LIST_CAPACITY) {}
+
+void FocusList::SetSource(const LanguageModel* model) {
+    unsigned int generation = (model != NULL) ? model->GetGeneration() : 0;
+    if (model != mSource || generation != mSourceGeneration) 
+        clear();
+    mSource = model;
+    mSourceGeneration = generation;
+}
+
+const LanguageModel* FocusList::GetSource(void) const {
+    return mSource;
+}
+
+void FocusList::Add(unsigned int span) {
+    if (mCapacity == 0) 
+        return;
+    
+    if (mIds.size() < mCapacity) {
+        mIds.push_back(static_cast<std::uint32_t>(span));
+        return;
+    }
+    
+    mIds[mHead] = static_cast<std::uint32_t>(span);
+    if (++mHead == mIds.size()) 
+        mHead = 0;
+}
+
+void FocusList::SetCapacity(std::size_t capacity) {
+    if (mIds.size() > capacity || mHead != 0) {
+        // Unroll the ring oldest first and keep the newest ids.
+        std::vector<std::uint32_t> ordered;
+        ordered.reserve(mIds.size());
+        for (std::size_t i = 0; i < mIds.size(); i++) 
+            ordered.push_back(GetSpanId(i));
+        if (ordered.size() > capacity) 
+            ordered.erase(ordered.begin(), ordered.end() - capacity);
+        mIds.swap(ordered);
+        mHead = 0;
+    }
+    mCapacity = capacity;
+}
+
+std::size_t FocusList::GetCapacity(void) const {
+    return mCapacity;
+}
+
+unsigned int FocusList::GetSpanId(std::size_t index) const {
+    std::size_t slot = mHead + index;
+    if (slot >= mIds.size()) 
+        slot -= mIds.size();
+    return mIds[slot];
+}
+
+SpanView FocusList::GetSpan(std::size_t index, std::vector<int>& buffer) const {
+    return mSource->GetSpan(GetSpanId(index), buffer);
+}
+
+unsigned int FocusList::GetOccurrences(std::size_t index) const {
+    return mSource->GetOccurrences(GetSpanId(index));
+}
+
+std::size_t FocusList::size(void) const {
+    return mIds.size();
+}
+
+bool FocusList::empty(void) const {
+    return mIds.empty();
+}
+
+void FocusList::clear(void) {
+    mIds.clear();
+    mHead = 0;
+}
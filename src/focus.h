@@ -0,0 +1,63 @@
+#ifndef _FOCUS_LIST__
+#define _FOCUS_LIST__
+
+// Default number of spans a focus list holds before it starts evicting.
+#define FOCUS_LIST_CAPACITY  (1024 * 740)
+
+#include "spanview.h"
+
+#include <vector>
+#include <cstdint>
+
+class LanguageModel;
+
+// Spans of a language model picked out for the sampler to match against.
+// Only span ids are kept, so building a focus costs one int per span no
+// matter how long the spans are, and the spans are read from the model's
+// own storage when scanned. Once full, each new span overwrites the oldest
+// one, ring buffer style.
+class FocusList {
+public:
+    
+    FocusList();
+    
+    // Model the span ids refer to. Switching to another model, or to the
+    // same model after it was reset or reloaded, clears the list.
+    void SetSource(const LanguageModel* model);
+    const LanguageModel* GetSource(void) const;
+    
+    // Append a span id, evicting the oldest span if the list is full.
+    void Add(unsigned int span);
+    
+    // Maximum number of spans kept. Shrinking keeps the newest ones.
+    void SetCapacity(std::size_t capacity);
+    std::size_t GetCapacity(void) const;
+    
+    // Span id at a position, oldest first.
+    unsigned int GetSpanId(std::size_t index) const;
+    
+    // View of the span at a position, oldest first. Packed spans are
+    // decoded into buffer; the view is valid until buffer or the model is
+    // next changed.
+    SpanView GetSpan(std::size_t index, std::vector<int>& buffer) const;
+    
+    // Times the span at a position occurs in the model.
+    unsigned int GetOccurrences(std::size_t index) const;
+    
+    std::size_t size(void) const;
+    bool empty(void) const;
+    void clear(void);
+    
+private:
+    
+    const LanguageModel* mSource;
+    unsigned int         mSourceGeneration;
+    
+    // Ids in a ring; mHead is the oldest once the ring has wrapped.
+    std::vector<std::uint32_t> mIds;
+    std::size_t                mHead;
+    std::size_t                mCapacity;
+    
+};
+
+#endif
@@ -0,0 +1,730 @@
+#include "kernels.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Widths with their own fully unrolled float kernels. Any other width goes
+// to the generic slot, which reads the count at run time.
+#define KERNELS_WIDTH_SLOTS  5
+
+#ifdef KERNELS_X86
+// Lets a constant trip count unroll completely; a run-time one unrolls
+// partially.
+#define KERNELS_UNROLL  _Pragma("GCC unroll 16")
+#else
+#define KERNELS_UNROLL
+#endif
+
+typedef int   (*FindTokenFunc)(const int*, int, int, int*);
+typedef void  (*UnpackTokensFunc)(const std::uint64_t*, std::uint64_t, int, int, int*);
+typedef float (*DotFunc)(const float*, const float*, int);
+typedef float (*SquaredNormFunc)(const float*, int);
+typedef void  (*AxpyFunc)(float, const float*, float*, int);
+typedef void  (*ScaleFunc)(float, float*, int);
+typedef void  (*CosineBatchFunc)(const float*, const float* const*, const float*, int, int, float*);
+typedef float (*DotHalfFunc)(const float*, const std::uint16_t*, int);
+typedef float (*DotInt8Func)(const float*, const std::int8_t*, int);
+
+struct KernelTable {
+    FindTokenFunc   findToken;
+    UnpackTokensFunc unpackTokens;
+    DotFunc         dot[KERNELS_WIDTH_SLOTS];
+    SquaredNormFunc squaredNorm[KERNELS_WIDTH_SLOTS];
+    AxpyFunc        axpy[KERNELS_WIDTH_SLOTS];
+    ScaleFunc       scale[KERNELS_WIDTH_SLOTS];
+    CosineBatchFunc cosineBatch[KERNELS_WIDTH_SLOTS];
+    DotHalfFunc     dotHalf;
+    DotInt8Func     dotInt8;
+    const char*     name;
+};
+
+// Slot in the float kernel arrays for a vector width.
+static inline int WidthSlot(int count) {
+    switch (count) {
+        case 32:  return 0;
+        case 64:  return 1;
+        case 128: return 2;
+        case 256: return 3;
+        default:  return 4;
+    }
+}
+
+// Entry points for one instruction set, instantiated per width. FIXED
+// replaces the run-time count with a constant so the body above inlines
+// with no loop bounds left to test; FIXED == 0 is the generic fallback.
+#define KERNELS_WIDTH_SET(ISA, TARGET)                                        \
+template <int FIXED> TARGET                                                   \
+static float DotFixed##ISA(const float* a, const float* b, int count) {       \
+    return Dot##ISA(a, b, FIXED > 0 ? FIXED : count);                         \
+}                                                                             \
+template <int FIXED> TARGET                                                   \
+static float SquaredNormFixed##ISA(const float* a, int count) {               \
+    return SquaredNorm##ISA(a, FIXED > 0 ? FIXED : count);                    \
+}                                                                             \
+template <int FIXED> TARGET                                                   \
+static void AxpyFixed##ISA(float alpha, const float* x, float* y, int count) {\
+    Axpy##ISA(alpha, x, y, FIXED > 0 ? FIXED : count);                        \
+}                                                                             \
+template <int FIXED> TARGET                                                   \
+static void ScaleFixed##ISA(float alpha, float* x, int count) {               \
+    Scale##ISA(alpha, x, FIXED > 0 ? FIXED : count);                          \
+}                                                                             \
+template <int FIXED> TARGET                                                   \
+static void CosineBatchFixed##ISA(const float* query, const float* const* rows,\
+                                  const float* norms, int rowCount, int count, \
+                                  float* out) {                               \
+    CosineBatch##ISA(query, rows, norms, rowCount,                            \
+                     FIXED > 0 ? FIXED : count, out);                         \
+}
+
+#define KERNELS_FILL_SLOT(TABLE, ISA, SLOT, WIDTH)                            \
+    (TABLE).dot[SLOT]         = &DotFixed##ISA<WIDTH>;                        \
+    (TABLE).squaredNorm[SLOT] = &SquaredNormFixed##ISA<WIDTH>;                \
+    (TABLE).axpy[SLOT]        = &AxpyFixed##ISA<WIDTH>;                       \
+    (TABLE).scale[SLOT]       = &ScaleFixed##ISA<WIDTH>;                      \
+    (TABLE).cosineBatch[SLOT] = &CosineBatchFixed##ISA<WIDTH>;
+
+// Slot order must match WidthSlot.
+#define KERNELS_FILL(TABLE, ISA)                                              \
+    KERNELS_FILL_SLOT(TABLE, ISA, 0, 32)                                      \
+    KERNELS_FILL_SLOT(TABLE, ISA, 1, 64)                                      \
+    KERNELS_FILL_SLOT(TABLE, ISA, 2, 128)                                     \
+    KERNELS_FILL_SLOT(TABLE, ISA, 3, 256)                                     \
+    KERNELS_FILL_SLOT(TABLE, ISA, 4, 0)
+
+static int FindTokenScalar(const int* data, int count, int token, int* out) {
+    int found = 0;
+    for (int i = 0; i < count; ++i) {
+        if (data[i] == token) {
+            out[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Field at a bit offset. The second word is shifted in two steps so a field
+// that starts on a word boundary does not shift by 64.
+static inline std::uint64_t UnpackField(const std::uint64_t* words, std::uint64_t bit) {
+    const std::uint64_t word  = bit >> 6;
+    const unsigned int  shift = static_cast<unsigned int>(bit & 63u);
+    return (words[word] >> shift) | ((words[word + 1] << 1) << (63u - shift));
+}
+
+static void UnpackTokensScalar(const std::uint64_t* words, std::uint64_t firstBit, 
+                               int width, int count, int* out) {
+    const std::uint64_t mask = (1ull << width) - 1u;
+    std::uint64_t bit = firstBit;
+    for (int i = 0; i < count; ++i, bit += static_cast<std::uint64_t>(width)) {
+        out[i] = static_cast<int>(UnpackField(words, bit) & mask) - 1;
+    }
+}
+
+static inline float DotScalar(const float* a, const float* b, int count) {
+    float sum = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static inline float SquaredNormScalar(const float* a, int count) {
+    return DotScalar(a, a, count);
+}
+
+static inline void AxpyScalar(float alpha, const float* x, float* y, int count) {
+    for (int i = 0; i < count; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+static inline void ScaleScalar(float alpha, float* x, int count) {
+    for (int i = 0; i < count; ++i) {
+        x[i] *= alpha;
+    }
+}
+
+// One body per instruction set, so the dot product inlines into the loop.
+#define KERNELS_COSINE_BATCH(NAME, DOT)                                       \
+static inline void NAME(const float* query, const float* const* rows,                \
+                 const float* norms, int rowCount, int count, float* out) {   \
+    for (int r = 0; r < rowCount; ++r) {                                      \
+        if (norms[r] <= 0.0f) {                                               \
+            out[r] = 0.0f;                                                    \
+            continue;                                                         \
+        }                                                                     \
+        out[r] = DOT(query, rows[r], count) / norms[r];                       \
+    }                                                                         \
+}
+
+KERNELS_COSINE_BATCH(CosineBatchScalar, DotScalar)
+KERNELS_WIDTH_SET(Scalar, )
+
+static float HalfToFloat(std::uint16_t h) {
+    std::uint32_t sign = static_cast<std::uint32_t>(h & 0x8000u) << 16;
+    std::uint32_t exp  = (h >> 10) & 0x1Fu;
+    std::uint32_t mant = h & 0x3FFu;
+    std::uint32_t bits;
+    
+    if (exp == 0u) {
+        if (mant == 0u) {
+            bits = sign;
+        } else {
+            // Subnormal: shift the mantissa up until it is normalized.
+            exp = 113u;
+            while ((mant & 0x400u) == 0u) {
+                mant <<= 1;
+                exp--;
+            }
+            bits = sign | (exp << 23) | ((mant & 0x3FFu) << 13);
+        }
+    } else if (exp == 31u) {
+        bits = sign | 0x7F800000u | (mant << 13);
+    } else {
+        bits = sign | ((exp + 112u) << 23) | (mant << 13);
+    }
+    
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static std::uint16_t FloatToHalf(float value) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    
+    std::uint32_t sign = (bits >> 16) & 0x8000u;
+    std::uint32_t absx = bits & 0x7FFFFFFFu;
+    
+    if (absx >= 0x7F800000u) {
+        // Inf stays inf; NaN stays a quiet NaN.
+        return static_cast<std::uint16_t>(sign | 0x7C00u | (absx > 0x7F800000u ? 0x200u : 0u));
+    }
+    if (absx >= 0x477FF000u) {
+        return static_cast<std::uint16_t>(sign | 0x7C00u); // rounds past 65504
+    }
+    if (absx < 0x38800000u) {
+        // Below the smallest normal half: produce a subnormal or zero.
+        if (absx < 0x33000000u) {
+            return static_cast<std::uint16_t>(sign);
+        }
+        std::uint32_t exp   = absx >> 23;
+        std::uint32_t mant  = (absx & 0x7FFFFFu) | 0x800000u;
+        std::uint32_t shift = 126u - exp;
+        std::uint32_t half  = mant >> shift;
+        std::uint32_t rest  = mant & ((1u << shift) - 1u);
+        std::uint32_t mid   = 1u << (shift - 1u);
+        if (rest > mid || (rest == mid && (half & 1u))) {
+            half++;
+        }
+        return static_cast<std::uint16_t>(sign | half);
+    }
+    
+    // Rebias the exponent and round the dropped 13 bits; a carry correctly
+    // moves into the exponent.
+    std::uint32_t half = (absx - 0x38000000u) >> 13;
+    std::uint32_t rest = absx & 0x1FFFu;
+    if (rest > 0x1000u || (rest == 0x1000u && (half & 1u))) {
+        half++;
+    }
+    return static_cast<std::uint16_t>(sign | half);
+}
+
+static float DotHalfScalar(const float* query, const std::uint16_t* row, int count) {
+    float sum = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        sum += query[i] * HalfToFloat(row[i]);
+    }
+    return sum;
+}
+
+static float DotInt8Scalar(const float* query, const std::int8_t* row, int count) {
+    float sum = 0.0f;
+    for (int i = 0; i < count; ++i) {
+        sum += query[i] * static_cast<float>(row[i]);
+    }
+    return sum;
+}
+
+#ifdef KERNELS_X86
+
+// Append the lane indices set in mask, offset by base.
+static inline int EmitMask(unsigned int mask, int base, int* out) {
+    int found = 0;
+    while (mask != 0u) {
+        out[found++] = base + __builtin_ctz(mask);
+        mask &= mask - 1u;
+    }
+    return found;
+}
+
+__attribute__((target("avx2")))
+static int FindTokenAVX2(const int* data, int count, int token, int* out) {
+    const __m256i needle = _mm256_set1_epi32(token);
+    int found = 0;
+    int i = 0;
+    
+    // 16 lanes per step: two compares folded into one 16-bit mask.
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 8));
+        unsigned int lo = static_cast<unsigned int>(
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, needle))));
+        unsigned int hi = static_cast<unsigned int>(
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(b, needle))));
+        found += EmitMask(lo | (hi << 8), i, out + found);
+    }
+    
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned int mask = static_cast<unsigned int>(
+            _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, needle))));
+        found += EmitMask(mask, i, out + found);
+    }
+    
+    for (; i < count; ++i) {
+        if (data[i] == token) {
+            out[found++] = i;
+        }
+    }
+    return found;
+}
+
+// Eight fields per step: each lane gathers the four bytes its field starts
+// in and shifts it into place, so fields of up to 25 bits fit one load.
+// Wider fields take the scalar path.
+__attribute__((target("avx2")))
+static void UnpackTokensAVX2(const std::uint64_t* words, std::uint64_t firstBit, 
+                             int width, int count, int* out) {
+    if (width > 25) {
+        UnpackTokensScalar(words, firstBit, width, count, out);
+        return;
+    }
+    
+    const char*   bytes = reinterpret_cast<const char*>(words);
+    const __m256i lanes = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), 
+                                             _mm256_set1_epi32(width));
+    const __m256i mask  = _mm256_set1_epi32((1 << width) - 1);
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i one   = _mm256_set1_epi32(1);
+    const std::uint64_t step = 8u * static_cast<std::uint64_t>(width);
+    
+    std::uint64_t bit = firstBit;
+    int i = 0;
+    for (; i + 8 <= count; i += 8, bit += step) {
+        // Offsets are taken from the step's first byte so they stay small
+        // however far into the stream it is.
+        const int* base  = reinterpret_cast<const int*>(bytes + (bit >> 3));
+        __m256i local    = _mm256_add_epi32(lanes, _mm256_set1_epi32(static_cast<int>(bit & 7u)));
+        __m256i field    = _mm256_i32gather_epi32(base, _mm256_srli_epi32(local, 3), 1);
+        field = _mm256_srlv_epi32(field, _mm256_and_si256(local, seven));
+        field = _mm256_sub_epi32(_mm256_and_si256(field, mask), one);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), field);
+    }
+    
+    UnpackTokensScalar(words, bit, width, count - i, out + i);
+}
+
+// SSE2 is part of x86-64, so this is the floor on every 64-bit build.
+__attribute__((target("sse2")))
+static inline float HorizontalSumSSE2(__m128 v) {
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2")))
+static inline float DotSSE2(const float* a, const float* b, int count) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),     _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float sum = HorizontalSumSSE2(_mm_add_ps(acc0, acc1));
+    for (; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static inline float SquaredNormSSE2(const float* a, int count) {
+    return DotSSE2(a, a, count);
+}
+
+__attribute__((target("sse2")))
+static inline void AxpySSE2(float alpha, const float* x, float* y, int count) {
+    const __m128 va = _mm_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 4 <= count; i += 4) {
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i)));
+        _mm_storeu_ps(y + i, vy);
+    }
+    for (; i < count; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static inline void ScaleSSE2(float alpha, float* x, int count) {
+    const __m128 va = _mm_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(x + i, _mm_mul_ps(va, _mm_loadu_ps(x + i)));
+    }
+    for (; i < count; ++i) {
+        x[i] *= alpha;
+    }
+}
+
+__attribute__((target("sse2")))
+KERNELS_COSINE_BATCH(CosineBatchSSE2, DotSSE2)
+KERNELS_WIDTH_SET(SSE2, __attribute__((target("sse2"))))
+
+__attribute__((target("avx2,fma")))
+static inline float DotAVX2(const float* a, const float* b, int count) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i),     _mm256_loadu_ps(b + i),     acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    __m128 shuf = _mm_movehdup_ps(half);
+    __m128 sums = _mm_add_ps(half, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    float sum = _mm_cvtss_f32(sums);
+    for (; i < count; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static inline float SquaredNormAVX2(const float* a, int count) {
+    return DotAVX2(a, a, count);
+}
+
+__attribute__((target("avx2,fma")))
+static inline void AxpyAVX2(float alpha, const float* x, float* y, int count) {
+    const __m256 va = _mm256_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 8 <= count; i += 8) {
+        __m256 vy = _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+        _mm256_storeu_ps(y + i, vy);
+    }
+    for (; i < count; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static inline void ScaleAVX2(float alpha, float* x, int count) {
+    const __m256 va = _mm256_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_ps(x + i, _mm256_mul_ps(va, _mm256_loadu_ps(x + i)));
+    }
+    for (; i < count; ++i) {
+        x[i] *= alpha;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+KERNELS_COSINE_BATCH(CosineBatchAVX2, DotAVX2)
+KERNELS_WIDTH_SET(AVX2, __attribute__((target("avx2,fma"))))
+
+__attribute__((target("avx2,fma")))
+static inline float HorizontalSumAVX2(__m256 acc) {
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    __m128 shuf = _mm_movehdup_ps(half);
+    __m128 sums = _mm_add_ps(half, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float DotHalfAVX2(const float* query, const std::uint16_t* row, int count) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256 r0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)));
+        __m256 r1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i),     r0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i + 8), r1, acc1);
+    }
+    for (; i + 8 <= count; i += 8) {
+        __m256 r0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), r0, acc0);
+    }
+    float sum = HorizontalSumAVX2(_mm256_add_ps(acc0, acc1));
+    for (; i < count; ++i) {
+        sum += query[i] * HalfToFloat(row[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float DotInt8AVX2(const float* query, const std::int8_t* row, int count) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    // Widen 16 int8 values to two vectors of 8 floats per step.
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m256 r0 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        __m256 r1 = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(bytes, 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i),     r0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i + 8), r1, acc1);
+    }
+    float sum = HorizontalSumAVX2(_mm256_add_ps(acc0, acc1));
+    for (; i < count; ++i) {
+        sum += query[i] * static_cast<float>(row[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static inline float DotAVX512(const float* a, const float* b, int count) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 32 <= count; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i),      _mm512_loadu_ps(b + i),      acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    if (i + 16 <= count) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        i += 16;
+    }
+    // Masked tail: no scalar remainder loop.
+    if (i < count) {
+        __mmask16 mask = static_cast<__mmask16>((1u << (count - i)) - 1u);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                               _mm512_maskz_loadu_ps(mask, b + i), acc1);
+    }
+    // Reduce through memory: the shuffle and extract intrinsics trip a false
+    // -Wuninitialized in some GCC versions when only the function targets
+    // AVX-512.
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, _mm512_add_ps(acc0, acc1));
+    __m128 sums = _mm_add_ps(_mm_add_ps(_mm_load_ps(lanes),     _mm_load_ps(lanes + 4)),
+                             _mm_add_ps(_mm_load_ps(lanes + 8), _mm_load_ps(lanes + 12)));
+    __m128 shuf = _mm_movehdup_ps(sums);
+    sums = _mm_add_ps(sums, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx512f")))
+static inline float SquaredNormAVX512(const float* a, int count) {
+    return DotAVX512(a, a, count);
+}
+
+__attribute__((target("avx512f")))
+static inline void AxpyAVX512(float alpha, const float* x, float* y, int count) {
+    const __m512 va = _mm512_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 16 <= count; i += 16) {
+        __m512 vy = _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+        _mm512_storeu_ps(y + i, vy);
+    }
+    if (i < count) {
+        __mmask16 mask = static_cast<__mmask16>((1u << (count - i)) - 1u);
+        __m512 vy = _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(mask, x + i),
+                                    _mm512_maskz_loadu_ps(mask, y + i));
+        _mm512_mask_storeu_ps(y + i, mask, vy);
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline void ScaleAVX512(float alpha, float* x, int count) {
+    const __m512 va = _mm512_set1_ps(alpha);
+    int i = 0;
+    KERNELS_UNROLL
+    for (; i + 16 <= count; i += 16) {
+        _mm512_storeu_ps(x + i, _mm512_mul_ps(va, _mm512_loadu_ps(x + i)));
+    }
+    if (i < count) {
+        __mmask16 mask = static_cast<__mmask16>((1u << (count - i)) - 1u);
+        _mm512_mask_storeu_ps(x + i, mask, _mm512_mul_ps(va, _mm512_maskz_loadu_ps(mask, x + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+KERNELS_COSINE_BATCH(CosineBatchAVX512, DotAVX512)
+KERNELS_WIDTH_SET(AVX512, __attribute__((target("avx512f"))))
+
+__attribute__((target("avx512f")))
+static float DotHalfAVX512(const float* query, const std::uint16_t* row, int count) {
+    // Zero-masked forms with a full mask: the plain ones trip the same false
+    // -Wuninitialized as the reductions above.
+    const __mmask16 full = static_cast<__mmask16>(0xFFFFu);
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 r = _mm512_maskz_cvtph_ps(full, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), r, acc);
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, acc);
+    float sum = 0.0f;
+    for (int l = 0; l < 16; ++l) {
+        sum += lanes[l];
+    }
+    for (; i < count; ++i) {
+        sum += query[i] * HalfToFloat(row[i]);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static float DotInt8AVX512(const float* query, const std::int8_t* row, int count) {
+    // Zero-masked forms with a full mask: the plain ones trip the same false
+    // -Wuninitialized as the reductions above.
+    const __mmask16 full = static_cast<__mmask16>(0xFFFFu);
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m512 r = _mm512_maskz_cvtepi32_ps(full, _mm512_maskz_cvtepi8_epi32(full, bytes));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), r, acc);
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, acc);
+    float sum = 0.0f;
+    for (int l = 0; l < 16; ++l) {
+        sum += lanes[l];
+    }
+    for (; i < count; ++i) {
+        sum += query[i] * static_cast<float>(row[i]);
+    }
+    return sum;
+}
+
+#endif
+
+static KernelTable SelectKernels(void) {
+    KernelTable table;
+    table.findToken = &FindTokenScalar;
+    table.unpackTokens = &UnpackTokensScalar;
+    KERNELS_FILL(table, Scalar)
+    table.dotHalf   = &DotHalfScalar;
+    table.dotInt8   = &DotInt8Scalar;
+    table.name      = "scalar";
+    
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        KERNELS_FILL(table, SSE2)
+        table.name      = "sse2";
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        table.findToken = &FindTokenAVX2;
+        table.unpackTokens = &UnpackTokensAVX2;
+        KERNELS_FILL(table, AVX2)
+        table.dotInt8   = &DotInt8AVX2;
+        if (__builtin_cpu_supports("f16c")) {
+            table.dotHalf = &DotHalfAVX2;
+        }
+        table.name      = "avx2";
+    }
+    // The token search and unpack have no AVX-512 variants; the AVX2 ones
+    // are kept.
+    if (__builtin_cpu_supports("avx512f")) {
+        KERNELS_FILL(table, AVX512)
+        table.dotHalf   = &DotHalfAVX512;
+        table.dotInt8   = &DotInt8AVX512;
+        table.name      = "avx512";
+    }
+#endif
+    
+    return table;
+}
+
+static const KernelTable& GetKernels(void) {
+    static const KernelTable table = SelectKernels();
+    return table;
+}
+
+int KernelFindToken(const int* data, int count, int token, int* out) {
+    return GetKernels().findToken(data, count, token, out);
+}
+
+void KernelUnpackTokens(const std::uint64_t* words, std::uint64_t firstBit, 
+                        int width, int count, int* out) {
+    GetKernels().unpackTokens(words, firstBit, width, count, out);
+}
+
+float KernelDot(const float* a, const float* b, int count) {
+    return GetKernels().dot[WidthSlot(count)](a, b, count);
+}
+
+float KernelSquaredNorm(const float* a, int count) {
+    return GetKernels().squaredNorm[WidthSlot(count)](a, count);
+}
+
+void KernelAxpy(float alpha, const float* x, float* y, int count) {
+    GetKernels().axpy[WidthSlot(count)](alpha, x, y, count);
+}
+
+void KernelScale(float alpha, float* x, int count) {
+    GetKernels().scale[WidthSlot(count)](alpha, x, count);
+}
+
+void KernelCosineBatch(const float* query,
+                       const float* const* rows,
+                       const float* norms,
+                       int rowCount,
+                       int count,
+                       float* out) {
+    GetKernels().cosineBatch[WidthSlot(count)](query, rows, norms, rowCount, count, out);
+}
+
+float KernelDotHalf(const float* query, const std::uint16_t* row, int count) {
+    return GetKernels().dotHalf(query, row, count);
+}
+
+float KernelDotInt8(const float* query, const std::int8_t* row, int count) {
+    return GetKernels().dotInt8(query, row, count);
+}
+
+void KernelFloatToHalf(const float* in, std::uint16_t* out, int count) {
+    for (int i = 0; i < count; ++i) {
+        out[i] = FloatToHalf(in[i]);
+    }
+}
+
+void KernelHalfToFloat(const std::uint16_t* in, float* out, int count) {
+    for (int i = 0; i < count; ++i) {
+        out[i] = HalfToFloat(in[i]);
+    }
+}
+
+const char* KernelGetName(void) {
+    return GetKernels().name;
+}
@@ -0,0 +1,58 @@
+#ifndef _KERNELS__
+#define _KERNELS__
+
+#include <cstdint>
+
+// Hot inner loops with SIMD variants. The best variant the CPU supports is
+// picked the first time the kernels are used. Integer kernels give the same
+// results as the scalar ones; float kernels agree up to summation order.
+
+// Write the index of every element of data[0, count) equal to token into
+// out, in increasing order. Returns how many were written; out must have
+// room for count entries.
+int KernelFindToken(const int* data, int count, int token, int* out);
+
+// Read count bit fields of width (1 to 32) bits each, starting at bit
+// firstBit of words, into out. Fields hold token + 1, so a zero field comes
+// out as -1. Bits are numbered from the low end of each word, and one word
+// past the last field must be readable.
+void KernelUnpackTokens(const std::uint64_t* words, std::uint64_t firstBit, 
+                        int width, int count, int* out);
+
+// Sum of a[i] * b[i] over count floats.
+float KernelDot(const float* a, const float* b, int count);
+
+// Sum of a[i] * a[i] over count floats.
+float KernelSquaredNorm(const float* a, int count);
+
+// y[i] += alpha * x[i] over count floats.
+void KernelAxpy(float alpha, const float* x, float* y, int count);
+
+// x[i] *= alpha over count floats.
+void KernelScale(float alpha, float* x, int count);
+
+// Cosine of a unit-length query against many rows of count floats:
+// out[r] = dot(query, rows[r]) / norms[r]. Rows with a norm of zero or less
+// are skipped, may be NULL, and get 0.
+void KernelCosineBatch(const float* query,
+                       const float* const* rows,
+                       const float* norms,
+                       int rowCount,
+                       int count,
+                       float* out);
+
+// Sum of query[i] * row[i] where row holds IEEE half floats.
+float KernelDotHalf(const float* query, const std::uint16_t* row, int count);
+
+// Sum of query[i] * row[i] where row holds int8 values. The row's scale is
+// left to the caller.
+float KernelDotInt8(const float* query, const std::int8_t* row, int count);
+
+// Convert between float and IEEE half, rounding to nearest even.
+void KernelFloatToHalf(const float* in, std::uint16_t* out, int count);
+void KernelHalfToFloat(const std::uint16_t* in, float* out, int count);
+
+// Name of the instruction set the kernels were dispatched to.
+const char* KernelGetName(void);
+
+#endif
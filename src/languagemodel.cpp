@@ -1,17 +1,182 @@
 #include "languagemodel.h"
 
 #include <fstream>
+#include <cstdint>
 #include <unordered_set>
 #include <unordered_map>
 #include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+// Marks the optional postings section after the spans ("POST").
+static const std::uint32_t LANGUAGE_MODEL_POSTINGS_MAGIC = 0x54534F50u;
+
+// Marks the optional bigram postings section after that ("BIGR").
+static const std::uint32_t LANGUAGE_MODEL_BIGRAMS_MAGIC = 0x52474942u;
+
+// Leads a v2 model file ("LMV2"). A v1 file starts with its vocabulary
+// size instead, which is never this large.
+static const std::uint32_t LANGUAGE_MODEL_FILE_MAGIC   = 0x32564D4Cu;
+static const std::uint32_t LANGUAGE_MODEL_FILE_VERSION = 4u;
+
+// Smallest span table, in slots.
+static const std::size_t LANGUAGE_MODEL_SPAN_TABLE_MIN = 1024;
+
+// Fixed header of a v2 - v4 model file. Every section is an array placed at
+// an 8-byte aligned offset, so a mapped file can be read in place. v3 adds
+// the text width and v4 the span counts at the end; older headers stop just
+// before the fields they lack.
+struct ModelFileHeader {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t vocabCount;
+    std::uint32_t spanCount;
+    std::uint64_t textSize;       // ints in the text, separators included
+    std::uint64_t suffixCount;
+    std::uint64_t tokenLimit;     // entries in the frequency table
+    std::uint64_t postingTokens;  // tokens with a posting list row
+    std::uint64_t postingCount;   // span ids across all token postings
+    std::uint64_t bigramCount;
+    std::uint64_t bigramBytes;
+    std::uint64_t vocabBytes;
+    
+    // Byte offset of each section from the start of the file.
+    std::uint64_t vocabStartOffset;    // uint32 [vocabCount + 1] into vocab bytes
+    std::uint64_t vocabBytesOffset;    // char [vocabBytes]
+    std::uint64_t textOffset;          // int32 [textSize], or packed words
+                                       // [PackedTokens::WordsFor(textSize, textWidth)]
+    std::uint64_t startsOffset;        // uint32 [spanCount + 1]
+    std::uint64_t suffixOffset;        // uint32 [suffixCount]
+    std::uint64_t frequencyOffset;     // uint32 [tokenLimit]
+    std::uint64_t postingStartOffset;  // uint32 [postingTokens + 1]
+    std::uint64_t postingIdsOffset;    // uint32 [postingCount]
+    std::uint64_t bigramKeysOffset;    // uint64 [bigramCount], sorted
+    std::uint64_t bigramCountsOffset;  // uint32 [bigramCount]
+    std::uint64_t bigramLastsOffset;   // uint32 [bigramCount]
+    std::uint64_t bigramStartOffset;   // uint64 [bigramCount + 1] into bigram bytes
+    std::uint64_t bigramBytesOffset;   // varint bytes [bigramBytes]
+    
+    std::uint32_t textWidth;           // bits per packed token, 0 for int32 text
+    std::uint32_t reserved;
+    
+    std::uint64_t countsOffset;        // uint32 [spanCount], 0 if every count is 1
+};
+
+// Hash of a span's tokens, for finding repeated spans.
+static std::uint64_t SpanHash(const int* tokens, std::size_t count) {
+    std::uint64_t hash = 0x9E3779B97F4A7C15ull ^ count;
+    for (std::size_t i = 0; i < count; i++) {
+        hash ^= static_cast<std::uint32_t>(tokens[i]);
+        hash *= 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Pack an adjacent token pair (a,b) into one 64-bit key.
+static std::uint64_t BigramKey(int a, int b) {
+    return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(a)) << 32) ^
+           static_cast<std::uint64_t>(static_cast<std::uint32_t>(b));
+}
+
+// Append an unsigned value seven bits per byte, low bits first; the high
+// bit of each byte flags that another follows.
+static void VarintAppend(std::vector<unsigned char>& bytes, std::uint32_t value) {
+    while (value >= 0x80u) {
+        bytes.push_back(static_cast<unsigned char>(value | 0x80u));
+        value >>= 7;
+    }
+    bytes.push_back(static_cast<unsigned char>(value));
+}
+
+// Call visit(id) for each span id of a delta coded posting list, in order.
+template <typename Visit>
+static void VarintForEach(const BigramList& list, Visit visit) {
+    const unsigned char* in  = list.bytes;
+    const unsigned char* end = in + list.byteCount;
+    std::uint32_t span = 0;
+    
+    while (in < end) {
+        std::uint32_t delta = 0;
+        int shift = 0;
+        while ((*in & 0x80u) && shift < 28) {
+            delta |= static_cast<std::uint32_t>(*in++ & 0x7Fu) << shift;
+            shift += 7;
+        }
+        delta |= static_cast<std::uint32_t>(*in++) << shift;
+        
+        span += delta;
+        visit(span);
+    }
+}
+
+// Decode a whole delta coded posting list into span ids.
+static void VarintDecodePostings(const BigramList& list, std::vector<std::uint32_t>& spans) {
+    VarintForEach(list, [&spans](std::uint32_t span) {
+        spans.push_back(span);
+    });
+}
+
+// True if a delta coded list decodes to its count of increasing span ids,
+// all below spanCount, ending at last.
+static bool CheckBigramList(const BigramList& list, std::uint32_t last, std::uint32_t spanCount) {
+    if (list.byteCount > 0 && (list.bytes[list.byteCount - 1] & 0x80u) != 0) 
+        return false;
+    
+    std::uint32_t count      = 0;
+    std::uint32_t previous   = 0;
+    bool          increasing = true;
+    VarintForEach(list, [&](std::uint32_t span) {
+        if (count > 0 && span <= previous) 
+            increasing = false;
+        previous = span;
+        count++;
+    });
+    return increasing && count == list.count && 
+           (count == 0 || (previous == last && previous < spanCount));
+}
+
+// Set the bit of every span id in a posting list.
+static void MarkPostings(const PostingList& ids, 
+                         const BigramList& packed, 
+                         std::vector<std::uint64_t>& bits) {
+    if (ids.data != NULL) {
+        for (std::size_t i = 0; i < ids.size(); ++i) 
+            bits[ids[i] >> 6] |= 1ull << (ids[i] & 63u);
+        return;
+    }
+    VarintForEach(packed, [&bits](std::uint32_t span) {
+        bits[span >> 6] |= 1ull << (span & 63u);
+    });
+}
 
 LanguageModel::LanguageModel(Tokenizer* tokenizer) : 
-    tok(tokenizer) {}
+    tok(tokenizer),
+    mOffsets(1, 1u),
+    mSpanEncoding(LANGUAGE_MODEL_SPANS_INT32),
+    mText(NULL),
+    mTextSize(0),
+    mStarts(NULL),
+    mSpanCount(0),
+    mCounts(NULL),
+    mSpanTableCount(0),
+    mDeduplicate(false),
+    mMapped(),
+    mPostingLimit(LANGUAGE_MODEL_POSTING_LIMIT),
+    mIndexDirty(true),
+    mGeneration(0) {
+    SyncArena();
+}
+
+LanguageModel::~LanguageModel() {
+    mIndex.Clear();
+    FileUnmap(mMapping);
+}
 
 bool LanguageModel::GetRelevantContext(AttentionSystem& attention,
                                        const std::vector<int>& context,
                                        std::vector<int>& focus) {
-    if (context.empty() || mModel.empty()) 
+    if (context.empty() || size() == 0) 
         return false;
     
     std::vector<int> content;
@@ -31,7 +196,7 @@ bool LanguageModel::GetRelevantContext(AttentionSystem& attention,
         return false;
     
     // Use the existing GetContext to get span-level neighborhoods.
-    std::vector<std::vector<int>> baseFocus;
+    FocusList baseFocus;
     if (!GetContext(content, baseFocus, 1)) {
         return false;
     }
@@ -41,8 +206,9 @@ bool LanguageModel::GetRelevantContext(AttentionSystem& attention,
     // De-duplicate tokens we add to the flat focus list.
     std::unordered_set<int> addedTokens;
     
+    std::vector<int> buffer;
     for (unsigned int si = 0; si < baseFocus.size(); si++) {
-        const std::vector<int>& span = baseFocus[si];
+        SpanView span = baseFocus.GetSpan(si, buffer);
         unsigned int spanSize = span.size();
         if (spanSize == 0) 
             continue;
@@ -65,213 +231,740 @@ bool LanguageModel::GetRelevantContext(AttentionSystem& attention,
     return foundAny;
 }
 
-bool LanguageModel::GetContext(const std::vector<int>& context, std::vector<std::vector<int>>& focus, unsigned int range) {
-    if (context.empty() || mModel.empty())
+bool LanguageModel::GetContext(const std::vector<int>& context, FocusList& focus, unsigned int range) {
+    if (context.empty() || size() == 0)
         return false;
     
     if (range < 1) range = 1;
     unsigned int pre = range-1;
     unsigned int post = range;
     
-    const unsigned int focusMaxSz = 1024 * 740;
-    const unsigned int modelSize  = static_cast<unsigned int>(mModel.size());
-    bool foundAny = false;
+    focus.SetSource(this);
     
-    if (focus.size() > focusMaxSz) {
-        focus.erase(focus.begin(), focus.begin() + focusMaxSz / 4);
+    // If the context is only one token long, fall back to simple single-token
+    // matching through the posting lists.
+    if (context.size() < 2) {
+        std::vector<std::uint32_t> hits;
+        FindSpans(context, hits);
+        return AddNeighborhoods(hits, pre, post, focus);
     }
     
-    // If the context is only one token long, fall back to simple single-token matching
-    if (context.size() < 2) {
-        std::unordered_set<int> contextTokens;
-        contextTokens.reserve(context.size());
-        for (std::size_t i = 0; i < context.size(); ++i) {
-            contextTokens.insert(context[i]);
-        }
+    // Match spans sharing any adjacent token pair with the context, through
+    // the bigram postings.
+    std::vector<std::uint64_t> keys;
+    keys.reserve(context.size());
+    for (std::size_t i = 0; i + 1 < context.size(); ++i) 
+        keys.push_back(BigramKey(context[i], context[i + 1]));
     
-        std::vector<bool> spanAdded(modelSize, false);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    
+    std::vector<std::uint32_t> hits;
+    FindBigramSpans(keys, hits);
+    return AddNeighborhoods(hits, pre, post, focus);
+}
+
+void LanguageModel::AddContext(const std::vector<int>& context) {
+    if (context.empty()) 
+        return;
+    
+    MakeWritable();
+    
+    const std::uint64_t hash = mDeduplicate ? SpanHash(context.data(), context.size()) : 0u;
+    int repeat = mDeduplicate ? FindRepeat(context, hash) : -1;
+    if (repeat >= 0) {
+        // Only the frequencies and weights change; the postings already
+        // hold the span.
+        if (mCountStore[repeat] < 0xFFFFFFFFu) 
+            mCountStore[repeat]++;
+        mIndexDirty = true;
+        return;
+    }
+    
+    if (mSpanEncoding == LANGUAGE_MODEL_SPANS_PACKED) {
+        mPacked.Append(-1);
+        for (std::size_t i = 0; i < context.size(); i++) 
+            mPacked.Append(context[i]);
+        mOffsets.push_back(static_cast<std::uint32_t>(mPacked.size() + 1));
+    } else {
+        mTokens.push_back(-1);
+        mTokens.insert(mTokens.end(), context.begin(), context.end());
+        mOffsets.push_back(static_cast<std::uint32_t>(mTokens.size() + 1));
+    }
+    mCountStore.push_back(1u);
+    SyncArena();
+    
+    if (mDeduplicate) {
+        InsertSpan(size() - 1, hash);
+        mSpanTableCount = size();
+    }
+    
+    AddPostings(size() - 1);
+    mIndexDirty = true;
+}
+
+int LanguageModel::FindRepeat(const std::vector<int>& context, std::uint64_t hash) {
+    SyncSpanTable(size() + 1);
+    
+    const std::size_t mask = mSpanTable.size() - 1;
+    for (std::size_t slot = static_cast<std::size_t>(hash) & mask; mSpanTable[slot] != 0u; slot = (slot + 1) & mask) {
+        unsigned int index = mSpanTable[slot] - 1u;
+        SpanView span = GetSpan(index, mSpanBuffer);
+        if (span.size() == context.size() && std::equal(span.begin(), span.end(), context.begin())) 
+            return static_cast<int>(index);
+    }
+    return -1;
+}
+
+void LanguageModel::SyncSpanTable(unsigned int capacity) {
+    std::size_t slots = LANGUAGE_MODEL_SPAN_TABLE_MIN;
+    while (slots < 2 * static_cast<std::size_t>(capacity)) 
+        slots *= 2;
+    if (slots > mSpanTable.size()) {
+        mSpanTable.assign(slots, 0u);
+        mSpanTableCount = 0;
+    }
+    
+    for (; mSpanTableCount < size(); mSpanTableCount++) {
+        SpanView span = GetSpan(mSpanTableCount, mSpanBuffer);
+        InsertSpan(mSpanTableCount, SpanHash(span.data, span.size()));
+    }
+}
+
+void LanguageModel::InsertSpan(unsigned int index, std::uint64_t hash) {
+    const std::size_t mask = mSpanTable.size() - 1;
+    std::size_t slot = static_cast<std::size_t>(hash) & mask;
+    while (mSpanTable[slot] != 0u) 
+        slot = (slot + 1) & mask;
+    mSpanTable[slot] = index + 1u;
+}
+
+void LanguageModel::FindSpans(const std::vector<int>& tokens, std::vector<std::uint32_t>& spans) {
+    spans.clear();
+    mSources.clear();
+    
+    // Frequent tokens are left out while a rarer one is present; the rarest
+    // of them stands in when every token is frequent.
+    int rarest = -1;
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        PostingList postings = GetPostings(tokens[i]);
+        if (postings.empty()) 
+            continue;
         
-        for (unsigned int si = 0; si < modelSize; ++si) {
-            const std::vector<int>& span = mModel[si];
-            
-            for (std::size_t ti = 0; ti < span.size(); ++ti) {
-                int token = span[ti];
-                
-                if (contextTokens.find(token) != contextTokens.end()) {
-                    // Add this span and its neighbors [si-pre, si+post]
-                    int start = static_cast<int>(si) - pre;
-                    if (start < 0) {
-                        start = 0;
-                    }
-                    int end = static_cast<int>(si) + post;
-                    if (end >= static_cast<int>(modelSize)) {
-                        end = static_cast<int>(modelSize) - 1;
-                    }
-                    
-                    for (int idx = start; idx <= end; ++idx) {
-                        if (!spanAdded[static_cast<unsigned int>(idx)]) {
-                            focus.push_back(mModel[static_cast<unsigned int>(idx)]);
-                            spanAdded[static_cast<unsigned int>(idx)] = true;
-                            foundAny = true;
-                            
-                            if (focus.size() > focusMaxSz) 
-                                break;
-                        }
-                    }
-                    // no need to keep scanning this span
-                    break;
-                }
-            }
+        if (mPostingLimit > 0 && postings.size() > mPostingLimit) {
+            if (rarest < 0 || postings.size() < GetPostings(rarest).size()) 
+                rarest = tokens[i];
+            continue;
         }
         
-        return foundAny;
+        PostingSource source = {postings, BigramList()};
+        mSources.push_back(source);
+        total += postings.size();
     }
     
-    // Build a set of all adjacent token pairs in the context for bi-gram matching.
-    // We encode each pair (a,b) into a 64-bit integer key.
-    std::unordered_set<std::uint64_t> contextPairs;
-    contextPairs.reserve(context.size());
+    if (mSources.empty() && rarest >= 0) {
+        // Take an even sample so the whole model stays represented.
+        PostingList postings = GetPostings(rarest);
+        for (std::size_t i = 0; i < mPostingLimit; ++i) 
+            spans.push_back(postings[i * postings.size() / mPostingLimit]);
+        return;
+    }
     
-    for (std::size_t i = 0; i + 1 < context.size(); ++i) {
-        int a = context[i];
-        int b = context[i + 1];
+    UnionPostings(total, spans);
+}
+
+void LanguageModel::FindBigramSpans(const std::vector<std::uint64_t>& keys, std::vector<std::uint32_t>& spans) {
+    spans.clear();
+    mSources.clear();
+    
+    // Same document frequency policy as FindSpans().
+    BigramList rarest = BigramList();
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        BigramList postings;
+        if (!FindBigram(keys[i], postings)) 
+            continue;
         
-        std::uint64_t key =
-            (static_cast<std::uint64_t>(static_cast<std::uint32_t>(a)) << 32) ^
-            static_cast<std::uint64_t>(static_cast<std::uint32_t>(b));
+        if (mPostingLimit > 0 && postings.count > mPostingLimit) {
+            if (rarest.count == 0 || postings.count < rarest.count) 
+                rarest = postings;
+            continue;
+        }
         
-        contextPairs.insert(key);
+        PostingSource source = {PostingList(), postings};
+        mSources.push_back(source);
+        total += postings.count;
     }
     
-    std::vector<bool> spanAdded(modelSize, false);
+    if (mSources.empty() && rarest.count > 0) {
+        std::vector<std::uint32_t> all;
+        all.reserve(rarest.count);
+        VarintDecodePostings(rarest, all);
+        for (std::size_t i = 0; i < mPostingLimit; ++i) 
+            spans.push_back(all[i * all.size() / mPostingLimit]);
+        return;
+    }
     
-    // Scan each span in the model for any adjacent token pair that matches
-    // one of the bigrams from the context. If it matches, we add the span
-    // and its neighbors to focus.
-    for (unsigned int si = 0; si < modelSize; ++si) {
-        const std::vector<int>& span = mModel[si];
-        // Not enough tokens to form a pair
-        if (span.size() < 2) 
-            continue;
+    UnionPostings(total, spans);
+}
+
+bool LanguageModel::FindBigram(std::uint64_t key, BigramList& list) const {
+    if (mMapping.data != NULL) {
+        const std::uint64_t* keys = mMapped.bigramKeys;
+        const std::uint64_t* it   = std::lower_bound(keys, keys + mMapped.bigramCount, key);
+        if (it == keys + mMapped.bigramCount || *it != key) 
+            return false;
         
-        for (std::size_t ti = 0; ti + 1 < span.size(); ++ti) {
-            int a = span[ti];
-            int b = span[ti + 1];
-            
-            std::uint64_t key =
-                (static_cast<std::uint64_t>(static_cast<std::uint32_t>(a)) << 32) ^
-                static_cast<std::uint64_t>(static_cast<std::uint32_t>(b));
-            
-            if (contextPairs.find(key) != contextPairs.end()) {
-                // Add this span and its neighbors [si-pre, si+post]
-                int start = static_cast<int>(si) - pre;
-                if (start < 0) {
-                    start = 0;
-                }
-                int end = static_cast<int>(si) + post;
-                if (end >= static_cast<int>(modelSize)) {
-                    end = static_cast<int>(modelSize) - 1;
-                }
-                
-                for (int idx = start; idx <= end; ++idx) {
-                    if (!spanAdded[static_cast<unsigned int>(idx)]) {
-                        focus.push_back(mModel[static_cast<unsigned int>(idx)]);
-                        spanAdded[static_cast<unsigned int>(idx)] = true;
-                        foundAny = true;
-                        
-                        if (focus.size() > focusMaxSz) 
-                            break;
-                    }
-                }
-                
-                // Once we know this span matches at least one bigram (and we've
-                // added its neighborhood), we don't need to keep scanning it.
-                break;
+        std::size_t k = static_cast<std::size_t>(it - keys);
+        list.bytes     = mMapped.bigramBytes + mMapped.bigramStart[k];
+        list.byteCount = static_cast<std::size_t>(mMapped.bigramStart[k + 1] - mMapped.bigramStart[k]);
+        list.count     = mMapped.bigramCounts[k];
+        return true;
+    }
+    
+    std::unordered_map<std::uint64_t, BigramPostings>::const_iterator it = mBigrams.find(key);
+    if (it == mBigrams.end()) 
+        return false;
+    
+    list.bytes     = it->second.bytes.data();
+    list.byteCount = it->second.bytes.size();
+    list.count     = it->second.count;
+    return true;
+}
+
+void LanguageModel::UnionPostings(std::size_t total, std::vector<std::uint32_t>& spans) {
+    spans.clear();
+    const std::vector<PostingSource>& sources = mSources;
+    if (sources.empty()) 
+        return;
+    
+    // A single list is already the answer, and a few ids sort faster than
+    // a bitmap over every span can be cleared and scanned.
+    const std::size_t wordCount = (static_cast<std::size_t>(size()) + 63) / 64;
+    if (sources.size() == 1 || total < wordCount) {
+        spans.reserve(total);
+        for (std::size_t i = 0; i < sources.size(); ++i) {
+            const PostingList& ids = sources[i].ids;
+            if (ids.data != NULL) 
+                spans.insert(spans.end(), ids.data, ids.data + ids.size());
+            else 
+                VarintDecodePostings(sources[i].packed, spans);
+        }
+        if (sources.size() > 1) {
+            std::sort(spans.begin(), spans.end());
+            spans.erase(std::unique(spans.begin(), spans.end()), spans.end());
+        }
+        return;
+    }
+    
+    // Each thread marks its share of the lists into its own bitmap, then
+    // ORs one range of words from all of them into the first. Reading the
+    // set bits in order gives the sorted union whatever the thread count.
+    unsigned int threadCount = mPool.GetThreadCount();
+    if (threadCount < 1u) 
+        threadCount = 1u;
+    if (threadCount > sources.size()) 
+        threadCount = static_cast<unsigned int>(sources.size());
+    if (mHitBits.size() < threadCount) 
+        mHitBits.resize(threadCount);
+    
+    std::vector<std::vector<std::uint64_t>>& hitBits = mHitBits;
+    mPool.Run(threadCount, [&](unsigned int t) {
+        std::vector<std::uint64_t>& bits = hitBits[t];
+        bits.assign(wordCount, 0ull);
+        for (std::size_t i = t; i < sources.size(); i += threadCount) 
+            MarkPostings(sources[i].ids, sources[i].packed, bits);
+    });
+    
+    if (threadCount > 1u) {
+        const std::size_t chunkSize = (wordCount + threadCount - 1) / threadCount;
+        mPool.Run(threadCount, [&](unsigned int chunk) {
+            std::size_t first = chunk * chunkSize;
+            std::size_t last  = std::min(first + chunkSize, wordCount);
+            std::vector<std::uint64_t>& merged = hitBits[0];
+            for (unsigned int t = 1; t < threadCount; ++t) {
+                const std::vector<std::uint64_t>& bits = hitBits[t];
+                for (std::size_t w = first; w < last; ++w) 
+                    merged[w] |= bits[w];
             }
+        });
+    }
+    
+    const std::vector<std::uint64_t>& merged = hitBits[0];
+    for (std::size_t w = 0; w < wordCount; ++w) {
+        std::uint64_t word = merged[w];
+        while (word != 0) {
+            int bit = __builtin_ctzll(word);
+            spans.push_back(static_cast<std::uint32_t>(w * 64 + static_cast<std::size_t>(bit)));
+            word &= word - 1;
         }
     }
+}
+
+void LanguageModel::SetThreadCount(unsigned int count) {
+    mPool.SetThreadCount(count);
+}
+
+unsigned int LanguageModel::GetThreadCount(void) const {
+    return mPool.GetThreadCount();
+}
+
+bool LanguageModel::AddNeighborhoods(const std::vector<std::uint32_t>& hits,
+                                     unsigned int pre,
+                                     unsigned int post,
+                                     FocusList& focus) const {
+    const unsigned int modelSize = size();
+    
+    // Past the capacity the ring would start evicting spans from this very
+    // lookup, so stop there.
+    const std::size_t addMax = focus.GetCapacity();
+    std::size_t added = 0;
+    
+    // Hits are sorted, so the neighborhoods only move forward and everything
+    // below next has already been added.
+    unsigned int next = 0;
+    bool foundAny = false;
+    
+    for (std::size_t h = 0; h < hits.size(); ++h) {
+        unsigned int si = hits[h];
+        
+        unsigned int start = (si > pre) ? si - pre : 0;
+        if (start < next) 
+            start = next;
+        unsigned int end = (si + post < modelSize) ? si + post : modelSize - 1;
+        
+        for (unsigned int idx = start; idx <= end; ++idx) {
+            if (added == addMax) 
+                return foundAny;
+            
+            focus.Add(idx);
+            added++;
+            foundAny = true;
+        }
+        if (end + 1 > next) 
+            next = end + 1;
+    }
     
     return foundAny;
 }
 
-void LanguageModel::AddContext(const std::vector<int>& context) {
-    if (context.empty()) 
-        return;
+PostingList LanguageModel::GetPostings(int token) const {
+    if (mMapping.data != NULL) {
+        if (token < 0 || static_cast<std::size_t>(token) >= mMapped.postingTokens) 
+            return PostingList();
+        std::uint32_t first = mMapped.postingStart[token];
+        return PostingList(mMapped.postingIds + first, mMapped.postingStart[token + 1] - first);
+    }
+    
+    if (token < 0 || token >= static_cast<int>(mPostings.size())) 
+        return PostingList();
+    const std::vector<std::uint32_t>& postings = mPostings[static_cast<std::size_t>(token)];
+    return PostingList(postings.data(), postings.size());
+}
+
+void LanguageModel::SetPostingLimit(unsigned int limit) {
+    mPostingLimit = limit;
+}
+
+unsigned int LanguageModel::GetPostingLimit(void) const {
+    return mPostingLimit;
+}
+
+void LanguageModel::AddPostings(unsigned int index) {
+    SpanView span = GetSpan(index, mSpanBuffer);
+    for (std::size_t i = 0; i < span.size(); ++i) {
+        int token = span[i];
+        if (token < 0) 
+            continue;
+        
+        if (token >= static_cast<int>(mPostings.size())) 
+            mPostings.resize(static_cast<std::size_t>(token) + 1);
+        
+        // Spans are indexed in order, so a repeat within the span is always
+        // the last entry.
+        std::vector<std::uint32_t>& postings = mPostings[static_cast<std::size_t>(token)];
+        if (postings.empty() || postings.back() != index) 
+            postings.push_back(index);
+    }
     
-    mModel.push_back(context);
+    for (std::size_t i = 0; i + 1 < span.size(); ++i) {
+        BigramPostings& postings = mBigrams[BigramKey(span[i], span[i + 1])];
+        if (postings.count > 0 && postings.last == index) 
+            continue;
+        
+        // The first id is stored as is, every later one as the gap from
+        // the one before.
+        VarintAppend(postings.bytes, index - postings.last);
+        postings.last = index;
+        postings.count++;
+    }
+}
+
+void LanguageModel::BuildPostings(void) {
+    mPostings.clear();
+    mBigrams.clear();
+    for (unsigned int i = 0; i < size(); i++) 
+        AddPostings(i);
 }
 
 
-bool LanguageModel::SaveToFile(const std::string& filename) const {
+// Pad a v2 file with zeros up to the next 8-byte boundary.
+static void WriteAlign(std::ostream& out, std::uint64_t& offset) {
+    static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    std::uint64_t pad = (8u - (offset & 7u)) & 7u;
+    out.write(zeros, static_cast<std::streamsize>(pad));
+    offset += pad;
+}
+
+// Write one section at the next aligned offset and record where it went.
+static void WriteSection(std::ostream& out, std::uint64_t& offset, std::uint64_t& sectionOffset, 
+                         const void* data, std::uint64_t bytes) {
+    WriteAlign(out, offset);
+    sectionOffset = offset;
+    if (bytes > 0) 
+        out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+    offset += bytes;
+}
+
+bool LanguageModel::SaveToFile(const std::string& filename) {
     if (tok == nullptr) 
         return false;
     
+    // Writing over the file this model is mapped from would pull the pages
+    // out from under it.
+    MakeWritable();
+    
+    const SuffixIndex& index = GetIndex();
+    
+    // Vocabulary as one string table: offsets into a block of characters.
+    const std::size_t vocabCount = tok->tokenToWord.size();
+    std::vector<std::uint32_t> vocabStart(vocabCount + 1, 0u);
+    std::string vocabBytes;
+    for (std::size_t i = 0; i < vocabCount; i++) {
+        vocabBytes += tok->tokenToWord[i];
+        vocabStart[i + 1] = static_cast<std::uint32_t>(vocabBytes.size());
+    }
+    
+    // Token postings as one table of rows.
+    std::vector<std::uint32_t> postingStart(mPostings.size() + 1, 0u);
+    std::vector<std::uint32_t> postingIds;
+    for (std::size_t t = 0; t < mPostings.size(); t++) {
+        postingIds.insert(postingIds.end(), mPostings[t].begin(), mPostings[t].end());
+        postingStart[t + 1] = static_cast<std::uint32_t>(postingIds.size());
+    }
+    
+    // Bigram postings in key order, so lookups can binary search the keys
+    // and the same model always saves the same bytes.
+    std::vector<std::uint64_t> bigramKeys;
+    bigramKeys.reserve(mBigrams.size());
+    for (std::unordered_map<std::uint64_t, BigramPostings>::const_iterator it = mBigrams.begin(); it != mBigrams.end(); ++it) 
+        bigramKeys.push_back(it->first);
+    std::sort(bigramKeys.begin(), bigramKeys.end());
+    
+    std::vector<std::uint32_t> bigramCounts(bigramKeys.size());
+    std::vector<std::uint32_t> bigramLasts(bigramKeys.size());
+    std::vector<std::uint64_t> bigramStart(bigramKeys.size() + 1, 0u);
+    for (std::size_t k = 0; k < bigramKeys.size(); k++) {
+        const BigramPostings& postings = mBigrams.find(bigramKeys[k])->second;
+        bigramCounts[k]    = postings.count;
+        bigramLasts[k]     = postings.last;
+        bigramStart[k + 1] = bigramStart[k] + postings.bytes.size();
+    }
+    
     std::ofstream out(filename.c_str(), std::ios::binary);
     if (!out.is_open()) 
         return false;
     
-    // Save tokenizer vocabulary
-    std::uint32_t vocabSize = static_cast<std::uint32_t>(tok->tokenToWord.size());
-    out.write(reinterpret_cast<const char*>(&vocabSize), sizeof(vocabSize));
+    ModelFileHeader header = ModelFileHeader();
+    header.magic         = LANGUAGE_MODEL_FILE_MAGIC;
+    header.version       = LANGUAGE_MODEL_FILE_VERSION;
+    header.vocabCount    = static_cast<std::uint32_t>(vocabCount);
+    header.spanCount     = size();
+    header.textSize      = mTextSize;
+    header.suffixCount   = index.GetSuffixCount();
+    header.tokenLimit    = index.GetTokenLimit();
+    header.postingTokens = mPostings.size();
+    header.postingCount  = postingIds.size();
+    header.bigramCount   = bigramKeys.size();
+    header.bigramBytes   = bigramStart.back();
+    header.vocabBytes    = vocabBytes.size();
+    
+    // An empty model has no packed words to write, so it is always saved
+    // as int32 text.
+    const bool packed = mSpanEncoding == LANGUAGE_MODEL_SPANS_PACKED && mTextSize > 0;
+    if (packed) 
+        header.textWidth = static_cast<std::uint32_t>(mPacked.GetWidth());
+    
+    // The header goes first with the offsets still zero, and is rewritten
+    // once every section has been placed.
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    std::uint64_t offset = sizeof(header);
+    
+    WriteSection(out, offset, header.vocabStartOffset, vocabStart.data(), 
+                 sizeof(std::uint32_t) * vocabStart.size());
+    WriteSection(out, offset, header.vocabBytesOffset, vocabBytes.data(), vocabBytes.size());
+    if (packed) 
+        WriteSection(out, offset, header.textOffset, mPacked.GetWords(), 
+                     sizeof(std::uint64_t) * mPacked.GetWordCount());
+    else 
+        WriteSection(out, offset, header.textOffset, mText, sizeof(std::int32_t) * mTextSize);
+    WriteSection(out, offset, header.startsOffset, mStarts, 
+                 sizeof(std::uint32_t) * (static_cast<std::uint64_t>(size()) + 1));
+    WriteSection(out, offset, header.countsOffset, mCounts, 
+                 sizeof(std::uint32_t) * static_cast<std::uint64_t>(size()));
+    WriteSection(out, offset, header.suffixOffset, index.GetSuffixData(), 
+                 sizeof(std::uint32_t) * header.suffixCount);
+    WriteSection(out, offset, header.frequencyOffset, index.GetFrequencyData(), 
+                 sizeof(std::uint32_t) * header.tokenLimit);
+    WriteSection(out, offset, header.postingStartOffset, postingStart.data(), 
+                 sizeof(std::uint32_t) * postingStart.size());
+    WriteSection(out, offset, header.postingIdsOffset, postingIds.data(), 
+                 sizeof(std::uint32_t) * postingIds.size());
+    WriteSection(out, offset, header.bigramKeysOffset, bigramKeys.data(), 
+                 sizeof(std::uint64_t) * bigramKeys.size());
+    WriteSection(out, offset, header.bigramCountsOffset, bigramCounts.data(), 
+                 sizeof(std::uint32_t) * bigramCounts.size());
+    WriteSection(out, offset, header.bigramLastsOffset, bigramLasts.data(), 
+                 sizeof(std::uint32_t) * bigramLasts.size());
+    WriteSection(out, offset, header.bigramStartOffset, bigramStart.data(), 
+                 sizeof(std::uint64_t) * bigramStart.size());
+    
+    WriteAlign(out, offset);
+    header.bigramBytesOffset = offset;
+    for (std::size_t k = 0; k < bigramKeys.size(); k++) {
+        const std::vector<unsigned char>& bytes = mBigrams.find(bigramKeys[k])->second.bytes;
+        out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    }
     if (!out.good()) 
         return false;
     
-    for (std::uint32_t i = 0; i < vocabSize; i++) {
-        const std::string& word = tok->tokenToWord[static_cast<std::size_t>(i)];
-        
-        // FIX: index should be the token index (i), not word.size()
-        std::uint32_t index = i;
-        std::uint32_t len   = static_cast<std::uint32_t>(word.size());
-        
-        out.write(reinterpret_cast<const char*>(&index), sizeof(index));
-        out.write(reinterpret_cast<const char*>(&len),   sizeof(len));
-        if (!out.good()) 
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    return out.good();
+}
+
+
+bool LanguageModel::LoadFromFile(const std::string& filename) {
+    if (tok == nullptr) 
+        return false;
+    
+    Reset();
+    
+    std::uint32_t magic = 0;
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if (!in.is_open()) 
+            return false;
+        in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        if (!in.good()) 
             return false;
-        
-        if (len > 0) {
-            out.write(word.data(), static_cast<std::streamsize>(len));
-            if (!out.good()) {
-                return false;
-            }
-        }
     }
     
-    // Save model spans
-    std::uint32_t spanCount = static_cast<std::uint32_t>(mModel.size());
-    out.write(reinterpret_cast<const char*>(&spanCount), sizeof(spanCount));
-    if (!out.good()) 
+    if (magic == LANGUAGE_MODEL_FILE_MAGIC) 
+        return LoadMapped(filename);
+    return LoadStream(filename);
+}
+
+bool LanguageModel::LoadMapped(const std::string& filename) {
+    if (!FileMapRead(filename, mMapping)) 
         return false;
     
-    for (std::uint32_t i = 0; i < spanCount; i++) {
-        const std::vector<int>& span = mModel[static_cast<std::size_t>(i)];
-        std::uint32_t spanLen = static_cast<std::uint32_t>(span.size());
+    const unsigned char* base     = mMapping.data;
+    const std::uint64_t  fileSize = mMapping.size;
+    
+    // Older headers are the v4 one cut short; the fields they lack stay 0,
+    // which is int32 text and no span counts.
+    ModelFileHeader header = ModelFileHeader();
+    std::uint32_t version = 0;
+    if (fileSize >= 8) 
+        std::memcpy(&version, base + 4, sizeof(version));
+    std::size_t headerSize = sizeof(header);
+    if (version == 2u) 
+        headerSize = offsetof(ModelFileHeader, textWidth);
+    else if (version == 3u) 
+        headerSize = offsetof(ModelFileHeader, countsOffset);
+    bool valid = fileSize >= headerSize;
+    if (valid) {
+        std::memcpy(&header, base, headerSize);
+        valid = header.magic == LANGUAGE_MODEL_FILE_MAGIC && 
+                header.version >= 2u && header.version <= LANGUAGE_MODEL_FILE_VERSION && 
+                header.textWidth <= 32u && 
+                header.textSize < 0xFFFFFFFFull && 
+                header.postingTokens < 0xFFFFFFFFull && 
+                header.suffixCount <= fileSize && 
+                header.tokenLimit <= fileSize && 
+                header.postingCount <= fileSize && 
+                header.bigramCount <= fileSize;
+    }
+    
+    // Every section must be aligned and lie inside the file. The counts are
+    // bounded by the file size first so the byte sizes cannot overflow.
+    struct Section {
+        std::uint64_t offset;
+        std::uint64_t bytes;
+    };
+    if (valid) {
+        const Section sections[] = {
+            {header.vocabStartOffset,   4ull * (header.vocabCount + 1ull)},
+            {header.vocabBytesOffset,   header.vocabBytes},
+            {header.textOffset,         header.textWidth > 0 ? 
+                                        8ull * PackedTokens::WordsFor(header.textSize, header.textWidth) : 
+                                        4ull * header.textSize},
+            {header.startsOffset,       4ull * (header.spanCount + 1ull)},
+            {header.countsOffset,       header.countsOffset != 0 ? 4ull * header.spanCount : 0ull},
+            {header.suffixOffset,       4ull * header.suffixCount},
+            {header.frequencyOffset,    4ull * header.tokenLimit},
+            {header.postingStartOffset, 4ull * (header.postingTokens + 1)},
+            {header.postingIdsOffset,   4ull * header.postingCount},
+            {header.bigramKeysOffset,   8ull * header.bigramCount},
+            {header.bigramCountsOffset, 4ull * header.bigramCount},
+            {header.bigramLastsOffset,  4ull * header.bigramCount},
+            {header.bigramStartOffset,  8ull * (header.bigramCount + 1)},
+            {header.bigramBytesOffset,  header.bigramBytes}
+        };
+        for (std::size_t i = 0; valid && i < sizeof(sections) / sizeof(sections[0]); i++) {
+            valid = (sections[i].offset & 7u) == 0 && 
+                    sections[i].offset <= fileSize && 
+                    sections[i].bytes <= fileSize - sections[i].offset;
+        }
+    }
+    
+    const std::uint32_t* vocabStart = NULL;
+    const std::uint32_t* starts     = NULL;
+    const std::uint32_t* postStart  = NULL;
+    const std::uint64_t* keys       = NULL;
+    const std::uint64_t* byteStart  = NULL;
+    if (valid) {
+        vocabStart = reinterpret_cast<const std::uint32_t*>(base + header.vocabStartOffset);
+        starts     = reinterpret_cast<const std::uint32_t*>(base + header.startsOffset);
+        postStart  = reinterpret_cast<const std::uint32_t*>(base + header.postingStartOffset);
+        keys       = reinterpret_cast<const std::uint64_t*>(base + header.bigramKeysOffset);
+        byteStart  = reinterpret_cast<const std::uint64_t*>(base + header.bigramStartOffset);
         
-        out.write(reinterpret_cast<const char*>(&spanLen), sizeof(spanLen));
-        if (!out.good()) 
-            return false;
+        // Check the tables that say where things are, so no lookup can run
+        // off the end of a section. The bulk arrays are checked below.
+        valid = vocabStart[0] == 0 && starts[0] == 1 && postStart[0] == 0 && byteStart[0] == 0 && 
+                vocabStart[header.vocabCount] == header.vocabBytes && 
+                starts[header.spanCount] == header.textSize + 1 && 
+                postStart[header.postingTokens] == header.postingCount && 
+                byteStart[header.bigramCount] == header.bigramBytes;
+        for (std::uint32_t i = 0; valid && i < header.vocabCount; i++) 
+            valid = vocabStart[i] <= vocabStart[i + 1];
+        for (std::uint32_t i = 0; valid && i < header.spanCount; i++) 
+            valid = starts[i] < starts[i + 1];
+        for (std::uint64_t i = 0; valid && i < header.postingTokens; i++) 
+            valid = postStart[i] <= postStart[i + 1];
+        for (std::uint64_t i = 0; valid && i < header.bigramCount; i++) 
+            valid = byteStart[i] <= byteStart[i + 1] && (i == 0 || keys[i - 1] < keys[i]);
+    }
+    
+    // Every span id and text position in the bulk arrays must lie inside
+    // the model, as the v1 reader checks, since lookups use them unchecked.
+    // One pass over each array.
+    if (valid) {
+        const std::uint32_t* ids = reinterpret_cast<const std::uint32_t*>(base + header.postingIdsOffset);
+        for (std::uint64_t t = 0; valid && t < header.postingTokens; t++) {
+            for (std::uint32_t i = postStart[t]; valid && i < postStart[t + 1]; i++) 
+                valid = ids[i] < header.spanCount && (i == postStart[t] || ids[i] > ids[i - 1]);
+        }
         
-        for (std::uint32_t j = 0; j < spanLen; j++) {
-            std::int32_t tokVal = static_cast<std::int32_t>(span[static_cast<std::size_t>(j)]);
-            out.write(reinterpret_cast<const char*>(&tokVal), sizeof(tokVal));
-            if (!out.good()) {
-                return false;
-            }
+        const std::uint32_t* counts = reinterpret_cast<const std::uint32_t*>(base + header.bigramCountsOffset);
+        const std::uint32_t* lasts  = reinterpret_cast<const std::uint32_t*>(base + header.bigramLastsOffset);
+        const unsigned char* bytes  = base + header.bigramBytesOffset;
+        for (std::uint64_t k = 0; valid && k < header.bigramCount; k++) {
+            BigramList list = {bytes + byteStart[k], 
+                               static_cast<std::size_t>(byteStart[k + 1] - byteStart[k]), 
+                               counts[k]};
+            valid = CheckBigramList(list, lasts[k], header.spanCount);
+        }
+        
+        // Suffix positions must have a next token, and reading backwards
+        // from one must reach a separator, so each span is checked to
+        // follow one.
+        const std::uint32_t* suffix = reinterpret_cast<const std::uint32_t*>(base + header.suffixOffset);
+        for (std::uint64_t i = 0; valid && i < header.suffixCount; i++) 
+            valid = suffix[i] >= 1u && suffix[i] + 1ull < header.textSize;
+        
+        PackedTokens packed;
+        const int*   text = reinterpret_cast<const int*>(base + header.textOffset);
+        if (header.textWidth > 0) 
+            packed.Adopt(reinterpret_cast<const std::uint64_t*>(base + header.textOffset), 
+                         static_cast<std::size_t>(header.textSize), 
+                         static_cast<int>(header.textWidth));
+        for (std::uint32_t s = 0; valid && s < header.spanCount; s++) {
+            std::size_t separator = starts[s] - 1u;
+            valid = (header.textWidth > 0 ? packed.Get(separator) : text[separator]) < 0;
         }
     }
     
-    return out.good();
-}
-
-
-bool LanguageModel::LoadFromFile(const std::string& filename) {
-    if (tok == nullptr) 
+    if (!valid) {
+        FileUnmap(mMapping);
         return false;
+    }
     
+    // The vocabulary is the one part copied out, into the tokenizer.
+    const char* vocabBytes = reinterpret_cast<const char*>(base + header.vocabBytesOffset);
+    tok->tokenToWord.clear();
+    tok->wordToToken.clear();
+    tok->tokenToWord.resize(static_cast<std::size_t>(header.vocabCount));
+    tok->wordToToken.reserve(static_cast<std::size_t>(header.vocabCount));
+    for (std::uint32_t i = 0; i < header.vocabCount; i++) {
+        std::string word(vocabBytes + vocabStart[i], vocabStart[i + 1] - vocabStart[i]);
+        tok->wordToToken[word] = static_cast<int>(i);
+        tok->tokenToWord[i].swap(word);
+    }
+    
+    mStarts    = starts;
+    mSpanCount = header.spanCount;
+    mCounts    = header.countsOffset != 0 ? 
+                 reinterpret_cast<const std::uint32_t*>(base + header.countsOffset) : NULL;
+    if (header.textWidth > 0) {
+        mSpanEncoding = LANGUAGE_MODEL_SPANS_PACKED;
+        mPacked.Adopt(reinterpret_cast<const std::uint64_t*>(base + header.textOffset), 
+                      static_cast<std::size_t>(header.textSize), 
+                      static_cast<int>(header.textWidth));
+        mText     = NULL;
+        mTextSize = mPacked.size();
+    } else {
+        mSpanEncoding = LANGUAGE_MODEL_SPANS_INT32;
+        mText     = reinterpret_cast<const int*>(base + header.textOffset);
+        mTextSize = static_cast<std::size_t>(header.textSize);
+    }
+    
+    mMapped.postingStart  = postStart;
+    mMapped.postingIds    = reinterpret_cast<const std::uint32_t*>(base + header.postingIdsOffset);
+    mMapped.postingTokens = static_cast<std::size_t>(header.postingTokens);
+    mMapped.bigramKeys    = keys;
+    mMapped.bigramCounts  = reinterpret_cast<const std::uint32_t*>(base + header.bigramCountsOffset);
+    mMapped.bigramLasts   = reinterpret_cast<const std::uint32_t*>(base + header.bigramLastsOffset);
+    mMapped.bigramStart   = byteStart;
+    mMapped.bigramBytes   = base + header.bigramBytesOffset;
+    mMapped.bigramCount   = static_cast<std::size_t>(header.bigramCount);
+    
+    const std::uint32_t* suffix    = reinterpret_cast<const std::uint32_t*>(base + header.suffixOffset);
+    const std::uint32_t* frequency = reinterpret_cast<const std::uint32_t*>(base + header.frequencyOffset);
+    if (mText == NULL) 
+        mIndex.Adopt(mPacked, mStarts, mSpanCount, mCounts, 
+                     suffix, static_cast<std::size_t>(header.suffixCount), 
+                     frequency, static_cast<std::size_t>(header.tokenLimit), 
+                     false);
+    else 
+        mIndex.Adopt(mText, mTextSize, mStarts, mSpanCount, mCounts, 
+                     suffix, static_cast<std::size_t>(header.suffixCount), 
+                     frequency, static_cast<std::size_t>(header.tokenLimit), 
+                     false);
+    mIndexDirty = false;
+    
+    return true;
+}
+
+bool LanguageModel::LoadStream(const std::string& filename) {
     std::ifstream in(filename.c_str(), std::ios::binary);
     if (!in.is_open()) 
         return false;
     
-    mModel.clear();
+    mSpanEncoding = LANGUAGE_MODEL_SPANS_INT32;
     
     // Load tokenizer vocabulary
     std::uint32_t vocabSize = 0;
@@ -328,39 +1021,309 @@ bool LanguageModel::LoadFromFile(const std::string& filename) {
         return false;
     }
     
-    mModel.reserve(static_cast<std::size_t>(spanCount));
+    mOffsets.reserve(static_cast<std::size_t>(spanCount) + 1);
     
     for (std::uint32_t i = 0; i < spanCount; i++) {
         std::uint32_t spanLen = 0;
         in.read(reinterpret_cast<char*>(&spanLen), sizeof(spanLen));
         if (!in.good()) {
-            mModel.clear();
+            Reset();
             tok->tokenToWord.clear();
             tok->wordToToken.clear();
             return false;
         }
         
-        std::vector<int> span;
-        span.reserve(static_cast<std::size_t>(spanLen));
+        // Tokens are stored as int32, so each span is read straight into
+        // the arena after its separator.
+        std::size_t first = mTokens.size() + 1;
+        mTokens.resize(first + spanLen, -1);
+        if (spanLen > 0) 
+            in.read(reinterpret_cast<char*>(&mTokens[first]), 
+                    static_cast<std::streamsize>(sizeof(std::int32_t) * spanLen));
+        if (!in.good()) {
+            Reset();
+            tok->tokenToWord.clear();
+            tok->wordToToken.clear();
+            return false;
+        }
         
-        for (std::uint32_t j = 0; j < spanLen; j++) {
-            std::int32_t tok32 = 0;
-            in.read(reinterpret_cast<char*>(&tok32), sizeof(tok32));
-            if (!in.good()) {
-                mModel.clear();
-                tok->tokenToWord.clear();
-                tok->wordToToken.clear();
+        mOffsets.push_back(static_cast<std::uint32_t>(mTokens.size() + 1));
+    }
+    
+    // v1 files hold every occurrence as its own span.
+    mCountStore.assign(static_cast<std::size_t>(spanCount), 1u);
+    SyncArena();
+    
+    // Files written before the postings sections existed end here.
+    if (!LoadPostings(in) || !LoadBigrams(in)) 
+        BuildPostings();
+    
+    return true;
+}
+
+bool LanguageModel::LoadPostings(std::istream& in) {
+    mPostings.clear();
+    
+    std::uint32_t magic      = 0;
+    std::uint32_t tokenCount = 0;
+    in.read(reinterpret_cast<char*>(&magic),      sizeof(magic));
+    in.read(reinterpret_cast<char*>(&tokenCount), sizeof(tokenCount));
+    if (!in.good() || magic != LANGUAGE_MODEL_POSTINGS_MAGIC) 
+        return false;
+    
+    mPostings.resize(static_cast<std::size_t>(tokenCount));
+    
+    for (std::uint32_t t = 0; t < tokenCount; t++) {
+        std::uint32_t count = 0;
+        in.read(reinterpret_cast<char*>(&count), sizeof(count));
+        if (!in.good() || count > size()) {
+            mPostings.clear();
+            return false;
+        }
+        
+        std::vector<std::uint32_t>& postings = mPostings[static_cast<std::size_t>(t)];
+        postings.resize(static_cast<std::size_t>(count));
+        if (count > 0) 
+            in.read(reinterpret_cast<char*>(postings.data()), 
+                    static_cast<std::streamsize>(sizeof(std::uint32_t) * count));
+        if (!in.good()) {
+            mPostings.clear();
+            return false;
+        }
+        
+        // Lists must be strictly increasing span ids of this model.
+        for (std::uint32_t i = 0; i < count; i++) {
+            if (postings[i] >= size() || (i > 0 && postings[i] <= postings[i - 1])) {
+                mPostings.clear();
                 return false;
             }
-            span.push_back(static_cast<int>(tok32));
+        }
+    }
+    
+    return true;
+}
+
+bool LanguageModel::LoadBigrams(std::istream& in) {
+    mBigrams.clear();
+    
+    std::uint32_t magic    = 0;
+    std::uint64_t keyCount = 0;
+    in.read(reinterpret_cast<char*>(&magic),    sizeof(magic));
+    in.read(reinterpret_cast<char*>(&keyCount), sizeof(keyCount));
+    if (!in.good() || magic != LANGUAGE_MODEL_BIGRAMS_MAGIC || keyCount > GetTokenCount()) 
+        return false;
+    
+    mBigrams.reserve(static_cast<std::size_t>(keyCount));
+    
+    for (std::uint64_t k = 0; k < keyCount; k++) {
+        std::uint64_t key       = 0;
+        std::uint32_t byteCount = 0;
+        BigramPostings postings;
+        
+        in.read(reinterpret_cast<char*>(&key),            sizeof(key));
+        in.read(reinterpret_cast<char*>(&postings.count), sizeof(postings.count));
+        in.read(reinterpret_cast<char*>(&postings.last),  sizeof(postings.last));
+        in.read(reinterpret_cast<char*>(&byteCount),      sizeof(byteCount));
+        if (!in.good() || postings.count > size() || byteCount > 5u * postings.count) {
+            mBigrams.clear();
+            return false;
         }
         
-        mModel.push_back(span);
+        postings.bytes.resize(static_cast<std::size_t>(byteCount));
+        in.read(reinterpret_cast<char*>(postings.bytes.data()), 
+                static_cast<std::streamsize>(byteCount));
+        if (!in.good()) {
+            mBigrams.clear();
+            return false;
+        }
+        
+        BigramList list = {postings.bytes.data(), postings.bytes.size(), postings.count};
+        if (!CheckBigramList(list, postings.last, size())) {
+            mBigrams.clear();
+            return false;
+        }
+        
+        mBigrams[key] = postings;
     }
     
     return true;
 }
 
 unsigned int LanguageModel::size(void) const {
-    return mModel.size();
+    return mSpanCount;
+}
+
+SpanView LanguageModel::GetSpan(unsigned int index, std::vector<int>& buffer) const {
+    std::uint32_t first  = mStarts[index];
+    std::size_t   length = mStarts[index + 1] - 1 - first;
+    if (mText != NULL) 
+        return SpanView(mText + first, length);
+    
+    buffer.resize(length);
+    mPacked.Decode(first, length, buffer.data());
+    return SpanView(buffer.data(), length);
+}
+
+std::size_t LanguageModel::GetTokenCount(void) const {
+    return mTextSize - mSpanCount;
+}
+
+unsigned int LanguageModel::GetOccurrences(unsigned int index) const {
+    if (mCounts == NULL) 
+        return 1u;
+    return mCounts[index];
+}
+
+unsigned int LanguageModel::GetGeneration(void) const {
+    return mGeneration;
+}
+
+bool LanguageModel::IsMapped(void) const {
+    return mMapping.data != NULL;
+}
+
+void LanguageModel::SetSpanEncoding(int encoding) {
+    if (encoding != LANGUAGE_MODEL_SPANS_PACKED) 
+        encoding = LANGUAGE_MODEL_SPANS_INT32;
+    if (encoding == mSpanEncoding) 
+        return;
+    
+    MakeWritable();
+    
+    if (encoding == LANGUAGE_MODEL_SPANS_PACKED) {
+        mPacked.Assign(mTokens.data(), mTokens.size());
+        std::vector<int>().swap(mTokens);
+    } else {
+        mTokens.resize(mPacked.size());
+        mPacked.Decode(0, mPacked.size(), mTokens.data());
+        mPacked.Clear();
+    }
+    mSpanEncoding = encoding;
+    
+    SyncArena();
+    RebindIndex();
+}
+
+int LanguageModel::GetSpanEncoding(void) const {
+    return mSpanEncoding;
+}
+
+void LanguageModel::SetDeduplication(bool dedup) {
+    mDeduplicate = dedup;
+    
+    // The table is only kept up to date while deduplicating.
+    if (!dedup) {
+        std::vector<std::uint32_t>().swap(mSpanTable);
+        mSpanTableCount = 0;
+    }
+}
+
+bool LanguageModel::GetDeduplication(void) const {
+    return mDeduplicate;
+}
+
+std::size_t LanguageModel::GetSpanMemoryUsage(void) const {
+    return mTokens.capacity()     * sizeof(int) + 
+           mOffsets.capacity()    * sizeof(std::uint32_t) + 
+           mCountStore.capacity() * sizeof(std::uint32_t) + 
+           mSpanTable.capacity()  * sizeof(std::uint32_t) + 
+           mPacked.GetMemoryUsage();
+}
+
+const SuffixIndex& LanguageModel::GetIndex(void) {
+    if (mIndexDirty) {
+        if (mText == NULL) 
+            mIndex.Build(mPacked, mStarts, mSpanCount, mCounts);
+        else 
+            mIndex.Build(mText, mTextSize, mStarts, mSpanCount, mCounts);
+        mIndexDirty = false;
+    }
+    return mIndex;
+}
+
+void LanguageModel::SyncArena(void) {
+    if (mSpanEncoding == LANGUAGE_MODEL_SPANS_PACKED) {
+        mText     = NULL;
+        mTextSize = mPacked.size();
+    } else {
+        mText     = mTokens.data();
+        mTextSize = mTokens.size();
+    }
+    mStarts    = mOffsets.data();
+    mSpanCount = static_cast<unsigned int>(mOffsets.size() - 1);
+    mCounts    = mCountStore.data();
+}
+
+void LanguageModel::RebindIndex(void) {
+    if (mIndexDirty) 
+        return;
+    
+    if (mText == NULL) 
+        mIndex.Adopt(mPacked, mStarts, mSpanCount, mCounts, 
+                     mIndex.GetSuffixData(), mIndex.GetSuffixCount(), 
+                     mIndex.GetFrequencyData(), mIndex.GetTokenLimit(), 
+                     true);
+    else 
+        mIndex.Adopt(mText, mTextSize, mStarts, mSpanCount, mCounts, 
+                     mIndex.GetSuffixData(), mIndex.GetSuffixCount(), 
+                     mIndex.GetFrequencyData(), mIndex.GetTokenLimit(), 
+                     true);
+}
+
+void LanguageModel::MakeWritable(void) {
+    if (!IsMapped()) 
+        return;
+    
+    if (mSpanEncoding == LANGUAGE_MODEL_SPANS_PACKED) 
+        mPacked.Own();
+    else 
+        mTokens.assign(mText, mText + mTextSize);
+    mOffsets.assign(mStarts, mStarts + mSpanCount + 1);
+    if (mCounts != NULL) 
+        mCountStore.assign(mCounts, mCounts + mSpanCount);
+    else 
+        mCountStore.assign(mSpanCount, 1u);
+    
+    mPostings.assign(mMapped.postingTokens, std::vector<std::uint32_t>());
+    for (std::size_t t = 0; t < mMapped.postingTokens; t++) {
+        PostingList postings = GetPostings(static_cast<int>(t));
+        mPostings[t].assign(postings.data, postings.data + postings.size());
+    }
+    
+    mBigrams.clear();
+    mBigrams.reserve(mMapped.bigramCount);
+    for (std::size_t k = 0; k < mMapped.bigramCount; k++) {
+        BigramPostings& postings = mBigrams[mMapped.bigramKeys[k]];
+        postings.bytes.assign(mMapped.bigramBytes + mMapped.bigramStart[k], 
+                              mMapped.bigramBytes + mMapped.bigramStart[k + 1]);
+        postings.count = mMapped.bigramCounts[k];
+        postings.last  = mMapped.bigramLasts[k];
+    }
+    
+    // The text is only moved, not changed, so the suffix array still holds.
+    SyncArena();
+    RebindIndex();
+    
+    FileUnmap(mMapping);
+    mMapped = MappedIndex();
+}
+
+void LanguageModel::Reset(void) {
+    mIndex.Clear();
+    mIndexDirty = true;
+    FileUnmap(mMapping);
+    mMapped = MappedIndex();
+    
+    // Release the arena rather than clear it, since a mapped load may
+    // never need it again.
+    std::vector<int>().swap(mTokens);
+    mOffsets.assign(1, 1u);
+    mPacked.Clear();
+    std::vector<std::uint32_t>().swap(mCountStore);
+    std::vector<std::uint32_t>().swap(mSpanTable);
+    mSpanTableCount = 0;
+    mPostings.clear();
+    mBigrams.clear();
+    SyncArena();
+    mGeneration++;
 }
@@ -1,42 +1,304 @@
 #ifndef _LANGUAGE_MODEL__
 #define _LANGUAGE_MODEL__
 
+// Default document frequency limit for GetContext lookups. A context token
+// (or bigram) found in more spans than this is skipped while the context has
+// rarer ones, and sampled down to this many spans when it has none.
+#define LANGUAGE_MODEL_POSTING_LIMIT  65536
+
+// How the span text is stored, in memory and in the model file.
+#define LANGUAGE_MODEL_SPANS_INT32   0
+#define LANGUAGE_MODEL_SPANS_PACKED  1   // bit-packed to the widest token id
+
 #include <vector>
 #include <string>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
 
 #include "tokenizer.h"
 #include "attention.h"
+#include "suffixindex.h"
+#include "spanview.h"
+#include "packedtokens.h"
+#include "focus.h"
+#include "workerpool.h"
+#include "platform.h"
+
+// Ids of the spans containing one adjacent token pair, increasing. Each is
+// stored as a varint of its gap from the previous id (the first as is),
+// so lists stay small and can still be appended to.
+struct BigramPostings {
+    
+    std::vector<unsigned char> bytes;
+    std::uint32_t              last;  // last id appended
+    std::uint32_t              count;
+    
+    BigramPostings() : 
+        last(0u),
+        count(0u) {}
+};
+
+// Sorted span ids of one token's posting list, read in place.
+struct PostingList {
+    
+    const std::uint32_t* data;
+    std::size_t          length;
+    
+    PostingList() : 
+        data(NULL),
+        length(0) {}
+    
+    PostingList(const std::uint32_t* ids, std::size_t count) : 
+        data(ids),
+        length(count) {}
+    
+    std::size_t size(void) const {
+        return length;
+    }
+    
+    bool empty(void) const {
+        return length == 0;
+    }
+    
+    std::uint32_t operator[](std::size_t index) const {
+        return data[index];
+    }
+    
+};
+
+// One bigram's varint coded posting list, read in place.
+struct BigramList {
+    const unsigned char* bytes;
+    std::size_t          byteCount;
+    std::uint32_t        count;
+};
 
 class LanguageModel {
 public:
     
-    // Build a "focus" list of tokens that are associated with the given context.
+    // Build a "focus" list of spans that are associated with the given context.
     // Returns true if at least one matching clip was found.
-    bool GetContext(const std::vector<int>& context, std::vector<std::vector<int>>& focus, unsigned int range);
+    bool GetContext(const std::vector<int>& context, FocusList& focus, unsigned int range);
     
     // Branch off into other relevant contexts
     bool GetRelevantContext(AttentionSystem& attention, const std::vector<int>& context, std::vector<int>& focus);
     
-    // Add a context span to the model.
+    // Add a context span to the model. With deduplication on, a span with
+    // the same tokens as one already held is not stored again; that span's
+    // occurrence count goes up instead.
     void AddContext(const std::vector<int>& context);
     
-    // Save the model data to a file.
-    bool SaveToFile(const std::string& filename) const;
+    // Save the model data to a file, in the current (v4) format and the
+    // current span encoding. Builds the suffix index first if it is out of
+    // date, since the file carries it.
+    bool SaveToFile(const std::string& filename);
     
-    // Load the model data from a file.
+    // Load the model data from a file. A v2, v3 or v4 file is mapped read-only
+    // and served in place until the model is next changed; v1 files are read
+    // into memory. The span encoding comes from the file.
     bool LoadFromFile(const std::string& filename);
     
     LanguageModel(Tokenizer* tokenizer);
+    ~LanguageModel();
     
-    // Get the size of the model
+    // Get the size of the model, in distinct spans
     unsigned int size(void) const;
     
-    std::vector<std::vector<int>> mModel;
+    // View of one span. Packed spans are decoded into buffer, so the view
+    // lasts until buffer changes or the next AddContext or LoadFromFile.
+    SpanView GetSpan(unsigned int index, std::vector<int>& buffer) const;
+    
+    // Number of tokens across all spans, each distinct span counted once.
+    std::size_t GetTokenCount(void) const;
+    
+    // Times a span was added.
+    unsigned int GetOccurrences(unsigned int index) const;
+    
+    // True while the spans are served from a mapped model file.
+    bool IsMapped(void) const;
+    
+    // Stamp taken each time every span is dropped, as by LoadFromFile.
+    // Span ids held from an earlier generation no longer refer to anything.
+    unsigned int GetGeneration(void) const;
+    
+    // Convert the span text to another LANGUAGE_MODEL_SPANS_* encoding.
+    // Scans of packed spans decode each one as they reach it.
+    void SetSpanEncoding(int encoding);
+    int GetSpanEncoding(void) const;
+    
+    // Store repeated spans once with an occurrence count; off by default.
+    // Scoring over the spans in a focus is the same either way, but a
+    // repeat no longer has a position of its own, so GetContext neighbour
+    // windows and the focus capacity count distinct spans instead of
+    // occurrences, which changes what a focus holds when repeats are not
+    // adjacent. Spans added before turning it on keep their copies.
+    void SetDeduplication(bool dedup);
+    bool GetDeduplication(void) const;
+    
+    // Bytes of owned storage held by the span text, offsets, occurrence
+    // counts and the table of spans by content. Spans still
+    // served from a mapped file are not counted.
+    std::size_t GetSpanMemoryUsage(void) const;
+    
+    // Suffix index over all spans, rebuilt here if the model changed since
+    // the last call.
+    const SuffixIndex& GetIndex(void);
+    
+    // Sorted ids of the spans containing a token.
+    PostingList GetPostings(int token) const;
+    
+    // Document frequency limit for GetContext lookups; 0 disables it.
+    void SetPostingLimit(unsigned int limit);
+    unsigned int GetPostingLimit(void) const;
+    
+    // Threads used to merge posting lists in GetContext. Results do not
+    // depend on the count.
+    void SetThreadCount(unsigned int count);
+    unsigned int GetThreadCount(void) const;
     
 private:
+    
+    LanguageModel(const LanguageModel&);
+    LanguageModel& operator=(const LanguageModel&);
+    
+    // One posting list picked for a lookup: plain ids, or a bigram list
+    // when ids.data is NULL.
+    struct PostingSource {
+        PostingList ids;
+        BigramList  packed;
+    };
+    
+    // Index sections of a mapped v2 model file, read in place.
+    struct MappedIndex {
+        const std::uint32_t* postingStart;  // postingTokens + 1 offsets into postingIds
+        const std::uint32_t* postingIds;
+        std::size_t          postingTokens;
+        const std::uint64_t* bigramKeys;    // sorted
+        const std::uint32_t* bigramCounts;
+        const std::uint32_t* bigramLasts;
+        const std::uint64_t* bigramStart;   // bigramCount + 1 offsets into bigramBytes
+        const unsigned char* bigramBytes;
+        std::size_t          bigramCount;
+    };
+    
+    // Ids of the spans containing any of the tokens, sorted, subject to the
+    // posting limit.
+    void FindSpans(const std::vector<int>& tokens, std::vector<std::uint32_t>& spans);
+    
+    // Same for spans containing any of the bigram keys.
+    void FindBigramSpans(const std::vector<std::uint64_t>& keys, std::vector<std::uint32_t>& spans);
+    
+    // Posting list of one bigram; false if no span contains it.
+    bool FindBigram(std::uint64_t key, BigramList& list) const;
+    
+    // Sorted union of the lists in mSources, holding total ids between them.
+    // Large unions go through per-thread bitmaps over all spans.
+    void UnionPostings(std::size_t total, std::vector<std::uint32_t>& spans);
+    
+    // Append each hit span and its neighbors [hit - pre, hit + post] to the
+    // focus once, in span order. Hits must be sorted. Stops once the focus
+    // is full of this call's spans.
+    bool AddNeighborhoods(const std::vector<std::uint32_t>& hits,
+                          unsigned int pre,
+                          unsigned int post,
+                          FocusList& focus) const;
+    
+    // Id of a held span with the same tokens as context, or -1. hash is
+    // SpanHash of context. Leaves the span table room for one more span.
+    int FindRepeat(const std::vector<int>& context, std::uint64_t hash);
+    
+    // Add the spans not yet in the span table, first growing it to hold at
+    // least capacity spans.
+    void SyncSpanTable(unsigned int capacity);
+    
+    // Put a span id in the span table, which must have room for it.
+    void InsertSpan(unsigned int index, std::uint64_t hash);
+    
+    // Index one span, which must be the newest, into the postings.
+    void AddPostings(unsigned int index);
+    
+    // Rebuild every posting list from the spans.
+    void BuildPostings(void);
+    
+    // Point the span readers back at the owned arena after it changed.
+    void SyncArena(void);
+    
+    // Point a built suffix index at the arena after the text moved or was
+    // re-encoded without changing.
+    void RebindIndex(void);
+    
+    // Copy a mapped model into owned storage and release the mapping so it
+    // can be changed. Does nothing if the model is not mapped.
+    void MakeWritable(void);
+    
+    // Drop every span, index and mapping.
+    void Reset(void);
+    
+    // Model file readers: v2 to v4 are mapped, v1 is streamed into memory.
+    bool LoadMapped(const std::string& filename);
+    bool LoadStream(const std::string& filename);
+    
+    // Optional postings sections that follow the spans in a v1 model file.
+    bool LoadPostings(std::istream& in);
+    bool LoadBigrams(std::istream& in);
+    
+    
     friend class SamplerSystem;
     Tokenizer* tok;
     
+    // Every span back to back in one arena, each preceded by a -1
+    // separator, which is the layout the suffix index reads in place.
+    // Span s is mTokens[mOffsets[s], mOffsets[s + 1] - 1); the last offset
+    // is where the next span would start. Offsets are 32-bit, the same
+    // limit the suffix index has on positions. The text lives in mTokens or,
+    // packed, in mPacked.
+    std::vector<int>           mTokens;
+    std::vector<std::uint32_t> mOffsets;
+    PackedTokens               mPacked;
+    int                        mSpanEncoding;
+    
+    // What spans are read from: the arena above, or a mapped model file.
+    // mText is NULL while the text is packed.
+    const int*           mText;
+    std::size_t          mTextSize;
+    const std::uint32_t* mStarts;
+    unsigned int         mSpanCount;
+    
+    // Occurrences of each span, read from mCounts. It is NULL while every
+    // count is 1, as for a model mapped from a file written without them.
+    std::vector<std::uint32_t> mCountStore;
+    const std::uint32_t*       mCounts;
+    
+    // Open addressed table of span id + 1 by content hash, 0 when empty,
+    // holding the first mSpanTableCount spans. Kept at most half full and
+    // filled in on the first deduplicating AddContext after a load.
+    std::vector<std::uint32_t> mSpanTable;
+    unsigned int               mSpanTableCount;
+    bool                       mDeduplicate;
+    
+    FileMapping mMapping;
+    MappedIndex mMapped;
+    
+    // Inverted index: for each token, the ids of the spans containing it,
+    // in increasing order. AddContext keeps it current.
+    std::vector<std::vector<std::uint32_t>> mPostings;
+    unsigned int mPostingLimit;
+    
+    // Bigram index keyed by the packed pair, used for longer contexts.
+    std::unordered_map<std::uint64_t, BigramPostings> mBigrams;
+    
+    // Lookup scratch.
+    std::vector<int>                        mSpanBuffer;
+    std::vector<PostingSource>              mSources;
+    std::vector<std::vector<std::uint64_t>> mHitBits;
+    WorkerPool                              mPool;
+    
+    SuffixIndex mIndex;
+    bool mIndexDirty;
+    
+    unsigned int mGeneration;
+    
 };
 
 #endif
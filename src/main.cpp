@@ -1,9 +1,12 @@
 #include <string>
 #include <vector>
+#include <cstdlib>
 #include <unordered_map>
 
 #include <sstream>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
 
 #include "repl.h"
 #include "string.h"
@@ -14,6 +17,7 @@
 #include "attention.h"
 #include "languagemodel.h"
 #include "sampler.h"
+#include "workerpool.h"
 #include "rem.h"
 
 ReplCommandConsole console;
@@ -28,28 +32,45 @@ void CommandSaveModel(const std::vector<std::string>& args);
 void CommandRead(const std::vector<std::string>& args);
 void CommandTrim(const std::vector<std::string>& args);
 void CommandClear(const std::vector<std::string>& args);
+void CommandWidth(const std::vector<std::string>& args);
+void CommandPrecision(const std::vector<std::string>& args);
+void CommandSimilar(const std::vector<std::string>& args);
+void CommandIndex(const std::vector<std::string>& args);
+void CommandSpans(const std::vector<std::string>& args);
+void CommandDedup(const std::vector<std::string>& args);
 
 std::vector<int> context;
-std::vector<std::vector<int>> focus;
+FocusList focus;
 
 int main() {
     srand(120);
+    sampler.SetSeed(120);
     
     console.RegisterCommandFunction("read", &CommandRead);
     console.RegisterCommandFunction("load", &CommandLoadModel);
     console.RegisterCommandFunction("save", &CommandSaveModel);
     console.RegisterCommandFunction("trim", &CommandTrim);
     console.RegisterCommandFunction("clear", &CommandClear);
+    console.RegisterCommandFunction("width", &CommandWidth);
+    console.RegisterCommandFunction("precision", &CommandPrecision);
+    console.RegisterCommandFunction("similar", &CommandSimilar);
+    console.RegisterCommandFunction("index", &CommandIndex);
+    console.RegisterCommandFunction("spans", &CommandSpans);
+    console.RegisterCommandFunction("dedup", &CommandDedup);
     
     const std::string modelFilename = "ds.model";
     const std::string attenFilename = "ds.attn";
     const std::string embedFilename = "ds.embed";
+    const std::string indexFilename = "ds.hnsw";
     
     if (FileExists(modelFilename) && FileExists(attenFilename) && FileExists(embedFilename)) {
         std::cout << "Loading model file... ";
         model.LoadFromFile(modelFilename);
         sampler.attention.LoadFromFile(attenFilename);
         sampler.embedding.LoadFromFile(embedFilename);
+        // The index is optional; anything missing or stale is rebuilt.
+        sampler.embeddingIndex.LoadFromFile(indexFilename, sampler.embedding);
+        sampler.embeddingIndex.Update(sampler.embedding);
         std::cout << "complete\n\n";
     }
     
@@ -76,8 +97,10 @@ int main() {
         Context contextConvert(&tok);
         contextConvert = keyboardSplt;
         std::vector<int> prompt = contextConvert.GetTokens();
-        for (unsigned int i=0; i < prompt.size(); i++) 
+        for (unsigned int i=0; i < prompt.size(); i++) {
             context.push_back( prompt[i] );
+            sampler.AppendContext(prompt[i]);
+        }
         
         // Broad pass - pull in chunks of relevant context
         //if (focus.size() < 1024) 
@@ -90,6 +113,8 @@ int main() {
         if (context.size() == 0) {std::cout << "Context empty\n\n"; continue;}
         if (model.size() == 0)   {std::cout << "Model empty\n\n"; continue;}
         
+        sampler.ReserveVocabulary(tok.tokenToWord.size());
+        
         SamplerParameters params;
         params.temperatureHigh  = 0.7f;
         params.temperatureLow   = 0.1f;
@@ -152,7 +177,7 @@ int main() {
             //    std::cout << dist.weights[i] << "    " << tok.tokenToWord[dist.tokens[i]] << "\n";
             //break;
             
-            int nextToken = sampler.SampleNextToken(context, model.mModel, params);
+            int nextToken = sampler.SampleNextToken(context, model.GetIndex(), params);
             
             // Handle special negative return codes first
             if (nextToken < 0) {
@@ -175,6 +200,7 @@ int main() {
                 firstRun = false;
                 if (word == "." || word == "?" || word == "!" || word == ",") {
                     context.push_back(nextToken);
+                    sampler.AppendContext(nextToken);
                     continue;
                 }
             }
@@ -184,8 +210,11 @@ int main() {
             }
             
             context.push_back(nextToken);
-            if (context.size() > 1024) 
+            sampler.AppendContext(nextToken);
+            if (context.size() > 1024) {
+                sampler.EvictContext(context.front());
                 context.erase(context.begin());
+            }
             
             if (word == ",") 
                 doEndSpace = true;
@@ -234,6 +263,286 @@ void CommandClear(const std::vector<std::string>& args) {
     std::cout << "Context cleared.\n\n";
     context.clear();
     focus.clear();
+    sampler.ClearContext();
+}
+
+void CommandWidth(const std::vector<std::string>& args) {
+    if (args.empty()) {
+        std::cout << "Embedding width is " << sampler.embedding.GetWidth() << "\n\n";
+        return;
+    }
+    
+    int width = StringToInt(args[0]);
+    if (width < 1) {
+        std::cout << "Usage: /width <dimensions>\n\n";
+        return;
+    }
+    
+    // Existing embeddings cannot be resized; they are retrained on /read.
+    sampler.embedding.SetWidth(width);
+    sampler.embeddingIndex.Clear();
+    std::cout << "Embedding width set to " << width << ", embeddings cleared.\n\n";
+}
+
+// Rank every embedded token against a sample of query tokens under both
+// systems and report how much of the top 10 survives, plus scan times.
+static void ReportRankingAgreement(const EmbeddingSystem& reference, const EmbeddingSystem& quantized) {
+    const int topK = 10;
+    const unsigned int queryMax = 100;
+    
+    std::vector<int> tokens;
+    for (unsigned int t=0; t < tok.tokenToWord.size(); t++) 
+        if (reference.HasEmbedding(t)) 
+            tokens.push_back(t);
+    if (tokens.size() <= static_cast<std::size_t>(topK)) 
+        return;
+    
+    const int count = static_cast<int>(tokens.size());
+    std::vector<float> norms(tokens.size());
+    std::vector<float> simRef(tokens.size());
+    std::vector<float> simQuant(tokens.size());
+    std::vector<int> orderRef(tokens.size());
+    std::vector<int> orderQuant(tokens.size());
+    
+    double timeRef = 0.0;
+    double timeQuant = 0.0;
+    unsigned int shared = 0;
+    unsigned int queries = 0;
+    unsigned int step = tokens.size() / queryMax + 1;
+    
+    Embedding query;
+    for (std::size_t q=0; q < tokens.size(); q += step) {
+        reference.GetEmbedding(tokens[q], query);
+        float norm = reference.GetNorm(tokens[q]);
+        if (norm <= 0.0f) 
+            continue;
+        for (unsigned int d=0; d < query.v.size(); d++) 
+            query.v[d] /= norm;
+        
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        reference.CosineBatch(query.v.data(), tokens.data(), count, norms.data(), simRef.data());
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        quantized.CosineBatch(query.v.data(), tokens.data(), count, norms.data(), simQuant.data());
+        std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+        timeRef   += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        timeQuant += std::chrono::duration<double, std::milli>(t2 - t1).count();
+        
+        for (int i=0; i < count; i++) {
+            orderRef[i] = i;
+            orderQuant[i] = i;
+        }
+        std::partial_sort(orderRef.begin(), orderRef.begin() + topK, orderRef.end(),
+                          [&simRef](int a, int b) { return simRef[a] > simRef[b]; });
+        std::partial_sort(orderQuant.begin(), orderQuant.begin() + topK, orderQuant.end(),
+                          [&simQuant](int a, int b) { return simQuant[a] > simQuant[b]; });
+        
+        for (int a=0; a < topK; a++) 
+            for (int b=0; b < topK; b++) 
+                if (orderRef[a] == orderQuant[b]) 
+                    shared++;
+        queries++;
+    }
+    if (queries == 0) 
+        return;
+    
+    std::cout << "Top-" << topK << " agreement with fp32: " 
+              << (100.0 * shared / (queries * topK)) << "% over " << queries << " queries\n";
+    std::cout << "Scan of " << count << " rows: fp32 " << (timeRef / queries) 
+              << " ms, quantized " << (timeQuant / queries) << " ms\n";
+}
+
+void CommandPrecision(const std::vector<std::string>& args) {
+    const char* names[] = {"fp32", "fp16", "int8"};
+    
+    int precision = -1;
+    if (!args.empty()) {
+        for (int p=0; p < 3; p++) 
+            if (args[0] == names[p]) 
+                precision = p;
+    }
+    if (precision < 0) {
+        std::cout << "Embedding precision is " << names[sampler.embedding.GetPrecision()] << "\n";
+        std::cout << "Usage: /precision fp32|fp16|int8\n\n";
+        return;
+    }
+    
+    // Keep an fp32 copy around long enough to measure the ranking drift.
+    EmbeddingSystem reference;
+    bool compare = sampler.embedding.GetPrecision() == EMBEDDING_FP32 && precision != EMBEDDING_FP32;
+    if (compare) 
+        reference = sampler.embedding;
+    
+    std::size_t before = sampler.embedding.GetMemoryUsage();
+    sampler.embedding.SetPrecision(precision);
+    std::size_t after = sampler.embedding.GetMemoryUsage();
+    sampler.embeddingIndex.Update(sampler.embedding);
+    
+    std::cout << "Embeddings stored as " << names[precision] << ", " 
+              << (before / 1024) << " KB -> " << (after / 1024) << " KB\n";
+    if (compare) 
+        ReportRankingAgreement(reference, sampler.embedding);
+    std::cout << "\n";
+}
+
+void CommandSpans(const std::vector<std::string>& args) {
+    const char* names[] = {"int32", "packed"};
+    
+    int encoding = -1;
+    if (!args.empty()) {
+        for (int e=0; e < 2; e++) 
+            if (args[0] == names[e]) 
+                encoding = e;
+    }
+    if (encoding < 0) {
+        std::cout << "Spans are stored as " << names[model.GetSpanEncoding()] << "\n";
+        std::cout << "Usage: /spans int32|packed\n\n";
+        return;
+    }
+    
+    std::size_t before = model.GetSpanMemoryUsage();
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    model.SetSpanEncoding(encoding);
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    std::size_t after = model.GetSpanMemoryUsage();
+    
+    std::cout << "Spans stored as " << names[encoding] << ", " 
+              << (before / 1024) << " KB -> " << (after / 1024) << " KB in " 
+              << std::chrono::duration<double>(t1 - t0).count() << " s\n\n";
+}
+
+void CommandDedup(const std::vector<std::string>& args) {
+    if (args.empty() || (args[0] != "on" && args[0] != "off")) {
+        std::cout << "Repeated spans are " << (model.GetDeduplication() ? "counted" : "stored") << "\n";
+        std::cout << "Usage: /dedup on|off\n\n";
+        return;
+    }
+    
+    model.SetDeduplication(args[0] == "on");
+    std::cout << "Repeated spans will be " << (model.GetDeduplication() ? "counted" : "stored") << "\n\n";
+}
+
+void CommandSimilar(const std::vector<std::string>& args) {
+    if (args.empty()) {
+        std::cout << "Usage: /similar <word> [count]\n\n";
+        return;
+    }
+    
+    std::unordered_map<std::string, int>::iterator it = tok.wordToToken.find(args[0]);
+    Embedding query;
+    if (it == tok.wordToToken.end() || !sampler.embedding.GetEmbedding(it->second, query) || 
+        sampler.embedding.GetNorm(it->second) <= 0.0f) {
+        std::cout << "No embedding for '" << args[0] << "'\n\n";
+        return;
+    }
+    
+    int count = 10;
+    if (args.size() > 1) 
+        count = std::max(1, StringToInt(args[1]));
+    
+    float norm = sampler.embedding.GetNorm(it->second);
+    for (unsigned int d=0; d < query.v.size(); d++) 
+        query.v[d] /= norm;
+    
+    // One extra, since the word itself is usually its own nearest neighbor.
+    std::vector<EmbeddingNeighbor> neighbors;
+    sampler.embeddingIndex.Search(sampler.embedding, query.v.data(), count + 1, neighbors);
+    
+    int shown = 0;
+    for (unsigned int i=0; i < neighbors.size() && shown < count; i++) {
+        if (neighbors[i].token == it->second) 
+            continue;
+        std::cout << "  " << tok.tokenToWord[neighbors[i].token] << "  " << neighbors[i].similarity << "\n";
+        shown++;
+    }
+    if (shown == 0) 
+        std::cout << "Embedding index is empty\n";
+    std::cout << "\n";
+}
+
+// Search a sample of embedded tokens through the index and by a full scan,
+// and report the recall of the top 10 and the queries per second of each
+// at a few search widths.
+static void ReportIndexRecall(void) {
+    const int topK = 10;
+    const unsigned int queryMax = 200;
+    const int widths[] = {16, 32, 64, 128};
+    
+    if (sampler.embeddingIndex.size() == 0) 
+        return;
+    
+    std::vector<int> tokens;
+    for (int t=0; t < sampler.embedding.GetTokenLimit(); t++) 
+        if (sampler.embedding.GetNorm(t) > 0.0f) 
+            tokens.push_back(t);
+    if (tokens.size() <= static_cast<std::size_t>(topK)) 
+        return;
+    
+    const int count = static_cast<int>(tokens.size());
+    std::vector<float> norms(tokens.size());
+    std::vector<float> similarity(tokens.size());
+    std::vector<int> order(tokens.size());
+    std::vector<EmbeddingNeighbor> neighbors;
+    unsigned int step = tokens.size() / queryMax + 1;
+    
+    const int searchWidth = sampler.embeddingIndex.GetSearchWidth();
+    
+    Embedding query;
+    for (unsigned int w=0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        sampler.embeddingIndex.SetSearchWidth(widths[w]);
+        
+        double timeIndex = 0.0;
+        double timeScan = 0.0;
+        unsigned int found = 0;
+        unsigned int queries = 0;
+        for (std::size_t q=0; q < tokens.size(); q += step) {
+            sampler.embedding.GetEmbedding(tokens[q], query);
+            float norm = sampler.embedding.GetNorm(tokens[q]);
+            for (unsigned int d=0; d < query.v.size(); d++) 
+                query.v[d] /= norm;
+            
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            sampler.embeddingIndex.Search(sampler.embedding, query.v.data(), topK, neighbors);
+            std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+            sampler.embedding.CosineBatch(query.v.data(), tokens.data(), count, norms.data(), similarity.data());
+            for (int i=0; i < count; i++) 
+                order[i] = i;
+            std::partial_sort(order.begin(), order.begin() + topK, order.end(),
+                              [&similarity](int a, int b) { return similarity[a] > similarity[b]; });
+            std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+            timeIndex += std::chrono::duration<double>(t1 - t0).count();
+            timeScan  += std::chrono::duration<double>(t2 - t1).count();
+            
+            for (int a=0; a < topK; a++) 
+                for (unsigned int b=0; b < neighbors.size(); b++) 
+                    if (tokens[order[a]] == neighbors[b].token) 
+                        found++;
+            queries++;
+        }
+        
+        std::cout << "  width " << widths[w] << ": recall@" << topK << " " 
+                  << (100.0 * found / (queries * topK)) << "%, index " 
+                  << static_cast<int>(queries / timeIndex) << " q/s, scan " 
+                  << static_cast<int>(queries / timeScan) << " q/s\n";
+    }
+    
+    sampler.embeddingIndex.SetSearchWidth(searchWidth);
+}
+
+void CommandIndex(const std::vector<std::string>& args) {
+    if (!args.empty() && args[0] == "rebuild") {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        sampler.embeddingIndex.Build(sampler.embedding);
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        std::cout << "Index rebuilt in " << std::chrono::duration<double>(t1 - t0).count() << " s\n";
+    } else if (!args.empty()) {
+        std::cout << "Usage: /index [rebuild]\n\n";
+        return;
+    }
+    
+    std::cout << "Embedding index holds " << sampler.embeddingIndex.size() << " of " 
+              << sampler.embedding.size() << " tokens\n";
+    ReportIndexRecall();
+    std::cout << "\n";
 }
 
 void CommandLoadModel(const std::vector<std::string>& args) {
@@ -246,11 +555,15 @@ void CommandLoadModel(const std::vector<std::string>& args) {
     std::string modelFilename = base + ".model";
     std::string attenFilename = base + ".attn";
     std::string embedFilename = base + ".embed";
+    std::string indexFilename = base + ".hnsw";
     
     std::cout << "Loading model '" << base << "'... ";
     model.LoadFromFile(modelFilename);
+    focus.clear();
     sampler.attention.LoadFromFile(attenFilename);
     sampler.embedding.LoadFromFile(embedFilename);
+    sampler.embeddingIndex.LoadFromFile(indexFilename, sampler.embedding);
+    sampler.embeddingIndex.Update(sampler.embedding);
     std::cout << "complete\n\n";
 }
 
@@ -264,11 +577,13 @@ void CommandSaveModel(const std::vector<std::string>& args) {
     std::string modelFilename = base + ".model";
     std::string attenFilename = base + ".attn";
     std::string embedFilename = base + ".embed";
+    std::string indexFilename = base + ".hnsw";
     
     std::cout << "Saving model '" << base << "'... ";
     model.SaveToFile(modelFilename);
     sampler.attention.SaveToFile(attenFilename);
     sampler.embedding.SaveToFile(embedFilename);
+    sampler.embeddingIndex.SaveToFile(indexFilename);
     std::cout << "complete\n\n";
 }
 
@@ -276,10 +591,16 @@ void CommandRead(const std::vector<std::string>& args) {
     const float strength = 2.4f;
 
     if (args.empty()) {
-        std::cout << "Usage: /read <filename>\n\n";
+        std::cout << "Usage: /read <filename> [threads]\n\n";
         return;
     }
     
+    // Embedding training threads. One keeps training deterministic; more
+    // train Hogwild, which can differ from run to run.
+    unsigned int threadCount = 1u;
+    if (args.size() > 1) 
+        threadCount = static_cast<unsigned int>(std::max(1, StringToInt(args[1])));
+    
     std::string filename = args[0];
     if (!FileExists(filename)) {
         std::cout << "File not found: " << filename << "\n\n";
@@ -313,23 +634,56 @@ void CommandRead(const std::vector<std::string>& args) {
         //    std::cout << " " << tok.tokenToWord[encoding[a]];
         //std::cout << "\n\n";
     }
-    int counter=0;
-    for (unsigned int e=0; e < encodings.size(); e++) {
-        model.AddContext(encodings[e]);
-        
-        // Train attention and embeddings
-        sampler.embedding.TrainOnSentence(encodings[e], encodings[e].size(), strength);
-        sampler.attention.ProcessSequence(encodings[e]);
+    // Sentences per training batch. fp32 embedding rows stay dirty across
+    // batches and are normalized once, at the end of the read. Quantized
+    // rows have no pending scale to keep them in range, so they are
+    // normalized after every batch.
+    const unsigned int batchSize = 1024;
+    
+    WorkerPool pool;
+    pool.SetThreadCount(threadCount);
+    sampler.embedding.SetDeferredNormalization(true);
+    
+    double trainSeconds = 0.0;
+    for (unsigned int first=0; first < encodings.size(); first += batchSize) {
+        unsigned int last = std::min(first + batchSize, static_cast<unsigned int>(encodings.size()));
         
-        counter++;
-        if (counter > 128) {
-            std::cout << e << " of " << encodings.size() << "\r";
-            counter=0;
+        // Train attention and create the new embedding rows sentence by
+        // sentence. Both draw from std::rand(), so this keeps the order of
+        // training one sentence at a time.
+        for (unsigned int e=first; e < last; e++) {
+            model.AddContext(encodings[e]);
+            if (encodings[e].size() >= 2) 
+                for (unsigned int i=0; i < encodings[e].size(); i++) 
+                    sampler.embedding.AddEmbedding(encodings[e][i]);
+            sampler.attention.ProcessSequence(encodings[e]);
         }
+        
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        sampler.embedding.TrainOnSentences(encodings, first, last, 0, strength, pool);
+        if (sampler.embedding.GetPrecision() != EMBEDDING_FP32) 
+            sampler.embedding.FlushNormalization(pool);
+        std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+        trainSeconds += std::chrono::duration<double>(t1 - t0).count();
+        
+        std::cout << last << " of " << encodings.size() << "\r";
     }
-    std::cout << encodings.size() << " of " << encodings.size() << "\n\n";
+    
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    sampler.embedding.FlushNormalization(pool);
+    sampler.embedding.SetDeferredNormalization(false);
+    trainSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    
+    std::cout << encodings.size() << " of " << encodings.size() << "\n";
+    if (trainSeconds > 0.0) 
+        std::cout << "Embeddings trained at " << static_cast<int>(encodings.size() / trainSeconds) 
+                  << " sentences/s on " << threadCount << " threads\n";
+    std::cout << "\n";
     sampler.attention.NormalizeWeightsPerAnchor();
     
     sampler.attention.RenormalizeAll(0.9f);
+    
+    // Link new tokens and re-link retrained ones.
+    sampler.embeddingIndex.Update(sampler.embedding);
 }
 
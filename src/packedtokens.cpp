@@ -0,0 +1,136 @@
+#include "packedtokens.h"
+#include "kernels.h"
+
+// Tokens decoded per kernel call when unpacking a long run.
+static const std::size_t PACKED_TOKENS_DECODE_RUN = 1u << 20;
+
+// Bits needed to hold a field value.
+static int BitsFor(std::uint64_t value) {
+    int bits = 1;
+    while (bits < 32 && (value >> bits) != 0u) 
+        bits++;
+    return bits;
+}
+
+PackedTokens::PackedTokens() : 
+    mWords(NULL), 
+    mCount(0), 
+    mWidth(1), 
+    mMask(1u) {}
+
+void PackedTokens::Clear(void) {
+    std::vector<std::uint64_t>().swap(mStore);
+    mWords = NULL;
+    mCount = 0;
+    mWidth = 1;
+    mMask  = 1u;
+}
+
+void PackedTokens::Assign(const int* tokens, std::size_t count) {
+    int maxToken = -1;
+    for (std::size_t i = 0; i < count; i++) 
+        if (tokens[i] > maxToken) 
+            maxToken = tokens[i];
+    Pack(tokens, count, BitsFor(static_cast<std::uint64_t>(maxToken + 1)));
+}
+
+void PackedTokens::Adopt(const std::uint64_t* words, std::size_t count, int width) {
+    Clear();
+    mWords = words;
+    mCount = count;
+    mWidth = width;
+    mMask  = (1ull << width) - 1u;
+}
+
+void PackedTokens::Append(int token) {
+    Own();
+    
+    const std::uint64_t value = static_cast<std::uint64_t>(token + 1);
+    if ((value & ~mMask) != 0u) 
+        Widen(BitsFor(value));
+    
+    // Grow geometrically; resize alone would reallocate on every new word.
+    std::size_t words = WordsFor(mCount + 1, mWidth);
+    if (words > mStore.size()) {
+        if (words > mStore.capacity()) 
+            mStore.reserve(words * 2);
+        mStore.resize(words, 0u);
+        mWords = mStore.data();
+    }
+    
+    Write(static_cast<std::uint64_t>(mCount) * static_cast<unsigned int>(mWidth), value);
+    mCount++;
+}
+
+void PackedTokens::Decode(std::size_t first, std::size_t count, int* out) const {
+    while (count > 0) {
+        std::size_t run = count < PACKED_TOKENS_DECODE_RUN ? count : PACKED_TOKENS_DECODE_RUN;
+        KernelUnpackTokens(mWords, static_cast<std::uint64_t>(first) * static_cast<unsigned int>(mWidth),
+                           mWidth, static_cast<int>(run), out);
+        first += run;
+        out   += run;
+        count -= run;
+    }
+}
+
+std::size_t PackedTokens::size(void) const {
+    return mCount;
+}
+
+int PackedTokens::GetWidth(void) const {
+    return mWidth;
+}
+
+const std::uint64_t* PackedTokens::GetWords(void) const {
+    return mWords;
+}
+
+std::size_t PackedTokens::GetWordCount(void) const {
+    return mCount == 0 ? 0 : WordsFor(mCount, mWidth);
+}
+
+std::size_t PackedTokens::GetMemoryUsage(void) const {
+    return mStore.capacity() * sizeof(std::uint64_t);
+}
+
+std::size_t PackedTokens::WordsFor(std::size_t count, int width) {
+    return static_cast<std::size_t>((static_cast<std::uint64_t>(count) * static_cast<unsigned int>(width) + 63u) >> 6) + 1;
+}
+
+void PackedTokens::Widen(int width) {
+    std::vector<int> tokens(mCount);
+    Decode(0, mCount, tokens.data());
+    Pack(tokens.data(), tokens.size(), width);
+}
+
+void PackedTokens::Pack(const int* tokens, std::size_t count, int width) {
+    std::vector<std::uint64_t> store(WordsFor(count, width), 0u);
+    Clear();
+    mStore.swap(store);
+    mWords = mStore.data();
+    mWidth = width;
+    mMask  = (1ull << width) - 1u;
+    
+    std::uint64_t bit = 0;
+    for (std::size_t i = 0; i < count; i++, bit += static_cast<std::uint64_t>(width)) 
+        Write(bit, static_cast<std::uint64_t>(tokens[i] + 1));
+    mCount = count;
+}
+
+void PackedTokens::Write(std::uint64_t bit, std::uint64_t value) {
+    const std::uint64_t word  = bit >> 6;
+    const unsigned int  shift = static_cast<unsigned int>(bit & 63u);
+    mStore[word] |= value << shift;
+    if (shift + static_cast<unsigned int>(mWidth) > 64u) 
+        mStore[word + 1] |= value >> (64u - shift);
+}
+
+void PackedTokens::Own(void) {
+    if (mWords != NULL && mWords == mStore.data()) 
+        return;
+    if (mWords != NULL) 
+        mStore.assign(mWords, mWords + WordsFor(mCount, mWidth));
+    else 
+        mStore.assign(WordsFor(0, mWidth), 0u);
+    mWords = mStore.data();
+}
@@ -0,0 +1,78 @@
+#ifndef _PACKED_TOKENS__
+#define _PACKED_TOKENS__
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Token ids bit-packed at the fewest bits that hold the largest one. Each
+// field stores token + 1, so the -1 span separator packs as zero. Fields
+// can be read one at a time or decoded in runs, and the store widens
+// itself when a larger token is appended.
+class PackedTokens {
+public:
+    
+    PackedTokens();
+    
+    void Clear(void);
+    
+    // Replace the contents with count tokens.
+    void Assign(const int* tokens, std::size_t count);
+    
+    // Use words packed elsewhere, such as a mapped model file, without
+    // copying them. They must hold WordsFor(count, width) words and stay put
+    // until the store is next changed; appending copies them first.
+    void Adopt(const std::uint64_t* words, std::size_t count, int width);
+    
+    void Append(int token);
+    
+    // Copy adopted words into the store's own storage.
+    void Own(void);
+    
+    // Token at a position.
+    int Get(std::size_t index) const {
+        const std::uint64_t bit   = static_cast<std::uint64_t>(index) * static_cast<unsigned int>(mWidth);
+        const std::uint64_t word  = bit >> 6;
+        const unsigned int  shift = static_cast<unsigned int>(bit & 63u);
+        const std::uint64_t field = (mWords[word] >> shift) | ((mWords[word + 1] << 1) << (63u - shift));
+        return static_cast<int>(field & mMask) - 1;
+    }
+    
+    // Decode count tokens starting at first into out.
+    void Decode(std::size_t first, std::size_t count, int* out) const;
+    
+    std::size_t size(void) const;
+    
+    // Bits per token.
+    int GetWidth(void) const;
+    
+    // The packed words, including the padding word after the last field.
+    const std::uint64_t* GetWords(void) const;
+    std::size_t GetWordCount(void) const;
+    
+    // Bytes held by the store itself; adopted words are not counted.
+    std::size_t GetMemoryUsage(void) const;
+    
+    // Words needed for count fields of width bits, padding included.
+    static std::size_t WordsFor(std::size_t count, int width);
+
+private:
+    
+    // Repack every token at a larger width.
+    void Widen(int width);
+    
+    // Replace the contents with count tokens packed at this width.
+    void Pack(const int* tokens, std::size_t count, int width);
+    
+    // OR a field value into the store at a bit offset.
+    void Write(std::uint64_t bit, std::uint64_t value);
+    
+    const std::uint64_t*       mWords;
+    std::size_t                mCount;
+    int                        mWidth;
+    std::uint64_t              mMask;
+    std::vector<std::uint64_t> mStore;
+
+};
+
+#endif
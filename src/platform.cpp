@@ -2,6 +2,14 @@
 
 #include <conio.h>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
@@ -42,6 +50,73 @@ bool FileExists(const std::string& filename) {
     return stream.is_open();
 }
 
+bool FileMapRead(const std::string& filename, FileMapping& mapping) {
+    FileUnmap(mapping);
+    
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, 
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) 
+        return false;
+    
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0) {
+        CloseHandle(file);
+        return false;
+    }
+    
+    // The mapping keeps the file open, so the file handle can go now.
+    HANDLE view = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (view == NULL) 
+        return false;
+    
+    void* data = MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(view);
+        return false;
+    }
+    
+    mapping.data   = static_cast<const unsigned char*>(data);
+    mapping.size   = static_cast<std::size_t>(fileSize.QuadPart);
+    mapping.handle = view;
+#else
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0) 
+        return false;
+    
+    struct stat st;
+    if (fstat(file, &st) != 0 || st.st_size <= 0) {
+        close(file);
+        return false;
+    }
+    
+    void* data = mmap(NULL, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) 
+        return false;
+    
+    mapping.data = static_cast<const unsigned char*>(data);
+    mapping.size = static_cast<std::size_t>(st.st_size);
+#endif
+    return true;
+}
+
+void FileUnmap(FileMapping& mapping) {
+    if (mapping.data == NULL) 
+        return;
+    
+#ifdef _WIN32
+    UnmapViewOfFile(mapping.data);
+    CloseHandle(static_cast<HANDLE>(mapping.handle));
+#else
+    munmap(const_cast<unsigned char*>(mapping.data), mapping.size);
+#endif
+    mapping.data   = NULL;
+    mapping.size   = 0;
+    mapping.handle = NULL;
+}
+
 bool DirectoryExists(const std::string& path) {
     struct stat st;
     if (stat(path.c_str(), &st) != 0)
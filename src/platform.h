@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <cstddef>
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -17,6 +18,23 @@ bool FileTextLoad(const std::string& filename, std::string& out);
 
 bool FileExists(const std::string& filename);
 
+// Read-only memory map of a whole file. Pages are loaded on first touch and
+// shared with every other process mapping the same file.
+struct FileMapping {
+    const unsigned char* data;
+    std::size_t          size;
+    void*                handle; // mapping object on Windows, unused elsewhere
+    
+    FileMapping() : 
+        data(NULL),
+        size(0),
+        handle(NULL) {}
+};
+
+bool FileMapRead(const std::string& filename, FileMapping& mapping);
+
+void FileUnmap(FileMapping& mapping);
+
 bool DirectoryExists(const std::string& path);
 
 std::string FloatToString(float value);
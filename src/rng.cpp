@@ -0,0 +1,53 @@
+#include "rng.h"
+
+static inline std::uint64_t RotateLeft(std::uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline std::uint64_t SplitMix64(std::uint64_t& state) {
+    std::uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+RandomGenerator::RandomGenerator() {
+    Seed(0u);
+}
+
+RandomGenerator::RandomGenerator(std::uint64_t seed) {
+    Seed(seed);
+}
+
+void RandomGenerator::Seed(std::uint64_t seed) {
+    // splitmix64 spreads any seed, including 0, over the whole state.
+    for (int i = 0; i < 4; i++) 
+        mState[i] = SplitMix64(seed);
+}
+
+std::uint64_t RandomGenerator::Next(void) {
+    const std::uint64_t result = RotateLeft(mState[1] * 5u, 7) * 9u;
+    const std::uint64_t t = mState[1] << 17;
+    
+    mState[2] ^= mState[0];
+    mState[3] ^= mState[1];
+    mState[1] ^= mState[2];
+    mState[0] ^= mState[3];
+    mState[2] ^= t;
+    mState[3] = RotateLeft(mState[3], 45);
+    
+    return result;
+}
+
+double RandomGenerator::NextDouble(void) {
+    return static_cast<double>(Next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+std::uint64_t RandomGenerator::NextBelow(std::uint64_t bound) {
+    // Reject the short tail so every value is equally likely.
+    const std::uint64_t limit = (0ull - bound) % bound;
+    std::uint64_t x = Next();
+    while (x < limit) 
+        x = Next();
+    return x % bound;
+}
@@ -0,0 +1,33 @@
+#ifndef _RNG__
+#define _RNG__
+
+#include <cstdint>
+
+// Small, fast 64-bit generator (xoshiro256**) seeded through splitmix64.
+// Each owner keeps its own state, so separate generators never contend
+// the way callers of std::rand() do.
+class RandomGenerator {
+public:
+    
+    RandomGenerator();
+    
+    RandomGenerator(std::uint64_t seed);
+    
+    // Restart the sequence from a seed.
+    void Seed(std::uint64_t seed);
+    
+    // Next raw 64-bit value.
+    std::uint64_t Next(void);
+    
+    // Uniform double in [0, 1) with full 53-bit resolution.
+    double NextDouble(void);
+    
+    // Uniform integer in [0, bound); bound must be non-zero.
+    std::uint64_t NextBelow(std::uint64_t bound);
+    
+private:
+    
+    std::uint64_t mState[4];
+};
+
+#endif
@@ -1,4 +1,3 @@
-#include <unordered_map>
 #include <vector>
 #include <cmath>
 #include <cstdlib>
@@ -6,8 +5,27 @@
 #include <algorithm>
 
 #include "sampler.h"
+#include "kernels.h"
 
-SamplerSystem::SamplerSystem() {}
+// Nearest tokens to the context added to the pool when matching fails.
+static const int FALLBACK_NEIGHBOR_COUNT = 32;
+
+SamplerSystem::SamplerSystem() : 
+    mRunningGeneration(0u),
+    mRunningLast(-1) {}
+
+void SamplerSystem::SetSeed(std::uint64_t seed) {
+    mRandom.Seed(seed);
+}
+
+void SamplerSystem::ReserveVocabulary(std::size_t tokenCount) {
+    mLockedScores.Reserve(tokenCount);
+    mAllScores.Reserve(tokenCount);
+    mTokens.reserve(tokenCount);
+    mWeights.reserve(tokenCount);
+    mCumulative.reserve(tokenCount);
+    mOrder.reserve(tokenCount);
+}
 
 int SamplerSystem::GetSentenceStart(int contextSize, int maxSentenceLen) const {
     int sentenceStart = 0;
@@ -17,33 +35,47 @@ int SamplerSystem::GetSentenceStart(int contextSize, int maxSentenceLen) const {
     return sentenceStart;
 }
 
-void SamplerSystem::ComputeSpanBestMatches(
+void SamplerSystem::ScanSpan(
     const std::vector<int>& context,
     int sentenceStart,
     int maxSentenceLen,
-    const std::vector<std::vector<int>>& focus,
-    std::vector<int>& spanBestLen,
+    SpanView span,
+    int spanIndex,
+    unsigned int count,
+    ScoreAccumulator& lockedScores,
+    ScoreAccumulator& allScores,
     int& globalBestLen,
     int& globalBestSpan) const
 {
+    const int spanSize = static_cast<int>(span.size());
+    if (spanSize < 2) {
+        return; // must have at least "token + nextToken"
+    }
+
     const int contextSize = static_cast<int>(context.size());
-    spanBestLen.assign(focus.size(), 0);
-    globalBestLen  = 0;
-    globalBestSpan = -1;
+    const int lastToken   = context[static_cast<std::size_t>(contextSize - 1)];
 
-    for (std::size_t s = 0; s < focus.size(); ++s) {
-        const std::vector<int>& span = focus[s];
-        const int spanSize = static_cast<int>(span.size());
-        if (spanSize < 2) {
-            continue; // must have at least "token + nextToken"
+    // Long spans are searched a block at a time so the hit list fits on
+    // the stack.
+    const int blockSize = 256;
+    int hits[blockSize];
+
+    for (int block = 0; block < spanSize - 1; block += blockSize) {
+        int blockEnd = block + blockSize;
+        if (blockEnd > spanSize - 1) {
+            blockEnd = spanSize - 1;
         }
 
-        int bestForThisSpan = 0;
+        // Only positions holding the last context token can match, so
+        // find those first and extend each one backwards.
+        int hitCount = KernelFindToken(&span[static_cast<std::size_t>(block)],
+                                       blockEnd - block, lastToken, hits);
 
-        for (int i = 0; i < spanSize - 1; ++i) {
-            int spanIdx  = i;
-            int ctxIdx   = contextSize - 1;
-            int matchLen = 0;
+        for (int h = 0; h < hitCount; ++h) {
+            int i        = block + hits[h];
+            int spanIdx  = i - 1;
+            int ctxIdx   = contextSize - 2;
+            int matchLen = 1;
 
             while (spanIdx >= 0 &&
                    ctxIdx >= sentenceStart &&
@@ -55,111 +87,169 @@ void SamplerSystem::ComputeSpanBestMatches(
                 --ctxIdx;
             }
 
-            if (matchLen > bestForThisSpan) {
-                bestForThisSpan = matchLen;
-            }
-        }
+            int nextToken = span[i + 1];
 
-        spanBestLen[s] = bestForThisSpan;
+            // Quadratically emphasize longer matches:
+            double weight = 1.0 + static_cast<double>(matchLen) *
+                                     static_cast<double>(matchLen);
 
-        if (bestForThisSpan > globalBestLen) {
-            globalBestLen  = bestForThisSpan;
-            globalBestSpan = static_cast<int>(s);
+            // All matches contribute to the "looser" pool, once per
+            // occurrence of the span:
+            allScores.Add(nextToken, weight * static_cast<double>(count));
+
+            // A longer match restarts the "locked" pool on this span. Only
+            // that span at the best length keeps contributing to it, and
+            // its repeats would not have.
+            if (matchLen > globalBestLen) {
+                globalBestLen  = matchLen;
+                globalBestSpan = spanIndex;
+                lockedScores.Clear();
+            }
+            if (spanIndex == globalBestSpan &&
+                matchLen == globalBestLen) {
+                lockedScores.Add(nextToken, weight);
+            }
         }
     }
 }
 
-void SamplerSystem::BuildScoreMaps(
+void SamplerSystem::ScanFocusRange(
     const std::vector<int>& context,
     int sentenceStart,
     int maxSentenceLen,
-    const std::vector<std::vector<int>>& focus,
-    const std::vector<int>& spanBestLen,
-    int globalBestLen,
-    int globalBestSpan,
-    std::unordered_map<int, double>& lockedScores,
-    std::unordered_map<int, double>& allScores) const
+    const FocusList& focus,
+    std::size_t first,
+    std::size_t last,
+    ScoreAccumulator& lockedScores,
+    ScoreAccumulator& allScores,
+    int& globalBestLen) const
 {
-    lockedScores.clear();
-    allScores.clear();
+    lockedScores.Clear();
+    allScores.Clear();
+    globalBestLen = 0;
 
-    if (globalBestLen <= 0 || globalBestSpan < 0) {
-        return;
+    // First span to reach the current best length; only it feeds the
+    // locked pool.
+    int globalBestSpan = -1;
+
+    // Packed spans are decoded one at a time into this buffer and scanned
+    // while they are still in cache.
+    std::vector<int> buffer;
+    for (std::size_t s = first; s < last; ++s) {
+        ScanSpan(context,
+                 sentenceStart,
+                 maxSentenceLen,
+                 focus.GetSpan(s, buffer),
+                 static_cast<int>(s),
+                 focus.GetOccurrences(s),
+                 lockedScores,
+                 allScores,
+                 globalBestLen,
+                 globalBestSpan);
     }
+}
 
-    const int contextSize = static_cast<int>(context.size());
+void SamplerSystem::BuildScoreMaps(
+    const std::vector<int>& context,
+    int sentenceStart,
+    int maxSentenceLen,
+    const FocusList& focus,
+    const SamplerParameters& params,
+    ScoreAccumulator& lockedScores,
+    ScoreAccumulator& allScores,
+    int& globalBestLen)
+{
+    // Small focus lists are not worth waking the pool for.
+    const std::size_t minSpansPerThread = 256;
 
-    for (std::size_t s = 0; s < focus.size(); ++s) {
-        const std::vector<int>& span = focus[s];
-        const int spanSize = static_cast<int>(span.size());
-        if (spanSize < 2) {
-            continue;
-        }
+    unsigned int threadCount = params.threadCount;
+    if (threadCount < 1u) {
+        threadCount = 1u;
+    }
+    if (focus.size() < minSpansPerThread * threadCount) {
+        threadCount = static_cast<unsigned int>(focus.size() / minSpansPerThread);
+    }
 
-        for (int i = 0; i < spanSize - 1; ++i) {
-            int spanIdx  = i;
-            int ctxIdx   = contextSize - 1;
-            int matchLen = 0;
+    if (threadCount <= 1u) {
+        ScanFocusRange(context, sentenceStart, maxSentenceLen, focus,
+                       0, focus.size(), lockedScores, allScores, globalBestLen);
+        return;
+    }
 
-            while (spanIdx >= 0 &&
-                   ctxIdx >= sentenceStart &&
-                   matchLen < maxSentenceLen &&
-                   span[static_cast<std::size_t>(spanIdx)] ==
-                   context[static_cast<std::size_t>(ctxIdx)]) {
-                ++matchLen;
-                --spanIdx;
-                --ctxIdx;
-            }
+    mPool.SetThreadCount(params.threadCount);
+    if (mScanStates.size() < threadCount) {
+        mScanStates.resize(threadCount);
+    }
 
-            if (matchLen <= 0) {
-                continue;
-            }
+    // One contiguous run of spans per thread, so concatenating the chunks
+    // in order reproduces the serial scan order.
+    const std::size_t chunkSize = (focus.size() + threadCount - 1) / threadCount;
+    std::vector<SamplerScanState>& states = mScanStates;
 
-            int nextToken = span[i + 1];
+    mPool.Run(threadCount, [&](unsigned int chunk) {
+        std::size_t first = chunk * chunkSize;
+        std::size_t last  = first + chunkSize;
+        if (last > focus.size()) {
+            last = focus.size();
+        }
+        SamplerScanState& state = states[chunk];
+        ScanFocusRange(context, sentenceStart, maxSentenceLen, focus,
+                       first, last, state.lockedScores, state.allScores,
+                       state.bestLen);
+    });
+
+    // Merge in chunk order. Weights are small whole numbers, so the sums
+    // are exact and first-touch order matches the serial scan.
+    lockedScores.Clear();
+    allScores.Clear();
+    globalBestLen = 0;
 
-            // Quadratically emphasize longer matches:
-            double weight = 1.0 + static_cast<double>(matchLen) *
-                                     static_cast<double>(matchLen);
+    unsigned int bestChunk = 0;
+    for (unsigned int chunk = 0; chunk < threadCount; ++chunk) {
+        const SamplerScanState& state = states[chunk];
+        for (std::size_t i = 0; i < state.allScores.size(); ++i) {
+            allScores.Add(state.allScores.GetToken(i), state.allScores.GetScore(i));
+        }
 
-            // All matches contribute to the "looser" pool:
-            allScores[nextToken] += weight;
+        // The earliest chunk with the longest match owns the locked pool.
+        if (state.bestLen > globalBestLen) {
+            globalBestLen = state.bestLen;
+            bestChunk     = chunk;
+        }
+    }
 
-            // Only the best span at the global best match length
-            // contributes to the "locked" pool:
-            if (static_cast<int>(s) == globalBestSpan &&
-                matchLen == globalBestLen) {
-                lockedScores[nextToken] += weight;
-            }
+    if (globalBestLen > 0) {
+        const ScoreAccumulator& locked = states[bestChunk].lockedScores;
+        for (std::size_t i = 0; i < locked.size(); ++i) {
+            lockedScores.Add(locked.GetToken(i), locked.GetScore(i));
         }
     }
 }
 
 void SamplerSystem::FallbackToFrequencyScores(
-    const std::vector<std::vector<int>>& focus,
-    std::unordered_map<int, double>& allScores,
-    int& globalBestLen) const
+    const std::vector<int>& context,
+    const FocusList& focus,
+    ScoreAccumulator& allScores,
+    int& globalBestLen)
 {
     if (!allScores.empty()) {
         return;
     }
 
-    std::unordered_map<int, int> freq;
-
+    // Each occurrence counts once; the accumulator is the frequency table.
+    std::vector<int> buffer;
     for (std::size_t s = 0; s < focus.size(); ++s) {
-        const std::vector<int>& span = focus[s];
+        SpanView span  = focus.GetSpan(s, buffer);
+        double   count = static_cast<double>(focus.GetOccurrences(s));
         for (std::size_t i = 0; i < span.size(); ++i) {
-            ++freq[span[i]];
+            allScores.Add(span[i], count);
         }
     }
 
-    if (freq.empty()) {
-        return;
-    }
+    AddNeighborScores(context, allScores);
 
-    allScores.clear();
-    for (std::unordered_map<int, int>::const_iterator it = freq.begin();
-         it != freq.end(); ++it) {
-        allScores[it->first] = static_cast<double>(it->second);
+    if (allScores.empty()) {
+        return;
     }
 
     // In this fallback case, treat as very weak match.
@@ -168,8 +258,8 @@ void SamplerSystem::FallbackToFrequencyScores(
 
 void SamplerSystem::ChooseScoreSource(
     int globalBestLen,
-    const std::unordered_map<int, double>& lockedScores,
-    const std::unordered_map<int, double>& allScores,
+    const ScoreAccumulator& lockedScores,
+    const ScoreAccumulator& allScores,
     const SamplerParameters& params,
     bool& useLockedScores,
     float& effectiveTemp) const
@@ -202,12 +292,12 @@ void SamplerSystem::ChooseScoreSource(
 
 void SamplerSystem::BuildTokenDistribution(
     const std::vector<int>& context,
-    const std::unordered_map<int, double>& baseScores,
+    const ScoreAccumulator& baseScores,
     const SamplerParameters& params,
     float effectiveTemp,
     std::vector<int>& tokens,
     std::vector<double>& weights,
-    double& totalWeight) const
+    double& totalWeight)
 {
     tokens.clear();
     weights.clear();
@@ -226,9 +316,8 @@ void SamplerSystem::BuildTokenDistribution(
     // 1) Find max base score (for normalization).
     // -------------------------------------------------------------------------
     double maxBase = 0.0;
-    std::unordered_map<int, double>::const_iterator itBase;
-    for (itBase = baseScores.begin(); itBase != baseScores.end(); ++itBase) {
-        double baseVal = itBase->second;
+    for (std::size_t i = 0; i < baseScores.size(); ++i) {
+        double baseVal = baseScores.GetScore(i);
         if (baseVal > maxBase) {
             maxBase = baseVal;
         }
@@ -236,9 +325,8 @@ void SamplerSystem::BuildTokenDistribution(
 
     // If we somehow have no positive base scores, fall back to uniform.
     if (maxBase <= 0.0) {
-        for (std::unordered_map<int, double>::const_iterator it = baseScores.begin();
-             it != baseScores.end(); ++it) {
-            tokens.push_back(it->first);
+        for (std::size_t i = 0; i < baseScores.size(); ++i) {
+            tokens.push_back(baseScores.GetToken(i));
             weights.push_back(1.0);
             totalWeight += 1.0;
         }
@@ -280,12 +368,14 @@ void SamplerSystem::BuildTokenDistribution(
     // -------------------------------------------------------------------------
     // 3) Precompute max attention score for normalization (if attention is used).
     // -------------------------------------------------------------------------
+    // Every candidate's attention score comes from one sweep of the context.
     float maxAttRaw = 0.0f;
     if (wAtt > 0.0) {
-        std::unordered_map<int, double>::const_iterator it;
-        for (it = baseScores.begin(); it != baseScores.end(); ++it) {
-            int token = it->first;
-            float attScore = attention.GetScore(context, token);
+        attention.GetScores(context, params.attentionHorizon, mAttentionScores);
+
+        for (std::size_t i = 0; i < baseScores.size(); ++i) {
+            int token = baseScores.GetToken(i);
+            float attScore = mAttentionScores.Get(token);
             if (attScore > maxAttRaw) {
                 maxAttRaw = attScore;
             }
@@ -294,90 +384,54 @@ void SamplerSystem::BuildTokenDistribution(
 
     // -------------------------------------------------------------------------
     // 4) Build a context embedding (average of context token embeddings).
+    //    The running sum is only rebuilt when the caller let it fall out of
+    //    step with the context; otherwise it is already up to date.
     // -------------------------------------------------------------------------
     bool haveContextEmbedding = false;
-    Embedding contextEmbedding;
+    Embedding& contextEmbedding = mContextEmbedding;
 
     if (wEmb > 0.0 && embedding.size() > 0 && !context.empty()) {
-        // Zero-init
-        for (int d = 0; d < EMBEDDING_WIDTH; ++d) {
-            contextEmbedding.v[d] = 0.0f;
-        }
-
-        int usedCount = 0;
-        std::size_t i;
-        for (i = 0; i < context.size(); ++i) {
-            int ctxToken = context[i];
-            const Embedding* ctxEmb = embedding.GetEmbeddingPtr(ctxToken);
-            if (ctxEmb == NULL) {
-                continue;
-            }
-            ++usedCount;
-            for (int d = 0; d < EMBEDDING_WIDTH; ++d) {
-                contextEmbedding.v[d] += ctxEmb->v[d];
-            }
-        }
-
-        if (usedCount > 0) {
-            float invCount = 1.0f / static_cast<float>(usedCount);
-            for (int d = 0; d < EMBEDDING_WIDTH; ++d) {
-                contextEmbedding.v[d] *= invCount;
-            }
-
-            // Normalize context embedding to unit length.
-            float norm = 0.0f;
-            for (int d = 0; d < EMBEDDING_WIDTH; ++d) {
-                float val = contextEmbedding.v[d];
-                norm += val * val;
-            }
-
-            if (norm > 0.0f) {
-                norm = std::sqrt(norm);
-                float invNorm = 1.0f / norm;
-                for (int d = 0; d < EMBEDDING_WIDTH; ++d) {
-                    contextEmbedding.v[d] *= invNorm;
-                }
-                haveContextEmbedding = true;
-            }
-        }
+        haveContextEmbedding = GetContextSum(context).GetNormalized(contextEmbedding);
     }
 
     // -------------------------------------------------------------------------
-    // 5) Precompute embedding similarities range (min / max) for normalization.
-    //    We use cosine similarity between contextEmbedding and token embedding.
+    // 5) Cosine similarity between contextEmbedding and every candidate's
+    //    embedding, computed once in a single batched call, plus its
+    //    range (min / max) for normalization. Token norms come from the
+    //    embedding system's cache; candidates without an embedding get a
+    //    norm of zero and are left out of the range.
     // -------------------------------------------------------------------------
     double minEmbRaw = 0.0;
     double maxEmbRaw = 0.0;
     bool haveEmbRange = false;
 
+    std::vector<int>&   embTokens     = mEmbTokens;
+    std::vector<float>& embNorms      = mEmbNorms;
+    std::vector<float>& embSimilarity = mEmbSimilarity;
+
     if (wEmb > 0.0 && haveContextEmbedding) {
-        std::unordered_map<int, double>::const_iterator it;
-        for (it = baseScores.begin(); it != baseScores.end(); ++it) {
-            int token = it->first;
-            const Embedding* tokenEmb = embedding.GetEmbeddingPtr(token);
-            if (tokenEmb == NULL) {
-                continue;
-            }
+        const std::size_t candidateCount = baseScores.size();
+        embTokens.resize(candidateCount);
+        embNorms.resize(candidateCount);
+        embSimilarity.resize(candidateCount);
 
-            float dot = 0.0f;
-            float normToken = 0.0f;
-            int d;
-            for (d = 0; d < EMBEDDING_WIDTH; ++d) {
-                float tv = tokenEmb->v[d];
-                dot       += contextEmbedding.v[d] * tv;
-                normToken += tv * tv;
-            }
+        for (std::size_t i = 0; i < candidateCount; ++i) {
+            embTokens[i] = baseScores.GetToken(i);
+        }
 
-            if (normToken <= 0.0f) {
-                continue;
-            }
+        // contextEmbedding is already unit length.
+        embedding.CosineBatch(contextEmbedding.v.data(),
+                              embTokens.data(),
+                              static_cast<int>(candidateCount),
+                              embNorms.data(),
+                              embSimilarity.data());
 
-            float tokenNorm = std::sqrt(normToken);
-            if (tokenNorm <= 0.0f) {
+        for (std::size_t i = 0; i < candidateCount; ++i) {
+            if (embNorms[i] <= 0.0f) {
                 continue;
             }
 
-            float sim = dot / tokenNorm; // contextEmbedding is already unit length
+            float sim = embSimilarity[i];
 
             if (!haveEmbRange) {
                 minEmbRaw = sim;
@@ -397,10 +451,9 @@ void SamplerSystem::BuildTokenDistribution(
     // -------------------------------------------------------------------------
     // 6) Build final distribution over tokens.
     // -------------------------------------------------------------------------
-    std::unordered_map<int, double>::const_iterator it;
-    for (it = baseScores.begin(); it != baseScores.end(); ++it) {
-        int token = it->first;
-        double baseVal = it->second;
+    for (std::size_t i = 0; i < baseScores.size(); ++i) {
+        int token = baseScores.GetToken(i);
+        double baseVal = baseScores.GetScore(i);
 
         if (baseVal <= 0.0) {
             continue;
@@ -418,7 +471,7 @@ void SamplerSystem::BuildTokenDistribution(
         // Attention normalized to [0, 1].
         double attNorm = 0.0;
         if (wAtt > 0.0 && maxAttRaw > 0.0f) {
-            float attScore = attention.GetScore(context, token);
+            float attScore = mAttentionScores.Get(token);
             if (attScore < 0.0f) {
                 attScore = 0.0f;
             }
@@ -436,32 +489,14 @@ void SamplerSystem::BuildTokenDistribution(
         double embNorm = 0.0;
         if (wEmb > 0.0 && haveContextEmbedding && haveEmbRange &&
             (maxEmbRaw > minEmbRaw)) {
-
-            const Embedding* tokenEmb = embedding.GetEmbeddingPtr(token);
-            if (tokenEmb != NULL) {
-                float dot = 0.0f;
-                float normToken = 0.0f;
-                int d;
-                for (d = 0; d < EMBEDDING_WIDTH; ++d) {
-                    float tv = tokenEmb->v[d];
-                    dot       += contextEmbedding.v[d] * tv;
-                    normToken += tv * tv;
+            if (embNorms[i] > 0.0f) {
+                double simD = static_cast<double>(embSimilarity[i]);
+                embNorm = (simD - minEmbRaw) / (maxEmbRaw - minEmbRaw);
+                if (embNorm < 0.0) {
+                    embNorm = 0.0;
                 }
-
-                if (normToken > 0.0f) {
-                    float tokenNorm = std::sqrt(normToken);
-                    if (tokenNorm > 0.0f) {
-                        float sim = dot / tokenNorm;
-
-                        double simD = static_cast<double>(sim);
-                        embNorm = (simD - minEmbRaw) / (maxEmbRaw - minEmbRaw);
-                        if (embNorm < 0.0) {
-                            embNorm = 0.0;
-                        }
-                        if (embNorm > 1.0) {
-                            embNorm = 1.0;
-                        }
-                    }
+                if (embNorm > 1.0) {
+                    embNorm = 1.0;
                 }
             }
         }
@@ -495,8 +530,8 @@ void SamplerSystem::BuildTokenDistribution(
         weights.clear();
         totalWeight = 0.0;
 
-        for (it = baseScores.begin(); it != baseScores.end(); ++it) {
-            tokens.push_back(it->first);
+        for (std::size_t i = 0; i < baseScores.size(); ++i) {
+            tokens.push_back(baseScores.GetToken(i));
             weights.push_back(1.0);
             totalWeight += 1.0;
         }
@@ -510,81 +545,208 @@ void SamplerSystem::BuildTokenDistribution(
 int SamplerSystem::SampleFromDistribution(
     const std::vector<int>& tokens,
     const std::vector<double>& weights,
-    double totalWeight) const
+    double totalWeight)
 {
     if (tokens.empty()) {
         return -1;
     }
 
     if (totalWeight <= 0.0) {
-        int idx = std::rand() % static_cast<int>(tokens.size());
+        std::uint64_t idx = mRandom.NextBelow(tokens.size());
         return tokens[static_cast<std::size_t>(idx)];
     }
 
-    double r = static_cast<double>(std::rand()) /
-               static_cast<double>(RAND_MAX);
-    double target = r * totalWeight;
+    // Running totals let us binary search for the target instead of
+    // walking the candidates.
+    std::vector<double>& cumulative = mCumulative;
+    cumulative.resize(weights.size());
 
     double accum = 0.0;
-    for (std::size_t i = 0; i < tokens.size(); ++i) {
+    for (std::size_t i = 0; i < weights.size(); ++i) {
         accum += weights[i];
-        if (accum >= target) {
-            return tokens[i];
-        }
+        cumulative[i] = accum;
     }
 
-    return tokens.back();
+    double target = mRandom.NextDouble() * accum;
+
+    std::vector<double>::const_iterator it =
+        std::upper_bound(cumulative.begin(), cumulative.end(), target);
+    if (it == cumulative.end()) {
+        return tokens.back();
+    }
+    return tokens[static_cast<std::size_t>(it - cumulative.begin())];
 }
 
 // -----------------------------------------------------------------------------
-// Main sampler entry point
+// Index lookup
 // -----------------------------------------------------------------------------
 
-int SamplerSystem::SampleNextToken(std::vector<int>& context,
-                                   std::vector<std::vector<int>>& focus,
-                                   SamplerParameters& params) {
-    // Basic sanity checks (unchanged)
-    if (context.empty()) {
-        return -2; // context empty
+void SamplerSystem::BuildIndexScoreMaps(
+    const std::vector<int>& context,
+    int sentenceStart,
+    int maxSentenceLen,
+    const SuffixIndex& index,
+    ScoreAccumulator& lockedScores,
+    ScoreAccumulator& allScores,
+    int& globalBestLen) const
+{
+    lockedScores.Clear();
+    allScores.Clear();
+
+    SuffixMatch match;
+    index.Find(context, sentenceStart, maxSentenceLen, match);
+
+    globalBestLen = match.length;
+    if (globalBestLen <= 0) {
+        return;
     }
-    if (focus.empty()) {
-        return -3; // focus empty
+
+    // The locked pool belongs to the first span reaching the best length,
+    // the same span the focus scan would have picked. Spans are laid out in
+    // order, so that is the span of the lowest matching position.
+    const std::uint32_t* positions = index.GetSuffixData();
+    unsigned int firstRank = match.begin[globalBestLen];
+    for (unsigned int r = match.begin[globalBestLen];
+         r < match.end[globalBestLen]; ++r) {
+        if (positions[r] < positions[firstRank]) {
+            firstRank = r;
+        }
+    }
+    std::uint32_t spanBegin;
+    std::uint32_t spanEnd;
+    index.GetSpanRange(index.GetSpan(firstRank), spanBegin, spanEnd);
+
+    for (int len = globalBestLen; len > 0; --len) {
+        // Quadratically emphasize longer matches:
+        double weight = 1.0 + static_cast<double>(len) *
+                                 static_cast<double>(len);
+
+        // Ranks matching exactly len tokens sit on either side of the
+        // deeper range. Each counts once per occurrence of its span.
+        for (unsigned int r = match.begin[len]; r < match.begin[len + 1]; ++r) {
+            allScores.Add(index.GetNextToken(r), weight * index.GetCount(r));
+        }
+        for (unsigned int r = match.end[len + 1]; r < match.end[len]; ++r) {
+            allScores.Add(index.GetNextToken(r), weight * index.GetCount(r));
+        }
     }
 
-    const int contextSize     = static_cast<int>(context.size());
-    const int maxSentenceLen  = 32;
-    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
+    for (unsigned int r = match.begin[globalBestLen];
+         r < match.end[globalBestLen]; ++r) {
+        if (positions[r] >= spanBegin && positions[r] < spanEnd) {
+            lockedScores.Add(index.GetNextToken(r),
+                             1.0 + static_cast<double>(globalBestLen) *
+                                   static_cast<double>(globalBestLen));
+        }
+    }
+}
 
-    // PASS 1: best match length per span + global best
-    std::vector<int> spanBestLen;
-    int globalBestLen  = 0;
-    int globalBestSpan = -1;
+void SamplerSystem::FallbackToFrequencyScores(
+    const SuffixIndex& index,
+    ScoreAccumulator& allScores,
+    int& globalBestLen)
+{
+    if (!allScores.empty()) {
+        return;
+    }
 
-    ComputeSpanBestMatches(context,
-                           sentenceStart,
-                           maxSentenceLen,
-                           focus,
-                           spanBestLen,
-                           globalBestLen,
-                           globalBestSpan);
+    const unsigned int tokenLimit = index.GetTokenLimit();
+    for (unsigned int t = 0; t < tokenLimit; ++t) {
+        unsigned int count = index.GetFrequency(static_cast<int>(t));
+        if (count > 0u) {
+            allScores.Add(static_cast<int>(t), static_cast<double>(count));
+        }
+    }
 
-    // PASS 2: build score maps (locked vs all)
-    std::unordered_map<int, double> lockedScores;
-    std::unordered_map<int, double> allScores;
+    // No neighbor search here: every token the model holds is already a
+    // candidate, and similarities below 1 on top of whole counts would not
+    // change the pool.
 
-    BuildScoreMaps(context,
-                   sentenceStart,
-                   maxSentenceLen,
-                   focus,
-                   spanBestLen,
-                   globalBestLen,
-                   globalBestSpan,
-                   lockedScores,
-                   allScores);
+    // In this fallback case, treat as very weak match.
+    globalBestLen = 0;
+}
 
-    // Fallback if no matches at all
-    FallbackToFrequencyScores(focus, allScores, globalBestLen);
+void SamplerSystem::AppendContext(int token)
+{
+    mRunningContext.Append(embedding, token);
+    mRunningGeneration = mRunningContext.GetGeneration();
+    mRunningLast = token;
+}
+
+void SamplerSystem::EvictContext(int token)
+{
+    mRunningContext.Evict(embedding, token);
+    mRunningGeneration = mRunningContext.GetGeneration();
+    if (mRunningContext.size() == 0) {
+        mRunningLast = -1;
+    }
+}
+
+void SamplerSystem::ClearContext(void)
+{
+    mRunningContext.Clear();
+    mRunningGeneration = mRunningContext.GetGeneration();
+    mRunningLast = -1;
+}
+
+const ContextEmbedding& SamplerSystem::GetContextSum(const std::vector<int>& context)
+{
+    const bool inStep = !context.empty() &&
+                        mRunningContext.size() == context.size() &&
+                        mRunningLast == context.back();
 
+    if (inStep && mRunningContext.Matches(embedding, context.size(), mRunningGeneration)) {
+        return mRunningContext;
+    }
+
+    // Still the kept context, but the embeddings changed under it.
+    if (inStep && mRunningContext.GetGeneration() == mRunningGeneration) {
+        mRunningContext.Rebuild(embedding, context);
+        mRunningGeneration = mRunningContext.GetGeneration();
+        return mRunningContext;
+    }
+
+    mBatchContext.Rebuild(embedding, context);
+    return mBatchContext;
+}
+
+void SamplerSystem::AddNeighborScores(
+    const std::vector<int>& context,
+    ScoreAccumulator& allScores)
+{
+    if (embeddingIndex.size() == 0 || context.empty()) {
+        return;
+    }
+
+    // Same running sum the distribution step uses.
+    if (!GetContextSum(context).GetNormalized(mContextEmbedding)) {
+        return;
+    }
+
+    embeddingIndex.Search(embedding,
+                          mContextEmbedding.v.data(),
+                          FALLBACK_NEIGHBOR_COUNT,
+                          mNeighbors);
+
+    for (std::size_t i = 0; i < mNeighbors.size(); ++i) {
+        if (mNeighbors[i].similarity > 0.0f) {
+            allScores.Add(mNeighbors[i].token,
+                          static_cast<double>(mNeighbors[i].similarity));
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Shared tail: score maps -> distribution
+// -----------------------------------------------------------------------------
+
+int SamplerSystem::SampleFromScoreMaps(
+    const std::vector<int>& context,
+    int globalBestLen,
+    const ScoreAccumulator& lockedScores,
+    const ScoreAccumulator& allScores,
+    const SamplerParameters& params)
+{
     if (allScores.empty()) {
         // Nothing to choose from.
         return -1;
@@ -601,13 +763,13 @@ int SamplerSystem::SampleNextToken(std::vector<int>& context,
                       useLockedScores,
                       effectiveTemp);
 
-    const std::unordered_map<int, double>& chosenScores =
+    const ScoreAccumulator& chosenScores =
         useLockedScores ? lockedScores : allScores;
 
     // Build token distribution with attention / (future) embedding
-    std::vector<int>    tokens;
-    std::vector<double> weights;
-    double              totalWeight = 0.0;
+    std::vector<int>&    tokens  = mTokens;
+    std::vector<double>& weights = mWeights;
+    double               totalWeight = 0.0;
 
     BuildTokenDistribution(context,
                            chosenScores,
@@ -621,53 +783,15 @@ int SamplerSystem::SampleNextToken(std::vector<int>& context,
     return SampleFromDistribution(tokens, weights, totalWeight);
 }
 
-
-TokenDistribution SamplerSystem::SampleNextTokenDistribution(std::vector<int>& context,
-                                                             std::vector<std::vector<int>>& focus,
-                                                             SamplerParameters& params, int topk) {
+TokenDistribution SamplerSystem::TopDistributionFromScoreMaps(
+    const std::vector<int>& context,
+    int globalBestLen,
+    const ScoreAccumulator& lockedScores,
+    const ScoreAccumulator& allScores,
+    const SamplerParameters& params,
+    int topk)
+{
     TokenDistribution dist;
-    // Basic sanity checks (unchanged)
-    if (context.empty()) {
-        return dist; // context empty
-    }
-    if (focus.empty()) {
-        return dist; // focus empty
-    }
-    
-    const int contextSize     = static_cast<int>(context.size());
-    const int maxSentenceLen  = 32;
-    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
-
-    // PASS 1: best match length per span + global best
-    std::vector<int> spanBestLen;
-    int globalBestLen  = 0;
-    int globalBestSpan = -1;
-
-    ComputeSpanBestMatches(context,
-                           sentenceStart,
-                           maxSentenceLen,
-                           focus,
-                           spanBestLen,
-                           globalBestLen,
-                           globalBestSpan);
-
-    // PASS 2: build score maps (locked vs all)
-    std::unordered_map<int, double> lockedScores;
-    std::unordered_map<int, double> allScores;
-
-    BuildScoreMaps(context,
-                   sentenceStart,
-                   maxSentenceLen,
-                   focus,
-                   spanBestLen,
-                   globalBestLen,
-                   globalBestSpan,
-                   lockedScores,
-                   allScores);
-
-    // Fallback if no matches at all
-    FallbackToFrequencyScores(focus, allScores, globalBestLen);
-
     if (allScores.empty()) {
         // Nothing to choose from.
         return dist;
@@ -684,13 +808,13 @@ TokenDistribution SamplerSystem::SampleNextTokenDistribution(std::vector<int>& c
                       useLockedScores,
                       effectiveTemp);
 
-    const std::unordered_map<int, double>& chosenScores =
+    const ScoreAccumulator& chosenScores =
         useLockedScores ? lockedScores : allScores;
 
     // Build token distribution with attention / (future) embedding
-    std::vector<int>    tokens;
-    std::vector<double> weights;
-    double              totalWeight = 0.0;
+    std::vector<int>&    tokens  = mTokens;
+    std::vector<double>& weights = mWeights;
+    double               totalWeight = 0.0;
 
     BuildTokenDistribution(context,
                            chosenScores,
@@ -716,48 +840,314 @@ TokenDistribution SamplerSystem::SampleNextTokenDistribution(std::vector<int>& c
         return dist;
     }
 
-    // Normalize to probabilities and pair up with tokens
-    std::vector<std::pair<int, double> > tokenProbs;
-    tokenProbs.reserve(tokens.size());
-    for (std::size_t i = 0; i < tokens.size(); ++i) {
-        double p = weights[i] / totalWeight;
-        if (p > 0.0) {
-            tokenProbs.push_back(std::make_pair(tokens[i], p));
+    if (topk <= 0) {
+        return dist;
+    }
+
+    // Candidate indices with positive weight, heaviest first once ordered.
+    // Ties go to the earlier candidate so the result is deterministic.
+    std::vector<std::size_t>& order = mOrder;
+    order.clear();
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        if (weights[i] > 0.0) {
+            order.push_back(i);
         }
     }
 
-    if (tokenProbs.empty()) {
+    if (order.empty()) {
         return dist;
     }
 
-    // Sort by probability descending
-    std::sort(tokenProbs.begin(),
-              tokenProbs.end(),
-              [](const std::pair<int, double>& a,
-                 const std::pair<int, double>& b) {
-                  return a.second > b.second;
-              });
+    std::size_t limit = order.size();
+    if (limit > static_cast<std::size_t>(topk)) {
+        limit = static_cast<std::size_t>(topk);
+    }
 
-    // Take the top K
-    std::size_t limit = tokenProbs.size();
-    if (limit > topk) {
-        limit = topk;
+    const std::vector<double>& raw = weights;
+    auto heavier = [&raw](std::size_t a, std::size_t b) {
+        if (raw[a] != raw[b]) {
+            return raw[a] > raw[b];
+        }
+        return a < b;
+    };
+
+    // Only the top K are moved to the front and sorted; the tail is never
+    // ordered or normalized.
+    if (limit < order.size()) {
+        std::nth_element(order.begin(), order.begin() + limit, order.end(), heavier);
     }
+    std::sort(order.begin(), order.begin() + limit, heavier);
 
     dist.tokens.reserve(limit);
     dist.weights.reserve(limit);
     for (std::size_t i = 0; i < limit; ++i) {
-        dist.tokens.push_back(tokenProbs[i].first);
-        dist.weights.push_back(tokenProbs[i].second); // already normalized probs
+        dist.tokens.push_back(tokens[order[i]]);
+        dist.weights.push_back(weights[order[i]] / totalWeight);
     }
 
     return dist;
 }
 
+// -----------------------------------------------------------------------------
+// Main sampler entry point
+// -----------------------------------------------------------------------------
+
+int SamplerSystem::SampleNextToken(std::vector<int>& context,
+                                   FocusList& focus,
+                                   SamplerParameters& params) {
+    // Basic sanity checks (unchanged)
+    if (context.empty()) {
+        return -2; // context empty
+    }
+    if (focus.empty()) {
+        return -3; // focus empty
+    }
+
+    const int contextSize     = static_cast<int>(context.size());
+    const int maxSentenceLen  = 32;
+    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
+
+    // Single pass: best match length + score maps (locked vs all)
+    ScoreAccumulator& lockedScores = mLockedScores;
+    ScoreAccumulator& allScores    = mAllScores;
+    int globalBestLen = 0;
+
+    BuildScoreMaps(context,
+                   sentenceStart,
+                   maxSentenceLen,
+                   focus,
+                   params,
+                   lockedScores,
+                   allScores,
+                   globalBestLen);
+
+    // Fallback if no matches at all
+    FallbackToFrequencyScores(context, focus, allScores, globalBestLen);
+
+    return SampleFromScoreMaps(context, globalBestLen, lockedScores, allScores, params);
+}
+
+int SamplerSystem::SampleNextToken(std::vector<int>& context,
+                                   const SuffixIndex& index,
+                                   SamplerParameters& params) {
+    if (context.empty()) {
+        return -2; // context empty
+    }
+    if (index.size() == 0) {
+        return -3; // focus empty
+    }
 
+    const int contextSize     = static_cast<int>(context.size());
+    const int maxSentenceLen  = 32;
+    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
 
+    ScoreAccumulator& lockedScores = mLockedScores;
+    ScoreAccumulator& allScores    = mAllScores;
+    int globalBestLen = 0;
 
+    BuildIndexScoreMaps(context,
+                        sentenceStart,
+                        maxSentenceLen,
+                        index,
+                        lockedScores,
+                        allScores,
+                        globalBestLen);
 
+    // Fallback if no matches at all
+    FallbackToFrequencyScores(index, allScores, globalBestLen);
 
+    return SampleFromScoreMaps(context, globalBestLen, lockedScores, allScores, params);
+}
 
 
+TokenDistribution SamplerSystem::SampleNextTokenDistribution(std::vector<int>& context,
+                                                             FocusList& focus,
+                                                             SamplerParameters& params, int topk) {
+    TokenDistribution dist;
+    // Basic sanity checks (unchanged)
+    if (context.empty()) {
+        return dist; // context empty
+    }
+    if (focus.empty()) {
+        return dist; // focus empty
+    }
+    
+    const int contextSize     = static_cast<int>(context.size());
+    const int maxSentenceLen  = 32;
+    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
+
+    // Single pass: best match length + score maps (locked vs all)
+    ScoreAccumulator& lockedScores = mLockedScores;
+    ScoreAccumulator& allScores    = mAllScores;
+    int globalBestLen = 0;
+
+    BuildScoreMaps(context,
+                   sentenceStart,
+                   maxSentenceLen,
+                   focus,
+                   params,
+                   lockedScores,
+                   allScores,
+                   globalBestLen);
+
+    // Fallback if no matches at all
+    FallbackToFrequencyScores(context, focus, allScores, globalBestLen);
+
+    return TopDistributionFromScoreMaps(context, globalBestLen, lockedScores, allScores, params, topk);
+}
+
+TokenDistribution SamplerSystem::SampleNextTokenDistribution(std::vector<int>& context,
+                                                             const SuffixIndex& index,
+                                                             SamplerParameters& params, int topk) {
+    TokenDistribution dist;
+    if (context.empty()) {
+        return dist; // context empty
+    }
+    if (index.size() == 0) {
+        return dist; // focus empty
+    }
+
+    const int contextSize     = static_cast<int>(context.size());
+    const int maxSentenceLen  = 32;
+    const int sentenceStart   = GetSentenceStart(contextSize, maxSentenceLen);
+
+    ScoreAccumulator& lockedScores = mLockedScores;
+    ScoreAccumulator& allScores    = mAllScores;
+    int globalBestLen = 0;
+
+    BuildIndexScoreMaps(context,
+                        sentenceStart,
+                        maxSentenceLen,
+                        index,
+                        lockedScores,
+                        allScores,
+                        globalBestLen);
+
+    // Fallback if no matches at all
+    FallbackToFrequencyScores(index, allScores, globalBestLen);
+
+    return TopDistributionFromScoreMaps(context, globalBestLen, lockedScores, allScores, params, topk);
+}
+
+// -----------------------------------------------------------------------------
+// Batched entry points
+// -----------------------------------------------------------------------------
+
+void SamplerSystem::BuildBatchScoreMaps(
+    const std::vector<std::vector<int>>& contexts,
+    const FocusList& focus,
+    const SamplerParameters& params)
+{
+    const std::size_t batchSize = contexts.size();
+    if (mBatchStates.size() < batchSize) {
+        mBatchStates.resize(batchSize);
+    }
+
+    std::vector<SamplerScanState>& states = mBatchStates;
+    for (std::size_t b = 0; b < batchSize; ++b) {
+        states[b].lockedScores.Clear();
+        states[b].allScores.Clear();
+        states[b].bestLen  = 0;
+        states[b].bestSpan = -1;
+    }
+
+    const int maxSentenceLen = 32;
+
+    // Each thread owns every threadCount-th context and sweeps the focus
+    // once for all of them, so every span is matched against the whole
+    // group while it is still in cache.
+    unsigned int threadCount = params.threadCount;
+    if (threadCount < 1u) {
+        threadCount = 1u;
+    }
+    if (threadCount > batchSize) {
+        threadCount = static_cast<unsigned int>(batchSize);
+    }
+    mPool.SetThreadCount(params.threadCount);
+
+    mPool.Run(threadCount, [&](unsigned int group) {
+        std::vector<int> buffer;
+        for (std::size_t s = 0; s < focus.size(); ++s) {
+            SpanView     span  = focus.GetSpan(s, buffer);
+            unsigned int count = focus.GetOccurrences(s);
+            for (std::size_t b = group; b < batchSize; b += threadCount) {
+                const std::vector<int>& context = contexts[b];
+                if (context.empty()) {
+                    continue;
+                }
+                const int sentenceStart =
+                    GetSentenceStart(static_cast<int>(context.size()), maxSentenceLen);
+
+                SamplerScanState& state = states[b];
+                ScanSpan(context,
+                         sentenceStart,
+                         maxSentenceLen,
+                         span,
+                         static_cast<int>(s),
+                         count,
+                         state.lockedScores,
+                         state.allScores,
+                         state.bestLen,
+                         state.bestSpan);
+            }
+        }
+    });
+}
+
+std::vector<int> SamplerSystem::SampleNextTokenBatch(std::vector<std::vector<int>>& contexts,
+                                                     FocusList& focus,
+                                                     SamplerParameters& params) {
+    std::vector<int> result(contexts.size(), -3); // focus empty
+    if (focus.empty()) {
+        return result;
+    }
+
+    BuildBatchScoreMaps(contexts, focus, params);
+
+    for (std::size_t b = 0; b < contexts.size(); ++b) {
+        if (contexts[b].empty()) {
+            result[b] = -2; // context empty
+            continue;
+        }
+
+        SamplerScanState& state = mBatchStates[b];
+        FallbackToFrequencyScores(contexts[b], focus, state.allScores, state.bestLen);
+
+        result[b] = SampleFromScoreMaps(contexts[b],
+                                        state.bestLen,
+                                        state.lockedScores,
+                                        state.allScores,
+                                        params);
+    }
+
+    return result;
+}
+
+std::vector<TokenDistribution> SamplerSystem::SampleNextTokenDistributionBatch(std::vector<std::vector<int>>& contexts,
+                                                                               FocusList& focus,
+                                                                               SamplerParameters& params, int topk) {
+    std::vector<TokenDistribution> result(contexts.size());
+    if (focus.empty()) {
+        return result;
+    }
+
+    BuildBatchScoreMaps(contexts, focus, params);
+
+    for (std::size_t b = 0; b < contexts.size(); ++b) {
+        if (contexts[b].empty()) {
+            continue;
+        }
+
+        SamplerScanState& state = mBatchStates[b];
+        FallbackToFrequencyScores(contexts[b], focus, state.allScores, state.bestLen);
+
+        result[b] = TopDistributionFromScoreMaps(contexts[b],
+                                                 state.bestLen,
+                                                 state.lockedScores,
+                                                 state.allScores,
+                                                 params,
+                                                 topk);
+    }
+
+    return result;
+}
@@ -2,9 +2,16 @@
 #define _SAMPLER__
 
 #include "embedding.h"
+#include "embeddingindex.h"
 #include "attention.h"
-#include <unordered_map>
+#include "suffixindex.h"
+#include "spanview.h"
+#include "focus.h"
+#include "accumulator.h"
+#include "workerpool.h"
+#include "rng.h"
 #include <vector>
+#include <cstdint>
 
 struct SamplerParameters {
     
@@ -13,12 +20,31 @@ struct SamplerParameters {
     float attentionRate;   // Strength of attention
     float embeddingRate;   // Strength of embedding
     
+    unsigned int threadCount; // Threads used to scan the focus
+    
+    float attentionHorizon;   // Ignore context anchors whose decay weight is below this (0 = whole context)
+    
     SamplerParameters() : 
         temperatureHigh(1.2f), 
         temperatureLow(0.3f),
         attentionRate(0.1f),
-        embeddingRate(0.3f) {}
+        embeddingRate(0.3f),
+        threadCount(1u),
+        attentionHorizon(0.0f) {}
+    
+};
+
+// Results of scanning part of the focus, or all of it for one context
+// of a batch.
+struct SamplerScanState {
+    ScoreAccumulator lockedScores;
+    ScoreAccumulator allScores;
+    int bestLen;
+    int bestSpan;
     
+    SamplerScanState() : 
+        bestLen(0),
+        bestSpan(-1) {}
 };
 
 struct TokenDistribution {
@@ -33,61 +59,191 @@ public:
     AttentionSystem attention;
     // Token embeddings
     EmbeddingSystem embedding;
+    // Nearest-neighbor graph over the embeddings. When a focus scan finds
+    // nothing, the tokens nearest the context join the fallback candidates.
+    // Sampling through the suffix index, as the REPL does, never uses it.
+    // Left empty it is simply not used; keep it in step with Update().
+    EmbeddingIndex embeddingIndex;
     
     int SampleNextToken(std::vector<int>& context,
-                        std::vector<std::vector<int>>& focus,
+                        FocusList& focus,
                         SamplerParameters& params);
     
+    // Same as above but matches against a suffix index over the whole model
+    // instead of scanning a focus list.
+    int SampleNextToken(std::vector<int>& context,
+                        const SuffixIndex& index,
+                        SamplerParameters& params);
+    
+    // Keep the running context embedding in step with the caller's context,
+    // a token at a time, so each sampling step costs O(width). Only a
+    // context of the same length and last token as the window kept this way
+    // uses it; any other, such as one of a batch, is averaged from scratch.
+    void AppendContext(int token);
+    void EvictContext(int token);
+    void ClearContext(void);
+    
     TokenDistribution SampleNextTokenDistribution(std::vector<int>& context,
-                                                  std::vector<std::vector<int>>& focus,
+                                                  FocusList& focus,
                                                   SamplerParameters& params, int topk);
     
+    TokenDistribution SampleNextTokenDistribution(std::vector<int>& context,
+                                                  const SuffixIndex& index,
+                                                  SamplerParameters& params, int topk);
+    
+    // Score several contexts in one sweep over the focus. Returns one
+    // token (or error code, as above) per context.
+    std::vector<int> SampleNextTokenBatch(std::vector<std::vector<int>>& contexts,
+                                          FocusList& focus,
+                                          SamplerParameters& params);
+    
+    std::vector<TokenDistribution> SampleNextTokenDistributionBatch(std::vector<std::vector<int>>& contexts,
+                                                                    FocusList& focus,
+                                                                    SamplerParameters& params, int topk);
+    
+    // Size the score tables for the whole vocabulary up front.
+    void ReserveVocabulary(std::size_t tokenCount);
+    
+    // Seed the sampler's own random generator.
+    void SetSeed(std::uint64_t seed);
+    
     SamplerSystem();
 
 private:
     // High-level steps of the sampler:
     int  GetSentenceStart(int contextSize, int maxSentenceLen) const;
 
-    void ComputeSpanBestMatches(const std::vector<int>& context,
-                                int sentenceStart,
-                                int maxSentenceLen,
-                                const std::vector<std::vector<int>>& focus,
-                                std::vector<int>& spanBestLen,
-                                int& globalBestLen,
-                                int& globalBestSpan) const;
-
+    // Match every focus position against the context in one pass, filling
+    // both the loose pool and the locked pool of the best span. Splits the
+    // focus across params.threadCount threads.
     void BuildScoreMaps(const std::vector<int>& context,
                         int sentenceStart,
                         int maxSentenceLen,
-                        const std::vector<std::vector<int>>& focus,
-                        const std::vector<int>& spanBestLen,
-                        int globalBestLen,
-                        int globalBestSpan,
-                        std::unordered_map<int, double>& lockedScores,
-                        std::unordered_map<int, double>& allScores) const;
+                        const FocusList& focus,
+                        const SamplerParameters& params,
+                        ScoreAccumulator& lockedScores,
+                        ScoreAccumulator& allScores,
+                        int& globalBestLen);
 
-    void FallbackToFrequencyScores(const std::vector<std::vector<int>>& focus,
-                                   std::unordered_map<int, double>& allScores,
-                                   int& globalBestLen) const;
+    // Match every position of one span, updating the running best. A span
+    // occurring count times adds count times to the looser pool.
+    void ScanSpan(const std::vector<int>& context,
+                  int sentenceStart,
+                  int maxSentenceLen,
+                  SpanView span,
+                  int spanIndex,
+                  unsigned int count,
+                  ScoreAccumulator& lockedScores,
+                  ScoreAccumulator& allScores,
+                  int& globalBestLen,
+                  int& globalBestSpan) const;
+
+    // Serial scan of focus spans [first, last).
+    void ScanFocusRange(const std::vector<int>& context,
+                        int sentenceStart,
+                        int maxSentenceLen,
+                        const FocusList& focus,
+                        std::size_t first,
+                        std::size_t last,
+                        ScoreAccumulator& lockedScores,
+                        ScoreAccumulator& allScores,
+                        int& globalBestLen) const;
+
+    // Fill mBatchStates with one scan result per context.
+    void BuildBatchScoreMaps(const std::vector<std::vector<int>>& contexts,
+                             const FocusList& focus,
+                             const SamplerParameters& params);
+
+    void FallbackToFrequencyScores(const std::vector<int>& context,
+                                   const FocusList& focus,
+                                   ScoreAccumulator& allScores,
+                                   int& globalBestLen);
+
+    void BuildIndexScoreMaps(const std::vector<int>& context,
+                             int sentenceStart,
+                             int maxSentenceLen,
+                             const SuffixIndex& index,
+                             ScoreAccumulator& lockedScores,
+                             ScoreAccumulator& allScores,
+                             int& globalBestLen) const;
+
+    void FallbackToFrequencyScores(const SuffixIndex& index,
+                                   ScoreAccumulator& allScores,
+                                   int& globalBestLen);
+
+    // Add the tokens nearest the context embedding to the fallback pool,
+    // each weighted by its similarity as if it had occurred once.
+    void AddNeighborScores(const std::vector<int>& context,
+                           ScoreAccumulator& allScores);
 
     void ChooseScoreSource(int globalBestLen,
-                           const std::unordered_map<int, double>& lockedScores,
-                           const std::unordered_map<int, double>& allScores,
+                           const ScoreAccumulator& lockedScores,
+                           const ScoreAccumulator& allScores,
                            const SamplerParameters& params,
                            bool& useLockedScores,
                            float& effectiveTemp) const;
 
     void BuildTokenDistribution(const std::vector<int>& context,
-                                const std::unordered_map<int, double>& baseScores,
+                                const ScoreAccumulator& baseScores,
                                 const SamplerParameters& params,
                                 float effectiveTemp,
                                 std::vector<int>& tokens,
                                 std::vector<double>& weights,
-                                double& totalWeight) const;
+                                double& totalWeight);
 
     int  SampleFromDistribution(const std::vector<int>& tokens,
                                 const std::vector<double>& weights,
-                                double totalWeight) const;
+                                double totalWeight);
+
+    // Pick the pool and temperature, then sample / rank from it.
+    int  SampleFromScoreMaps(const std::vector<int>& context,
+                             int globalBestLen,
+                             const ScoreAccumulator& lockedScores,
+                             const ScoreAccumulator& allScores,
+                             const SamplerParameters& params);
+
+    TokenDistribution TopDistributionFromScoreMaps(const std::vector<int>& context,
+                                                   int globalBestLen,
+                                                   const ScoreAccumulator& lockedScores,
+                                                   const ScoreAccumulator& allScores,
+                                                   const SamplerParameters& params,
+                                                   int topk);
+
+    // Scratch reused across calls so sampling does not allocate per token.
+    ScoreAccumulator    mLockedScores;
+    ScoreAccumulator    mAllScores;
+    std::vector<int>    mTokens;
+    std::vector<double> mWeights;
+    std::vector<double> mCumulative;
+    std::vector<std::size_t> mOrder;
+    AttentionScores     mAttentionScores;
+
+    // Running sum for a context, from mRunningContext when it was kept in
+    // step through AppendContext / EvictContext, otherwise rebuilt in
+    // mBatchContext.
+    const ContextEmbedding& GetContextSum(const std::vector<int>& context);
+    ContextEmbedding mRunningContext;
+    unsigned int     mRunningGeneration;  // generation this class left it at
+    int              mRunningLast;        // last token appended, -1 if none
+    ContextEmbedding mBatchContext;
+
+    // Unit-length context embedding, then per-candidate tokens,
+    // norms and cosine similarities.
+    Embedding                 mContextEmbedding;
+    std::vector<int>          mEmbTokens;
+    std::vector<float>        mEmbNorms;
+    std::vector<float>        mEmbSimilarity;
+    std::vector<EmbeddingNeighbor> mNeighbors;
+
+    // Draws for sampling; independent of std::rand().
+    RandomGenerator mRandom;
+
+    // Workers and their scratch for the threaded focus scan.
+    WorkerPool                    mPool;
+    std::vector<SamplerScanState> mScanStates;
+
+    // One scan result per context of the current batch.
+    std::vector<SamplerScanState> mBatchStates;
 };
 
 #endif
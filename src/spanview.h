@@ -0,0 +1,50 @@
+#ifndef _SPAN_VIEW__
+#define _SPAN_VIEW__
+
+#include <vector>
+#include <cstddef>
+
+// Read-only view of one span of tokens stored elsewhere, such as the
+// language model's token arena. Cheap to copy; it stays valid only until
+// the storage behind it grows or is cleared.
+struct SpanView {
+    
+    const int*  data;
+    std::size_t length;
+    
+    SpanView() : 
+        data(NULL),
+        length(0) {}
+    
+    SpanView(const int* tokens, std::size_t count) : 
+        data(tokens),
+        length(count) {}
+    
+    // View of a whole vector, which must outlive the view.
+    SpanView(const std::vector<int>& tokens) : 
+        data(tokens.data()),
+        length(tokens.size()) {}
+    
+    std::size_t size(void) const {
+        return length;
+    }
+    
+    bool empty(void) const {
+        return length == 0;
+    }
+    
+    const int& operator[](std::size_t index) const {
+        return data[index];
+    }
+    
+    const int* begin(void) const {
+        return data;
+    }
+    
+    const int* end(void) const {
+        return data + length;
+    }
+    
+};
+
+#endif
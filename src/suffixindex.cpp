@@ -0,0 +1,357 @@
+#include "suffixindex.h"
+
+#include <algorithm>
+
+// Token readers for the two text layouts, so the sort and the search are
+// written once.
+struct PlainText {
+    const int* text;
+    int operator[](std::size_t pos) const {
+        return text[pos];
+    }
+};
+
+struct PackedText {
+    const PackedTokens* text;
+    int operator[](std::size_t pos) const {
+        return text->Get(pos);
+    }
+};
+
+// The counts, or NULL if every one is 1 so lookups can skip them.
+static const std::uint32_t* NonUnitCounts(const std::uint32_t* counts, std::size_t count) {
+    if (counts != NULL) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (counts[i] != 1u) {
+                return counts;
+            }
+        }
+    }
+    return NULL;
+}
+
+SuffixIndex::SuffixIndex() : 
+    mText(NULL),
+    mPacked(NULL),
+    mTextSize(0),
+    mSpanStart(NULL),
+    mSpanCount(0),
+    mSpanCounts(NULL),
+    mSuffix(NULL),
+    mSuffixCount(0),
+    mFrequency(NULL),
+    mTokenLimit(0) {}
+
+void SuffixIndex::Clear(void) {
+    mText        = NULL;
+    mPacked      = NULL;
+    mTextSize    = 0;
+    mSpanStart   = NULL;
+    mSpanCount   = 0;
+    mSpanCounts  = NULL;
+    mSuffix      = NULL;
+    mSuffixCount = 0;
+    mFrequency   = NULL;
+    mTokenLimit  = 0;
+    mSuffixStore.clear();
+    mFrequencyStore.clear();
+    mRepeats.clear();
+}
+
+void SuffixIndex::Build(const int* text,
+                        std::size_t textSize,
+                        const std::uint32_t* spanStart,
+                        std::size_t spanCount,
+                        const std::uint32_t* spanCounts) {
+    Clear();
+
+    mText      = text;
+    mTextSize  = textSize;
+    mSpanStart  = spanStart;
+    mSpanCount  = spanCount;
+    mSpanCounts = NonUnitCounts(spanCounts, spanCount);
+
+    PlainText reader = {text};
+    BuildFrom(reader);
+    MarkRepeats();
+}
+
+void SuffixIndex::Build(const PackedTokens& text,
+                        const std::uint32_t* spanStart,
+                        std::size_t spanCount,
+                        const std::uint32_t* spanCounts) {
+    Clear();
+
+    mPacked    = &text;
+    mTextSize  = text.size();
+    mSpanStart  = spanStart;
+    mSpanCount  = spanCount;
+    mSpanCounts = NonUnitCounts(spanCounts, spanCount);
+
+    PackedText reader = {&text};
+    BuildFrom(reader);
+    MarkRepeats();
+}
+
+template <class Text>
+void SuffixIndex::BuildFrom(const Text& text) {
+    const std::size_t textSize = mTextSize;
+
+    int maxToken = -1;
+    for (std::size_t i = 0; i < textSize; ++i) {
+        if (text[i] > maxToken) {
+            maxToken = text[i];
+        }
+    }
+    mFrequencyStore.assign(static_cast<std::size_t>(maxToken + 1), 0u);
+    mSuffixStore.reserve(textSize);
+
+    // The k-th separator starts span k.
+    std::size_t  span   = 0;
+    unsigned int weight = 1u;
+    for (std::size_t i = 0; i < textSize; ++i) {
+        if (text[i] < 0) {
+            if (mSpanCounts != NULL) {
+                weight = mSpanCounts[span];
+            }
+            ++span;
+            continue;
+        }
+        mFrequencyStore[static_cast<std::size_t>(text[i])] += weight;
+
+        // Only positions with a next token can be continued.
+        if (i + 1 < textSize && text[i + 1] >= 0) {
+            mSuffixStore.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // Order positions by their left context, read backwards up to the index
+    // depth. The separator sorts before every token. Ties keep text order.
+    std::sort(mSuffixStore.begin(), mSuffixStore.end(),
+              [&text](std::uint32_t a, std::uint32_t b) {
+                  for (int d = 0; d < SUFFIX_INDEX_DEPTH; ++d) {
+                      int ta = text[a - d];
+                      int tb = text[b - d];
+                      if (ta != tb) {
+                          return ta < tb;
+                      }
+                      if (ta < 0) {
+                          break; // both hit a separator
+                      }
+                  }
+                  return a < b;
+              });
+
+    mSuffix      = mSuffixStore.data();
+    mSuffixCount = mSuffixStore.size();
+    mFrequency   = mFrequencyStore.data();
+    mTokenLimit  = mFrequencyStore.size();
+}
+
+void SuffixIndex::Adopt(const int* text,
+                        std::size_t textSize,
+                        const std::uint32_t* spanStart,
+                        std::size_t spanCount,
+                        const std::uint32_t* spanCounts,
+                        const std::uint32_t* suffix,
+                        std::size_t suffixCount,
+                        const std::uint32_t* frequency,
+                        std::size_t tokenLimit,
+                        bool copy) {
+    AdoptArrays(spanStart, spanCount, spanCounts, suffix, suffixCount, frequency, tokenLimit, copy);
+    mText     = text;
+    mTextSize = textSize;
+    MarkRepeats();
+}
+
+void SuffixIndex::Adopt(const PackedTokens& text,
+                        const std::uint32_t* spanStart,
+                        std::size_t spanCount,
+                        const std::uint32_t* spanCounts,
+                        const std::uint32_t* suffix,
+                        std::size_t suffixCount,
+                        const std::uint32_t* frequency,
+                        std::size_t tokenLimit,
+                        bool copy) {
+    AdoptArrays(spanStart, spanCount, spanCounts, suffix, suffixCount, frequency, tokenLimit, copy);
+    mPacked   = &text;
+    mTextSize = text.size();
+    MarkRepeats();
+}
+
+void SuffixIndex::MarkRepeats(void) {
+    mRepeats.clear();
+    if (mSpanCounts == NULL) {
+        return;
+    }
+
+    mRepeats.assign((mTextSize >> 6) + 1, 0u);
+    for (std::size_t s = 0; s < mSpanCount; ++s) {
+        if (mSpanCounts[s] == 1u) {
+            continue;
+        }
+        std::size_t end = s + 1 < mSpanCount ? mSpanStart[s + 1] : mTextSize;
+        for (std::size_t pos = mSpanStart[s]; pos < end; ++pos) {
+            mRepeats[pos >> 6] |= 1ull << (pos & 63u);
+        }
+    }
+}
+
+void SuffixIndex::AdoptArrays(const std::uint32_t* spanStart,
+                              std::size_t spanCount,
+                              const std::uint32_t* spanCounts,
+                              const std::uint32_t* suffix,
+                              std::size_t suffixCount,
+                              const std::uint32_t* frequency,
+                              std::size_t tokenLimit,
+                              bool copy) {
+    // The arrays may be this index's own storage, so copy before clearing.
+    std::vector<std::uint32_t> suffixStore;
+    std::vector<std::uint32_t> frequencyStore;
+    if (copy) {
+        suffixStore.assign(suffix, suffix + suffixCount);
+        frequencyStore.assign(frequency, frequency + tokenLimit);
+    }
+
+    Clear();
+
+    mSpanStart  = spanStart;
+    mSpanCount  = spanCount;
+    mSpanCounts = NonUnitCounts(spanCounts, spanCount);
+
+    if (copy) {
+        mSuffixStore.swap(suffixStore);
+        mFrequencyStore.swap(frequencyStore);
+        suffix    = mSuffixStore.data();
+        frequency = mFrequencyStore.data();
+    }
+
+    mSuffix      = suffix;
+    mSuffixCount = suffixCount;
+    mFrequency   = frequency;
+    mTokenLimit  = tokenLimit;
+}
+
+void SuffixIndex::Find(const std::vector<int>& context,
+                       int sentenceStart,
+                       int maxLength,
+                       SuffixMatch& match) const {
+    match.length   = 0;
+    match.begin[0] = 0;
+    match.end[0]   = static_cast<unsigned int>(mSuffixCount);
+
+    const int contextSize = static_cast<int>(context.size());
+    if (maxLength > SUFFIX_INDEX_DEPTH) {
+        maxLength = SUFFIX_INDEX_DEPTH;
+    }
+    if (maxLength > contextSize - sentenceStart) {
+        maxLength = contextSize - sentenceStart;
+    }
+
+    if (mPacked != NULL) {
+        PackedText reader = {mPacked};
+        FindIn(reader, context, maxLength, match);
+    } else {
+        PlainText reader = {mText};
+        FindIn(reader, context, maxLength, match);
+    }
+}
+
+template <class Text>
+void SuffixIndex::FindIn(const Text& text,
+                         const std::vector<int>& context,
+                         int maxLength,
+                         SuffixMatch& match) const {
+    const int contextSize = static_cast<int>(context.size());
+    unsigned int lo = match.begin[0];
+    unsigned int hi = match.end[0];
+
+    // Every range already shares the first d tokens, so within it the
+    // entries are sorted by the token at depth d alone. A suffix array
+    // adopted from a damaged file may not be, so a position is never read
+    // back past the start of the text; it reads as a separator instead.
+    for (int d = 0; d < maxLength; ++d) {
+        const int token = context[static_cast<std::size_t>(contextSize - 1 - d)];
+        const std::uint32_t depth = static_cast<std::uint32_t>(d);
+
+        const std::uint32_t* first =
+            std::lower_bound(mSuffix + lo, mSuffix + hi, token,
+                             [&text, depth](std::uint32_t pos, int value) {
+                                 return (pos >= depth ? text[pos - depth] : -1) < value;
+                             });
+        const std::uint32_t* last =
+            std::upper_bound(first, mSuffix + hi, token,
+                             [&text, depth](int value, std::uint32_t pos) {
+                                 return value < (pos >= depth ? text[pos - depth] : -1);
+                             });
+
+        if (first == last) {
+            break;
+        }
+
+        lo = static_cast<unsigned int>(first - mSuffix);
+        hi = static_cast<unsigned int>(last  - mSuffix);
+
+        match.length = d + 1;
+        match.begin[d + 1] = lo;
+        match.end[d + 1]   = hi;
+    }
+
+    // Empty range past the deepest match so callers can always subtract k + 1.
+    match.begin[match.length + 1] = lo;
+    match.end[match.length + 1]   = lo;
+}
+
+int SuffixIndex::GetNextToken(unsigned int rank) const {
+    if (mPacked != NULL) {
+        return mPacked->Get(mSuffix[rank] + 1);
+    }
+    return mText[mSuffix[rank] + 1];
+}
+
+unsigned int SuffixIndex::GetSpan(unsigned int rank) const {
+    const std::uint32_t* it =
+        std::upper_bound(mSpanStart, mSpanStart + mSpanCount, mSuffix[rank]);
+    return static_cast<unsigned int>(it - mSpanStart) - 1u;
+}
+
+void SuffixIndex::GetSpanRange(unsigned int span, std::uint32_t& begin, std::uint32_t& end) const {
+    begin = mSpanStart[span];
+    end = (span + 1u < mSpanCount) ? mSpanStart[span + 1u] 
+                                   : static_cast<std::uint32_t>(mTextSize);
+}
+
+unsigned int SuffixIndex::GetCount(unsigned int rank) const {
+    const std::uint32_t pos = mSuffix[rank];
+    if (mRepeats.empty() || (mRepeats[pos >> 6] & (1ull << (pos & 63u))) == 0u) {
+        return 1u;
+    }
+    return mSpanCounts[GetSpan(rank)];
+}
+
+unsigned int SuffixIndex::GetFrequency(int token) const {
+    if (token < 0 || token >= static_cast<int>(mTokenLimit)) {
+        return 0u;
+    }
+    return mFrequency[static_cast<std::size_t>(token)];
+}
+
+unsigned int SuffixIndex::GetTokenLimit(void) const {
+    return static_cast<unsigned int>(mTokenLimit);
+}
+
+std::size_t SuffixIndex::size(void) const {
+    return mSpanCount;
+}
+
+const std::uint32_t* SuffixIndex::GetSuffixData(void) const {
+    return mSuffix;
+}
+
+std::size_t SuffixIndex::GetSuffixCount(void) const {
+    return mSuffixCount;
+}
+
+const std::uint32_t* SuffixIndex::GetFrequencyData(void) const {
+    return mFrequency;
+}
@@ -0,0 +1,169 @@
+#ifndef _SUFFIX_INDEX__
+#define _SUFFIX_INDEX__
+
+// Longest left context the index can match. Suffixes are only ordered up to
+// this many tokens, so it must be at least the sampler's sentence window.
+#define SUFFIX_INDEX_DEPTH  32
+
+#include "packedtokens.h"
+
+#include <vector>
+#include <cstdint>
+
+// Result of a lookup: nested suffix array ranges, one per match length.
+// Ranks in [begin[k], end[k]) match at least k tokens of the context, so the
+// ranks matching exactly k tokens are the ones in range k but not in k + 1.
+struct SuffixMatch {
+    int length; // longest match found, 0 if nothing matched
+
+    unsigned int begin[SUFFIX_INDEX_DEPTH + 2];
+    unsigned int end[SUFFIX_INDEX_DEPTH + 2];
+
+    SuffixMatch() : length(0) {}
+};
+
+// Suffix array over the concatenated spans of a language model. Suffixes are
+// read right-to-left from each position, so every entry is the left context
+// of a position that still has a next token in its span.
+//
+// The index reads the model's text in place: every span preceded by a
+// negative separator, starting with one at position 0. The text may be
+// plain ints or bit-packed. It and the span starts must stay put for as long
+// as the index is used.
+class SuffixIndex {
+public:
+
+    SuffixIndex();
+
+    // Remove all indexed spans.
+    void Clear(void);
+
+    // Rebuild the index over a text laid out as above. spanStart holds the
+    // position of the first token of each of the spanCount spans, and
+    // spanCounts how many times each span occurred, or NULL if every span
+    // occurred once. Frequencies are weighted by those counts.
+    void Build(const int* text,
+               std::size_t textSize,
+               const std::uint32_t* spanStart,
+               std::size_t spanCount,
+               const std::uint32_t* spanCounts);
+
+    void Build(const PackedTokens& text,
+               const std::uint32_t* spanStart,
+               std::size_t spanCount,
+               const std::uint32_t* spanCounts);
+
+    // Use a suffix array and frequency table built earlier over the same
+    // text and span counts, such as ones mapped from a model file, without
+    // copying them. With copy set they are copied into the index's own
+    // storage instead.
+    void Adopt(const int* text,
+               std::size_t textSize,
+               const std::uint32_t* spanStart,
+               std::size_t spanCount,
+               const std::uint32_t* spanCounts,
+               const std::uint32_t* suffix,
+               std::size_t suffixCount,
+               const std::uint32_t* frequency,
+               std::size_t tokenLimit,
+               bool copy);
+
+    void Adopt(const PackedTokens& text,
+               const std::uint32_t* spanStart,
+               std::size_t spanCount,
+               const std::uint32_t* spanCounts,
+               const std::uint32_t* suffix,
+               std::size_t suffixCount,
+               const std::uint32_t* frequency,
+               std::size_t tokenLimit,
+               bool copy);
+
+    // Find all positions whose left context matches the tail of the context,
+    // looking back at most maxLength tokens and never before sentenceStart.
+    // Runs in O(m log n) for a match of m tokens.
+    void Find(const std::vector<int>& context,
+              int sentenceStart,
+              int maxLength,
+              SuffixMatch& match) const;
+
+    // Token that follows the position at this rank.
+    int GetNextToken(unsigned int rank) const;
+
+    // Span containing the position at this rank.
+    unsigned int GetSpan(unsigned int rank) const;
+
+    // Text positions [begin, end) covered by a span. Spans are laid out in
+    // order, so a lower position always means a lower span.
+    void GetSpanRange(unsigned int span, std::uint32_t& begin, std::uint32_t& end) const;
+
+    // Occurrences of the span containing the position at this rank.
+    unsigned int GetCount(unsigned int rank) const;
+
+    // Number of times a token occurs anywhere in the indexed spans.
+    unsigned int GetFrequency(int token) const;
+
+    // One past the largest token id in the indexed spans.
+    unsigned int GetTokenLimit(void) const;
+
+    // Number of indexed spans.
+    std::size_t size(void) const;
+
+    // Sorted text positions and per-token counts, for saving.
+    const std::uint32_t* GetSuffixData(void) const;
+    std::size_t GetSuffixCount(void) const;
+    const std::uint32_t* GetFrequencyData(void) const;
+
+private:
+
+    // Sort the suffixes and count tokens over a text of either layout.
+    template <class Text>
+    void BuildFrom(const Text& text);
+
+    // Narrow the match ranges one context token at a time.
+    template <class Text>
+    void FindIn(const Text& text,
+                const std::vector<int>& context,
+                int maxLength,
+                SuffixMatch& match) const;
+
+    // Set the repeat bits from the span counts, once the text is set.
+    void MarkRepeats(void);
+
+    // Take over or copy the arrays; the caller sets the text.
+    void AdoptArrays(const std::uint32_t* spanStart,
+                     std::size_t spanCount,
+                     const std::uint32_t* spanCounts,
+                     const std::uint32_t* suffix,
+                     std::size_t suffixCount,
+                     const std::uint32_t* frequency,
+                     std::size_t tokenLimit,
+                     bool copy);
+
+    // Exactly one of these is set while the index holds a text.
+    const int*           mText;
+    const PackedTokens*  mPacked;
+    std::size_t          mTextSize;
+    const std::uint32_t* mSpanStart;
+    std::size_t          mSpanCount;
+    const std::uint32_t* mSpanCounts;  // NULL when every span occurs once
+
+    // Text positions sorted by their left context.
+    const std::uint32_t* mSuffix;
+    std::size_t          mSuffixCount;
+
+    // Occurrence count per token id.
+    const std::uint32_t* mFrequency;
+    std::size_t          mTokenLimit;
+
+    // Storage behind mSuffix and mFrequency unless they were adopted.
+    std::vector<std::uint32_t> mSuffixStore;
+    std::vector<std::uint32_t> mFrequencyStore;
+
+    // A bit per text position, set inside spans that occur more than once,
+    // so GetCount only searches for the span of those. Empty while
+    // mSpanCounts is NULL.
+    std::vector<std::uint64_t> mRepeats;
+
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool() : 
+    mJob(NULL),
+    mJobCount(0u),
+    mNextJob(0u),
+    mPending(0u),
+    mBatch(0ul),
+    mStop(false) {}
+
+WorkerPool::~WorkerPool() {
+    Stop();
+}
+
+void WorkerPool::SetThreadCount(unsigned int count) {
+    if (count < 1u) 
+        count = 1u;
+    if (count == GetThreadCount()) 
+        return;
+    
+    Stop();
+    
+    mStop = false;
+    for (unsigned int i = 1; i < count; i++) 
+        mThreads.push_back(std::thread(&WorkerPool::WorkerLoop, this));
+}
+
+unsigned int WorkerPool::GetThreadCount(void) const {
+    return static_cast<unsigned int>(mThreads.size()) + 1u;
+}
+
+void WorkerPool::Run(unsigned int jobCount, const JobFunc& job) {
+    if (jobCount == 0u) 
+        return;
+    
+    if (mThreads.empty()) {
+        for (unsigned int i = 0; i < jobCount; i++) 
+            job(i);
+        return;
+    }
+    
+    std::unique_lock<std::mutex> lock(mMutex);
+    mJob      = &job;
+    mJobCount = jobCount;
+    mNextJob  = 0u;
+    mPending  = jobCount;
+    mBatch++;
+    mWake.notify_all();
+    
+    Drain(lock);
+    
+    while (mPending > 0u) 
+        mDone.wait(lock);
+    mJob = NULL;
+}
+
+void WorkerPool::Drain(std::unique_lock<std::mutex>& lock) {
+    while (mNextJob < mJobCount) {
+        unsigned int index = mNextJob++;
+        const JobFunc& job = *mJob;
+        
+        lock.unlock();
+        job(index);
+        lock.lock();
+        
+        if (--mPending == 0u) 
+            mDone.notify_all();
+    }
+}
+
+void WorkerPool::WorkerLoop(void) {
+    std::unique_lock<std::mutex> lock(mMutex);
+    unsigned long seenBatch = mBatch;
+    
+    while (true) {
+        while (!mStop && seenBatch == mBatch) 
+            mWake.wait(lock);
+        if (mStop) 
+            return;
+        
+        seenBatch = mBatch;
+        Drain(lock);
+    }
+}
+
+void WorkerPool::Stop(void) {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_all();
+    
+    for (std::size_t i = 0; i < mThreads.size(); i++) 
+        mThreads[i].join();
+    mThreads.clear();
+}
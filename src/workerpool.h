@@ -0,0 +1,56 @@
+#ifndef _WORKER_POOL__
+#define _WORKER_POOL__
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Fixed set of worker threads that run numbered jobs. The calling thread
+// takes jobs too, so a pool of N threads starts N - 1 workers.
+class WorkerPool {
+public:
+    
+    typedef std::function<void(unsigned int)> JobFunc;
+    
+    WorkerPool();
+    ~WorkerPool();
+    
+    // Restart the pool with this many threads. 0 or 1 runs every job on
+    // the calling thread.
+    void SetThreadCount(unsigned int count);
+    
+    unsigned int GetThreadCount(void) const;
+    
+    // Call job(i) for every i in [0, jobCount) and wait for all of them.
+    // Jobs are handed out in order but may finish in any order.
+    void Run(unsigned int jobCount, const JobFunc& job);
+    
+private:
+    
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+    
+    void WorkerLoop(void);
+    
+    // Take and run jobs until the current batch is handed out.
+    void Drain(std::unique_lock<std::mutex>& lock);
+    
+    void Stop(void);
+    
+    std::vector<std::thread> mThreads;
+    
+    std::mutex              mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    
+    const JobFunc* mJob;
+    unsigned int   mJobCount;
+    unsigned int   mNextJob;
+    unsigned int   mPending;
+    unsigned long  mBatch;
+    bool           mStop;
+};
+
+#endif